@@ -0,0 +1,494 @@
+#!/usr/bin/env python3
+"""
+Generate C++ structs and a validating loader from Tattle's command schema.
+
+	python3 cmake/generate_config.py schemas/command.json <output dir>
+
+Writes command_config.h and command_config.cpp, which declare namespace tattle::config:
+
+	* A struct for each object with properties, initialized to the schema's defaults.
+	  Arrays with prefixItems become structs whose members are named by the items' titles.
+	  Booleans and numbers without a default are std::optional.  Objects without
+	  properties and oneOf unions are kept as Json, after validation.
+	* Load(json, out, errors, at, warnings) for each struct, which checks the JSON against
+	  the schema and fills in the struct.  Errors read "<JSON pointer>: <problem>".
+	  Properties the schema doesn't allow are ignored and listed in `warnings`, if given,
+	  so configs written for other versions still load.
+
+Supported keywords: type, properties, additionalProperties, required, enum, minimum,
+default, items, prefixItems, oneOf, anyOf (of required lists) and local $refs.
+"""
+
+import json
+import os
+import re
+import sys
+
+
+SCALARS = {
+	"string"  : "std::string",
+	"boolean" : "bool",
+	"integer" : "long long",
+	"number"  : "double",
+}
+
+TYPE_TESTS = {
+	"string"  : "json.is_string()",
+	"boolean" : "json.is_boolean()",
+	"integer" : "json.is_number_integer()",
+	"number"  : "json.is_number()",
+	"object"  : "json.is_object()",
+	"array"   : "json.is_array()",
+}
+
+
+def camel(name):
+	return "".join(part[:1].upper() + part[1:] for part in re.split(r"[^0-9A-Za-z]+", name) if part)
+
+def identifier(name):
+	return re.sub(r"[^0-9A-Za-z_]", "_", name)
+
+def literal(value):
+	if isinstance(value, bool):  return "true" if value else "false"
+	if isinstance(value, str):   return json.dumps(value, ensure_ascii=False)
+	if isinstance(value, int):   return str(value)
+	if isinstance(value, float): return repr(value)
+	if isinstance(value, list):  return "{" + ", ".join(literal(v) for v in value) + "}"
+	raise ValueError("unsupported default: %r" % (value,))
+
+
+class Generator:
+	def __init__(self, schema):
+		self.schema  = schema
+		self.defs    = schema.get("$defs", {})
+		self.structs = []  # (name, schema), dependencies first
+		self.named   = {}  # id(schema) -> struct name
+		self.checks  = []  # (name, schema) for oneOf definitions
+		self.checked = {}
+		self.counter = 0
+
+	# Schema inspection
+
+	def deref(self, s):
+		"""Follow a $ref, letting the referring schema's keywords override the definition's."""
+		if "$ref" not in s: return s, None
+		name = s["$ref"].split("/")[-1]
+		target, _ = self.deref(self.defs[name])
+		merged = dict(target)
+		merged.update({k: v for k, v in s.items() if k != "$ref"})
+		return merged, name
+
+	def kind(self, s):
+		s, _ = self.deref(s)
+		if "oneOf" in s: return "union"
+		t = s.get("type")
+		if t == "object":
+			return "struct" if "properties" in s else "map"
+		if t == "array":
+			return "tuple" if "prefixItems" in s else "list"
+		if t in SCALARS: return "scalar"
+		raise ValueError("unsupported schema: %r" % (s,))
+
+	def types(self, s):
+		"""JSON types a schema accepts."""
+		s, _ = self.deref(s)
+		if "oneOf" in s:
+			return set().union(*(self.types(alt) for alt in s["oneOf"]))
+		t = s["type"]
+		return {"integer", "number"} if t == "number" else {t}
+
+	def struct(self, s, hint):
+		"""Register a struct for an object or tuple schema, and return its name."""
+		original = s
+		s, ref = self.deref(s)
+		key = id(self.defs[ref]) if ref else id(original)
+		if key in self.named: return self.named[key]
+
+		name = camel(ref) if ref else hint
+		if name in (n for n, _ in self.structs) or name in ("Json", "Errors"):
+			raise ValueError("struct name collision: " + name)
+		self.named[key] = name
+
+		# Members' types first, so they are declared before this struct.
+		if "properties" in s:
+			for prop, sub in s["properties"].items():
+				if not prop.startswith("$"): self.cpp_type(sub, name + camel(prop))
+		else:
+			for n, sub in enumerate(s["prefixItems"]):
+				self.cpp_type(sub, name + str(n))
+
+		self.structs.append((name, s))
+		return name
+
+	def check(self, s):
+		"""Register a checker for a oneOf schema, and return its name."""
+		s, ref = self.deref(s)
+		if ref in self.checked: return self.checked[ref]
+		name = "Check" + camel(ref or "union%d" % len(self.checks))
+		if ref: self.checked[ref] = name
+		for n, alt in enumerate(s["oneOf"]): self.cpp_type(alt, self.alternative(name, n, alt))
+		self.checks.append((name, s))
+		return name
+
+	def alternative(self, check, n, alt):
+		"""Name hint for an inline alternative of a oneOf, eg. ReportStringObject."""
+		kinds = self.types(alt)
+		return check[len("Check"):] + (camel(kinds.pop()) if len(kinds) == 1 else "Option%d" % n)
+
+	def cpp_type(self, s, hint):
+		k = self.kind(s)
+		raw = s
+		s, _ = self.deref(s)
+		if k in ("struct", "tuple"): return self.struct(raw, hint)
+		if k == "union":
+			self.check(raw)
+			return "Json"
+		if k == "map":
+			extra = s.get("additionalProperties")
+			if isinstance(extra, dict): self.cpp_type(extra, hint + "Item")
+			return "Json"
+		if k == "list":
+			if self.kind(s.get("items", {"type": "string"})) != "scalar" or self.types(s["items"]) != {"string"}:
+				raise ValueError("only arrays of strings are supported")
+			return "std::vector<std::string>"
+		base = SCALARS[s["type"]]
+		if "default" not in s and s["type"] != "string": return "std::optional<" + base + ">"
+		return base
+
+	# Code generation
+
+	def local(self, prefix):
+		self.counter += 1
+		return "%s%d" % (prefix, self.counter)
+
+	def read(self, s, json_expr, target, at, errors, indent, hint, warnings="warnings"):
+		"""
+		A statement or block which validates json_expr and, if valid, stores it in target.
+			With no target, the value is only validated.
+		"""
+		pad = "\t" * indent
+		k = self.kind(s)
+		raw = s
+		s, ref = self.deref(s)
+
+		if k in ("struct", "tuple"):
+			name = self.struct(raw, hint)
+			if target: return [pad + "Load(%s, %s, %s, %s, %s);" % (json_expr, target, errors, at, warnings)]
+			scratch = self.local("scratch")
+			return [pad + "{",
+				pad + "\t%s %s;" % (name, scratch),
+				pad + "\tLoad(%s, %s, %s, %s, %s);" % (json_expr, scratch, errors, at, warnings),
+				pad + "}"]
+
+		if k == "union":
+			check = "%s(%s, %s, %s, %s)" % (self.check(raw), json_expr, errors, at, warnings)
+			if target: return [pad + "if (%s) %s = %s;" % (check, target, json_expr)]
+			return [pad + check + ";"]
+
+		if k == "map":
+			extra = s.get("additionalProperties", True)
+			lines = [
+				pad + "if (!%s.is_object()) Fail(%s, %s, \"expected an object\");" % (json_expr, errors, at),
+				pad + "else",
+				pad + "{"]
+			if isinstance(extra, dict):
+				item = self.local("item")
+				lines += [pad + "\tfor (auto %s = %s.begin(); %s != %s.end(); ++%s)" % (item, json_expr, item, json_expr, item)]
+				lines += self.body(self.read(extra, item + ".value()", None,
+					"%s + \"/\" + Escape(%s.key())" % (at, item), errors, indent + 1, hint + "Item", warnings), indent + 1)
+			elif extra is False:
+				lines += [pad + "\tif (%s.size()) Warn(%s, %s, \"unexpected properties\");" % (json_expr, warnings, at)]
+			if target:
+				lines += [pad + "\t%s = %s;" % (target, json_expr)]
+			lines += [pad + "}"]
+			return [pad + "{"] + ["\t" + l for l in lines] + [pad + "}"]
+
+		value = self.local("value")
+		base = "std::vector<std::string>" if k == "list" else SCALARS[s["type"]]
+		tests = ["Read(%s, %s, %s, %s)" % (json_expr, value, errors, at)]
+		if "enum" in s:
+			tests.append("OneOf(%s, {%s}, %s, %s)" % (value, ", ".join(literal(v) for v in s["enum"]), errors, at))
+		if "minimum" in s:
+			minimum = float(s["minimum"]) if s["type"] == "number" else int(s["minimum"])
+			tests.append("AtLeast(%s, %s, %s, %s)" % (value, literal(minimum), errors, at))
+
+		if target:
+			store = "if (%s) %s = std::move(%s);" % (" && ".join(tests), target, value)
+		elif len(tests) == 1:
+			store = tests[0] + ";"
+		else:
+			store = "if (%s) %s;" % (" && ".join(tests[:-1]), tests[-1])
+		return [
+			pad + "{",
+			pad + "\t%s %s{};" % (base, value),
+			pad + "\t" + store,
+			pad + "}"]
+
+	@staticmethod
+	def body(lines, indent):
+		"""Indent a lone statement following an if or for."""
+		if len(lines) == 1: return ["\t" + lines[0]]
+		return lines
+
+	def declare(self, name, s):
+		lines = ["\tstruct " + name, "\t{"]
+		if "properties" in s:
+			members = [(prop, sub) for prop, sub in s["properties"].items() if not prop.startswith("$")]
+		else:
+			members = [(sub["title"], sub) for sub in s["prefixItems"]]
+
+		rows = []
+		for prop, sub in members:
+			merged, _ = self.deref(sub)
+			ctype = self.cpp_type(sub, name + camel(prop))
+			init = ""
+			if "default" in merged and self.kind(sub) not in ("struct", "tuple", "union", "map"):
+				init = " = " + literal(merged["default"])
+			comment = merged.get("$comment", "")
+			rows.append((ctype, identifier(prop) + init + ";", comment))
+
+		width = max(len(r[0]) for r in rows)
+		for ctype, decl, comment in rows:
+			line = "\t\t%s %s" % (ctype.ljust(width), decl)
+			if comment: line += " // " + comment
+			lines.append(line)
+		lines.append("\t};")
+		return lines
+
+	def define_struct(self, name, s):
+		lines = [
+			"bool tattle::config::Load(const Json &json, %s &out, Errors &errors, const std::string &at, Errors *warnings)" % name,
+			"{"]
+
+		if "properties" in s:
+			lines += [
+				"\tif (!json.is_object()) return Fail(errors, at, \"expected an object\");",
+				"\tconst size_t count = errors.size();",
+				"",
+				"\tfor (auto i = json.begin(); i != json.end(); ++i)",
+				"\t{",
+				"\t\tconst std::string &key   = i.key();",
+				"\t\tconst std::string  where = at + \"/\" + Escape(key);",
+				""]
+			keyword = "if"
+			for prop, sub in s["properties"].items():
+				lines.append("\t\t%s (key == %s)" % (keyword, literal(prop)))
+				keyword = "else if"
+				target = None if prop.startswith("$") else "out." + identifier(prop) # $ properties are checked, not kept
+				lines += self.body(self.read(sub, "i.value()", target, "where", "errors", 2, name + camel(prop)), 2)
+
+			extra = s.get("additionalProperties", True)
+			if extra is False:
+				lines += ["\t\telse Warn(warnings, where, \"unknown property\");"]
+			elif isinstance(extra, dict):
+				lines += ["\t\telse"]
+				lines += self.body(self.read(extra, "i.value()", None, "where", "errors", 2, name + "Item"), 2)
+			lines += ["\t}"]
+
+			for prop in s.get("required", []):
+				lines.append("\tif (!json.contains(%s)) Fail(errors, at, %s);" % (literal(prop), literal("missing \"%s\"" % prop)))
+
+			for alternatives in [s["anyOf"]] if "anyOf" in s else []:
+				groups = [alt["required"] for alt in alternatives]
+				test = " || ".join("(" + " && ".join("json.contains(%s)" % literal(p) for p in g) + ")" for g in groups)
+				names = " or ".join(", ".join("\"%s\"" % p for p in g) for g in groups)
+				lines.append("\tif (!(%s)) Fail(errors, at, %s);" % (test, literal("requires " + names)))
+		else:
+			items = s["prefixItems"]
+			lines += [
+				"\tif (!json.is_array()) return Fail(errors, at, \"expected an array\");",
+				"\tconst size_t count = errors.size();",
+				""]
+			if s.get("items", True) is False:
+				lines.append("\tif (json.size() > %d) Fail(errors, at, \"expected at most %d items\");" % (len(items), len(items)))
+			for n, sub in enumerate(items):
+				lines.append("\tif (json.size() > %d)" % n)
+				lines += self.body(self.read(sub, "json[%d]" % n, "out." + identifier(sub["title"]), "at + \"/%d\"" % n, "errors", 1, name + str(n)), 1)
+
+		lines += ["\treturn errors.size() == count;", "}"]
+		return lines
+
+	def define_check(self, name, s):
+		lines = [
+			"// Accepts the alternative which matches with the fewest warnings, or reports the errors of the closest.",
+			"static bool %s(const Json &json, Errors &errors, const std::string &at, Errors *warnings)" % name,
+			"{",
+			"\tErrors closest, fewest;",
+			"\tbool   any = false, matched = false;"]
+		for n, alt in enumerate(s["oneOf"]):
+			hint = self.alternative(name, n, alt)
+			test = " || ".join(TYPE_TESTS[t] for t in sorted(self.types(alt)))
+			lines += [
+				"\tif (%s)" % test,
+				"\t{",
+				"\t\tErrors attempt, attemptWarnings;"]
+			lines += self.read(alt, "json", None, "at", "attempt", 2, hint, "&attemptWarnings")
+			lines += [
+				"\t\tif (attempt.empty() && attemptWarnings.empty()) return true;",
+				"\t\tif (attempt.empty() && (!matched || attemptWarnings.size() < fewest.size())) fewest = std::move(attemptWarnings);",
+				"\t\tmatched = matched || attempt.empty();",
+				"\t\tif (!any || attempt.size() < closest.size()) closest = std::move(attempt);",
+				"\t\tany = true;",
+				"\t}"]
+		expected = sorted(set().union(*(self.types(alt) for alt in s["oneOf"])))
+		article = lambda t: ("an " if t[0] in "aeiou" else "a ") + t
+		lines += [
+			"\tif (matched)",
+			"\t{",
+			"\t\tif (warnings) warnings->insert(warnings->end(), fewest.begin(), fewest.end());",
+			"\t\treturn true;",
+			"\t}",
+			"\tif (!any) return Fail(errors, at, %s);" % literal("expected " + " or ".join(map(article, expected))),
+			"\terrors.insert(errors.end(), closest.begin(), closest.end());",
+			"\treturn false;",
+			"}"]
+		return lines
+
+	def generate(self, source_name):
+		root = self.struct(self.schema, "Command")
+
+		# Generate bodies first; this registers every struct and checker.
+		bodies = []
+		for name, s in list(self.structs):
+			bodies.append(self.define_struct(name, s))
+		checks = [self.define_check(name, s) for name, s in list(self.checks)]
+
+		banner = [
+			"//",
+			"//  %%s",
+			"//  tattle",
+			"//",
+			"//  Generated from %s by cmake/generate_config.py.  Do not edit." % source_name,
+			"//"]
+
+		header = [l.replace("%%s", "command_config.h") for l in banner] + [
+			"",
+			"#ifndef tattle_command_config_h",
+			"#define tattle_command_config_h",
+			"",
+			"#include <string>",
+			"#include <vector>",
+			"#include <optional>",
+			"",
+			"#include <nlohmann/json.hpp>",
+			"",
+			"",
+			"namespace tattle",
+			"{",
+			"namespace config",
+			"{",
+			"\tusing Json   = nlohmann::json;",
+			"\tusing Errors = std::vector<std::string>;",
+			""]
+		for name, s in self.structs:
+			header += self.declare(name, s) + [""]
+		header += [
+			"\t/*",
+			"\t\tCheck JSON against the schema and fill in `out`, returning false if there were errors.",
+			"\t\t\tErrors are appended as \"<JSON pointer>: <problem>\", relative to `at`.",
+			"\t\t\tProperties the schema doesn't allow are ignored, and listed in `warnings` if given.",
+			"\t\t\tMembers missing from the JSON keep their current values.",
+			"\t*/"]
+		width = max(len(name) for name, _ in self.structs)
+		for name, _ in self.structs:
+			header.append("\tbool Load(const Json &json, %s&out, Errors &errors, const std::string &at = std::string(), Errors *warnings = nullptr);" % (name + " ").ljust(width + 1))
+		header += ["}", "}", "", "#endif // tattle_command_config_h", ""]
+
+		source = [l.replace("%%s", "command_config.cpp") for l in banner] + [
+			"",
+			"#include \"command_config.h\"",
+			"",
+			"",
+			"using namespace tattle::config;",
+			"",
+			"",
+			"namespace",
+			"{",
+			"\tbool Fail(Errors &errors, const std::string &at, const std::string &problem)",
+			"\t{",
+			"\t\terrors.push_back((at.length() ? at : std::string(\"/\")) + \": \" + problem);",
+			"\t\treturn false;",
+			"\t}",
+			"",
+			"\tvoid Warn(Errors *warnings, const std::string &at, const std::string &problem)",
+			"\t{",
+			"\t\tif (warnings) warnings->push_back((at.length() ? at : std::string(\"/\")) + \": \" + problem);",
+			"\t}",
+			"",
+			"\t// Escape a key for a JSON pointer.",
+			"\tstd::string Escape(const std::string &key)",
+			"\t{",
+			"\t\tstd::string result;",
+			"\t\tfor (char c : key)",
+			"\t\t{",
+			"\t\t\tif      (c == '~') result += \"~0\";",
+			"\t\t\telse if (c == '/') result += \"~1\";",
+			"\t\t\telse               result += c;",
+			"\t\t}",
+			"\t\treturn result;",
+			"\t}",
+			"",
+			"\tbool Read(const Json &json, std::string &out, Errors &errors, const std::string &at)",
+			"\t\t{if (!json.is_string()) return Fail(errors, at, \"expected a string\"); out = json.get<std::string>(); return true;}",
+			"\tbool Read(const Json &json, bool &out, Errors &errors, const std::string &at)",
+			"\t\t{if (!json.is_boolean()) return Fail(errors, at, \"expected a boolean\"); out = json.get<bool>(); return true;}",
+			"\tbool Read(const Json &json, long long &out, Errors &errors, const std::string &at)",
+			"\t\t{if (!json.is_number_integer()) return Fail(errors, at, \"expected an integer\"); out = json.get<long long>(); return true;}",
+			"\tbool Read(const Json &json, double &out, Errors &errors, const std::string &at)",
+			"\t\t{if (!json.is_number()) return Fail(errors, at, \"expected a number\"); out = json.get<double>(); return true;}",
+			"",
+			"\tbool Read(const Json &json, std::vector<std::string> &out, Errors &errors, const std::string &at)",
+			"\t{",
+			"\t\tif (!json.is_array()) return Fail(errors, at, \"expected an array\");",
+			"\t\tstd::vector<std::string> result;",
+			"\t\tfor (size_t n = 0; n < json.size(); ++n)",
+			"\t\t{",
+			"\t\t\tresult.emplace_back();",
+			"\t\t\tif (!Read(json[n], result.back(), errors, at + \"/\" + std::to_string(n))) return false;",
+			"\t\t}",
+			"\t\tout = std::move(result);",
+			"\t\treturn true;",
+			"\t}",
+			"",
+			"\tbool OneOf(const std::string &value, std::initializer_list<const char*> options, Errors &errors, const std::string &at)",
+			"\t{",
+			"\t\tstd::string list;",
+			"\t\tfor (auto option : options)",
+			"\t\t{",
+			"\t\t\tif (value == option) return true;",
+			"\t\t\tlist += (list.length() ? \", \\\"\" : \"\\\"\") + std::string(option) + \"\\\"\";",
+			"\t\t}",
+			"\t\treturn Fail(errors, at, \"expected one of \" + list);",
+			"\t}",
+			"",
+			"\tbool AtLeast(long long value, long long minimum, Errors &errors, const std::string &at)",
+			"\t\t{return value >= minimum || Fail(errors, at, \"must be at least \" + std::to_string(minimum));}",
+			"\tbool AtLeast(double value, double minimum, Errors &errors, const std::string &at)",
+			"\t\t{return value >= minimum || Fail(errors, at, \"must be at least \" + Json(minimum).dump());}",
+			"}",
+			""]
+		for lines in checks:
+			source += lines + ["", ""]
+		for lines in bodies:
+			source += lines + ["", ""]
+
+		return "\n".join(header), "\n".join(source).rstrip("\n") + "\n"
+
+
+def main():
+	if len(sys.argv) != 3:
+		sys.exit("usage: generate_config.py <schema.json> <output dir>")
+
+	with open(sys.argv[1], encoding="utf-8") as f:
+		schema = json.load(f)
+
+	header, source = Generator(schema).generate(os.path.basename(sys.argv[1]))
+
+	os.makedirs(sys.argv[2], exist_ok=True)
+	for name, text in (("command_config.h", header), ("command_config.cpp", source)):
+		with open(os.path.join(sys.argv[2], name), "w", encoding="utf-8", newline="\n") as f:
+			f.write(text)
+
+
+if __name__ == "__main__":
+	main()
@@ -0,0 +1,142 @@
+//
+//  admission.cpp
+//  tattle
+//
+//  Admission control for many instances sending the same report at once.
+//
+
+#include <wx/defs.h>
+
+#include <chrono>
+#include <cstdio>
+
+#include "tattle.h"
+
+#include <wx/filename.h>
+#include <wx/utils.h>
+
+
+using namespace tattle;
+
+
+Admission::Admission(const wxString &dir, const Report::Identifier &id) :
+	_dir(dir)
+{
+	// Any report identity maps to a safe filename.
+	const std::string identity = id.type + ":" + id.id;
+
+	char hex[9];
+	std::snprintf(hex, sizeof(hex), "%08x", unsigned(Crc32(identity.data(), identity.length())));
+	_key = wxString("tattle-") + hex;
+
+	if (!wxFileName::DirExists(_dir)) wxFileName::Mkdir(_dir, wxS_DIR_DEFAULT, wxPATH_MKDIR_FULL);
+}
+
+Admission::~Admission()
+{
+	if (!_leader.locked()) return;
+
+	// Standby instances see the new generation and exit.
+	FileLock guard;
+	guard.lock(_path(".lock"));
+
+	Tally tally = _read();
+	if (_hasReported)
+	{
+		unsigned others = _reported - (_counted ? 0u : std::min(_reported, 1u));
+		tally.pending -= std::min(tally.pending, others);
+	}
+	else tally.pending = 0;
+
+	++tally.generation;
+	_write(tally);
+}
+
+wxString Admission::_path(const wxString &suffix) const
+{
+	return wxFileName(_dir, _key + suffix).GetFullPath();
+}
+
+Admission::Tally Admission::_read() const
+{
+	Tally tally;
+
+	std::string bytes;
+	if (!ReadFileBytes(_path(".json"), bytes)) return tally;
+
+	try
+	{
+		Json json = Json::parse(bytes);
+		tally.pending    = JsonMember(json, "pending",    0u);
+		tally.generation = JsonMember(json, "generation", 0u);
+	}
+	catch (Json::exception&) {}
+
+	return tally;
+}
+
+void Admission::_write(const Tally &tally) const
+{
+	WriteFileAtomic(_path(".json"), Json({{"pending", tally.pending}, {"generation", tally.generation}}).dump());
+}
+
+bool Admission::enter(unsigned maxInstances, int waitSeconds)
+{
+	if (_leader.lock(_path(".leader"), false)) return true;
+
+	// Count this occurrence for the leader to report.
+	unsigned generation;
+	{
+		FileLock guard;
+		guard.lock(_path(".lock"));
+
+		Tally tally = _read();
+		++tally.pending;
+		_write(tally);
+		generation = tally.generation;
+	}
+	_counted = true;
+
+	// A few instances stand by in case the leader dies before reporting.
+	for (unsigned n = 1; n < maxInstances && !_slot.locked(); ++n)
+		_slot.lock(_path(wxString::Format(".slot%u", n)), false);
+
+	if (!_slot.locked())
+	{
+		std::cout << "Tattle: another instance is sending this report; occurrence counted." << std::endl;
+		return false;
+	}
+
+	const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(std::max(waitSeconds, 0));
+	while (!_leader.lock(_path(".leader"), false))
+	{
+		if (std::chrono::steady_clock::now() >= deadline)
+		{
+			_slot.unlock();
+			return false;
+		}
+		wxMilliSleep(250);
+	}
+	_slot.unlock();
+
+	// A leader which finished normally has advanced the generation.
+	FileLock guard;
+	guard.lock(_path(".lock"));
+
+	if (_read().generation != generation)
+	{
+		_leader.unlock();
+		return false;
+	}
+
+	std::cout << "Tattle: the leading instance exited early; taking over its report." << std::endl;
+	return true;
+}
+
+unsigned Admission::occurrences() const
+{
+	FileLock guard;
+	guard.lock(_path(".lock"));
+
+	return _read().pending + (_counted ? 0u : 1u);
+}
@@ -7,7 +7,7 @@
 
 #include <fstream> // Debug
 
-#include "tattle.h"
+#include "tattle_gui.h"
 
 #include <wx/app.h>
 #include <wx/cmdline.h>
@@ -25,33 +25,12 @@ using namespace tattle;
 
 static PersistentData persist_;
 static Report   report_;
-static UIConfig uiConfig_ = UIConfig(report_.config);
+static UIConfig uiConfig_ = UIConfig(report_);
 
 PersistentData &tattle::persist = persist_;
 const Report   &tattle::report   = report_;
 const UIConfig &tattle::uiConfig = uiConfig_;
 
-UIConfig::UIConfig(Json & _config) :
-	config(_config)
-{
-}
-
-unsigned UIConfig::marginSm() const    {return JsonFetch(config, "/style/margin_small", 5u);}
-unsigned UIConfig::marginMd() const    {return JsonFetch(config, "/style/margin_medium", 8u);}
-unsigned UIConfig::marginLg() const    {return JsonFetch(config, "/style/margin_large", 10u);}
-
-wxArtID UIConfig::GetIconID(wxString tattleName) const
-{
-	if (tattleName == "information") return wxART_INFORMATION;
-	if (tattleName == "info")        return wxART_INFORMATION;
-	if (tattleName == "warning")     return wxART_WARNING;
-	if (tattleName == "error")       return wxART_ERROR;
-	if (tattleName == "question")    return wxART_QUESTION;
-	if (tattleName == "help")        return wxART_HELP;
-	if (tattleName == "tip")         return wxART_TIP;
-	return "";
-}
-
 static TattleApp *tattleApp = NULL;
 
 
@@ -305,6 +284,12 @@ public:
 	void PerformPrompt();
 	void PerformPost();
 
+	// Handle the reply to a query which ran alongside the prompt.
+	void OnQueryReply(const Report::Reply &reply);
+
+	// Count the report instead of sending it, if one like it was sent recently.
+	bool SuppressDuplicate();
+
 private:
 	RUN_STAGE stage;
 
@@ -313,6 +298,12 @@ private:
 
 	bool idleHandler;
 	bool anyWindows;
+
+	wxString spoolEntry; // Spooled copy of a failed post, if any.
+
+	std::unique_ptr<Admission> admission; // Held while this instance leads, if coordinating.
+	std::unique_ptr<QueryTask> queryTask; // A query running alongside the workflow, if any.
+	std::unique_ptr<Preconnect> preconnect; // Opens the post connection while the prompt is shown.
 };
 
 bool TattleApp::OnInit()
@@ -335,9 +326,9 @@ bool TattleApp::OnInit()
 	bool badCmdLine = false;
 
 	// DEBUG: dump the config to CWD
-	if (report.config["path"].contains("config_dump"))
+	if (report.path_configDump().length())
 	{
-		wxFile file(wxString::FromUTF8(report.config["path"]["config_dump"]), wxFile::OpenMode::write);
+		wxFile file(wxString::FromUTF8(report.path_configDump()), wxFile::OpenMode::write);
 		if (!file.IsOpened()) return false;
 
 		file.Write(report.config.dump(1, '\t', false, nlohmann::detail::error_handler_t::replace));
@@ -345,9 +336,44 @@ bool TattleApp::OnInit()
 		file.Close();
 	}
 
-	if (report.config["path"].contains("state"))
+	if (report.configWarnings().size())
+	{
+		cout << "Ignoring configuration the schema doesn't describe:" << endl;
+		for (auto &warning : report.configWarnings()) cout << "  " << warning << endl;
+	}
+
+	if (report.configErrors().size())
+	{
+		cout << "The configuration does not match the schema:" << endl;
+		for (auto &error : report.configErrors()) cout << "  " << error << endl;
+		cout << "  Execute tattle --help for more information." << endl;
+		return false;
+	}
+
+	if (report.path_tattleData().length())
 	{
-		bool loaded = persist.load(wxString::FromUTF8(report.config["path"]["state"]));
+		// A missing or unreadable state file leaves the data empty, as on a first run.
+		persist.load(wxString::FromUTF8(report.path_tattleData()), report.state_binary());
+		LoadConnectionCache(persist, wxString::FromUTF8(report.path_tattleData()) + ".tls", report.state_connection_ttl());
+	}
+
+	// Deliver previously spooled reports and exit.
+	if (report.spool_flush())
+	{
+		if (!report.path_spool().length())
+		{
+			cout << "Flushing the spool requires a spool directory (path.spool)." << endl;
+			return false;
+		}
+
+		Spool spool(wxString::FromUTF8(report.path_spool()));
+		Spool::FlushResult flushed = spool.flush(*this, report.spool_concurrency(),
+			report.spool_retry_policy(), report.timeouts(false), &persist.connections);
+		cout << "Sent " << flushed.sent << " spooled report(s)";
+		if (flushed.failed)  cout << "; " << flushed.failed << " will be retried";
+		if (flushed.dropped) cout << "; " << flushed.dropped << " dropped";
+		cout << "." << endl;
+		return true; // No windows; OnRun exits immediately.
 	}
 
 	if (!report.url_post().isSet() && !report.url_query().isSet())
@@ -362,8 +388,23 @@ bool TattleApp::OnInit()
 		return false;
 	}
 
+	// In a crash storm, let one instance report for the others.
+	if (report.path_locks().length())
+	{
+		admission.reset(new Admission(wxString::FromUTF8(report.path_locks()), report.identity()));
+		if (!admission->enter(report.admission_max_instances(), report.admission_wait()))
+		{
+			admission.reset();
+			return true; // No windows; OnRun exits immediately.
+		}
+	}
+
+	if (!report.dedupe_by_contents() && SuppressDuplicate()) return true;
+
 	report_.compile();
 
+	if (report.dedupe_by_contents() && SuppressDuplicate()) return true;
+
 	if (report.contents().size() == 0)
 	{
 		cout << "The report is empty.  Supply at least one piece of content (string, input or file)." << endl;
@@ -382,8 +423,27 @@ bool TattleApp::OnInit()
 	return true;
 }
 
+bool TattleApp::SuppressDuplicate()
+{
+	unsigned occurrences = report.suppressDuplicate(persist, admission.get());
+	if (!occurrences) return false;
+
+	cout << "A matching report was sent recently; counted " << occurrences << " occurrence(s)." << endl;
+	return true; // No windows; OnRun exits immediately.
+}
+
 int TattleApp::OnExit()
 {
+	admission.reset();
+	queryTask.reset();
+	preconnect.reset();
+
+	// Keep connection data for the next run, and expire old state now that nothing is waiting on us.
+	if (report.path_tattleData().length())
+	{
+		SaveConnectionCache(persist);
+		persist.maintain(report.state_max_entries(), report.state_ttl());
+	}
 	//cout << "Exiting..." << endl;
 	return wxApp::OnExit();
 }
@@ -395,7 +455,43 @@ void TattleApp::PerformQuery()
 	*/
 	if (report.url_query().isSet())
 	{
-		Report::Reply reply = report.httpQuery(*this);
+		Report::Reply cached;
+		bool fresh = false;
+		const bool haveFresh = report.cachedReply(persist, cached, &fresh) && fresh;
+
+		// The prompt opens straight away; the reply is shown in it when it arrives.
+		if (uiConfig.concurrentQuery() && report.url_post().isSet() && !uiConfig.silentPost())
+		{
+			queryTask.reset(new QueryTask(report, *this, &persist, [this](Report::Reply &reply) {OnQueryReply(reply);}));
+
+			// Once the prompt is up, show a fresh reply from an earlier run until this one arrives.
+			if (haveFresh) CallAfter([this, cached]() {OnQueryReply(cached);});
+			return;
+		}
+
+		// A fresh reply from an earlier run is shown at once, and refreshed for next time.
+		if (haveFresh)
+		{
+			std::cout << "Tattle: using the saved reply; refreshing it in the background" << std::endl;
+
+			if (cached.valid() && !uiConfig.silentQuery())
+				pendingWindow = Prompt::DisplayReply(cached);
+
+			queryTask.reset(new QueryTask(report, *this, &persist, [](Report::Reply &reply)
+			{
+				if (reply.serverValues.size()) persist.mergePatch(reply.serverValues);
+			}));
+			return;
+		}
+
+		std::unique_ptr<ProgressDialog> progress;
+		if (uiConfig.showProgress())
+			progress.reset(new ProgressDialog("Looking for solutions...", "Preparing...", *this));
+
+		Report::Reply reply = report.httpQuery(*this, progress.get(), &persist);
+		progress.reset();
+
+		if (reply.serverValues.size()) persist.mergePatch(reply.serverValues);
 
 		if (reply.valid() && !uiConfig.silentQuery())
 		{
@@ -408,12 +504,27 @@ void TattleApp::PerformQuery()
 			report_.connectionWarning = true;
 		}
 	}
-	else if (!uiConfig.silentQuery())
+}
+void TattleApp::OnQueryReply(const Report::Reply &reply)
+{
+	if (reply.serverValues.size()) persist.mergePatch(reply.serverValues);
+
+	// Too late to matter once the report is on its way.
+	if (stage > RS_PROMPT || uiConfig.silentQuery()) return;
+
+	if (prompt && reply.command != Report::SC_STOP)
 	{
-		// Probe the server to test the connection
-		if (report.url_post().isSet() && !report.httpTest(*this, report.url_post()))
-			report_.connectionWarning = true;
+		prompt->ShowReply(reply);
+		return;
 	}
+
+	// Stopping is up to the user, in a dialog of its own.
+	if (!reply.valid()) return;
+
+	if (prompt) prompt->Disable();
+
+	if (wxWindow *dialog = Prompt::DisplayReply(reply))
+		InsertDialog(dialog);
 }
 void TattleApp::PerformPrompt()
 {
@@ -425,6 +536,17 @@ void TattleApp::PerformPrompt()
 			// Set up the prompt window for display
 			prompt = new Prompt(NULL, -1, report_);
 			pendingWindow = prompt;
+
+			// Connect to the server while the user fills in the prompt; this also tests the connection.
+			Report::Timeouts timeouts = report.timeouts(true);
+			preconnect.reset(new Preconnect(*this, report.url_post(), timeouts.connect + timeouts.reply, &persist.connections,
+				[this](bool connected)
+			{
+				if (connected || uiConfig.silentQuery()) return;
+
+				report_.connectionWarning = true;
+				if (prompt && stage <= RS_PROMPT) prompt->ShowConnectionWarning();
+			}));
 		}
 		else
 		{
@@ -438,15 +560,40 @@ void TattleApp::PerformPost()
 	// Could be query-only...
 	if (!report.url_post().isSet()) return;
 	
-	Report::Reply reply = report.httpPost(prompt ? (wxEvtHandler&) *prompt : *this);
+	wxEvtHandler &parent = prompt ? (wxEvtHandler&) *prompt : *this;
+
+	std::unique_ptr<ProgressDialog> progress;
+	if (uiConfig.showProgress())
+		progress.reset(new ProgressDialog("Sending...", "Preparing Report...", parent));
+
+	// Count other instances and recently suppressed duplicates.
+	Report::Occurrences occurrences = report_.stampOccurrences(persist, admission.get());
+
+	Report::Reply reply = report.httpPost(parent, progress.get(), &persist);
+	progress.reset();
+
+	if (reply.serverValues.size()) persist.mergePatch(reply.serverValues);
+
+	// Keep reports which could not be delivered for a later --flush-spool.
+	if (report.path_spool().length())
+	{
+		Spool spool(wxString::FromUTF8(report.path_spool()));
+		spool.remove(spoolEntry);
+		spoolEntry.clear();
+
+		if (!reply.connected() || reply.statusCode >= 500)
+			spoolEntry = spool.store(report, report.url_post());
+	}
+
+	report.markDelivered(persist, occurrences, reply, spoolEntry.length() != 0);
 
 	if (reply.valid())
 	{
-		if (!reply.icon.length()) reply.icon = wxART_INFORMATION;
+		if (!reply.icon.length()) reply.icon = "information";
 	}
 	else
 	{
-		if (!reply.icon.length()) reply.icon = wxART_ERROR;
+		if (!reply.icon.length()) reply.icon = "error";
 
 		// Flag for a connection warning.
 		report_.connectionWarning = true;
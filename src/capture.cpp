@@ -0,0 +1,249 @@
+//
+//  capture.cpp
+//  tattle
+//
+
+#include <wx/defs.h>
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "tattle.h"
+
+#include <wx/file.h>
+#include <wx/dir.h>
+#include <wx/filename.h>
+
+
+using namespace tattle;
+
+
+// Windows smaller than this are copied into memory even when mapping was asked for.
+enum {CAPTURE_MAP_MIN = 256 * 1024};
+
+
+void tattle::ParallelFor(size_t count, const std::function<void(size_t)> &task)
+{
+	std::atomic<size_t> next(0);
+	auto worker = [&]()
+	{
+		for (size_t n; (n = next++) < count; ) task(n);
+	};
+
+	size_t workerCount = std::min<size_t>(count, std::max(1u, std::min(4u, std::thread::hardware_concurrency())));
+
+	std::vector<std::thread> workers;
+	for (size_t n = 1; n < workerCount; ++n) workers.emplace_back(worker);
+	worker();
+	for (auto &thread : workers) thread.join();
+}
+
+
+static void DumpString(wxMemoryBuffer &dest, const std::string src)
+{
+	dest.AppendData((void*) &src[0], src.length());
+}
+
+static void AppendText(FileViews &dest, const std::string &text)
+{
+	FileView view;
+	DumpString(view.buffer, text);
+	dest.push_back(std::move(view));
+}
+
+// Capture a window of an open file, mapping a snapshot of it if requested.
+static void CaptureWindow(FileViews &dest, wxFile &file, wxFileOffset offset, size_t length, bool map)
+{
+	if (!length) return;
+
+	FileView view;
+
+	if (map && length >= CAPTURE_MAP_MIN)
+	{
+		if (auto mapping = MappedFile::Snapshot(file, offset, length))
+		{
+			view.mapping = std::move(mapping);
+			dest.push_back(std::move(view));
+			return;
+		}
+		// Otherwise fall back to reading the file.
+	}
+
+	file.Seek(offset);
+	auto consumed = file.Read(view.buffer.GetAppendBuf(length), length);
+	view.buffer.UngetAppendBuf((consumed > 0) ? size_t(consumed) : 0);
+	dest.push_back(std::move(view));
+}
+
+void tattle::CaptureFile(FileViews &dest,
+	const wxString &path, unsigned trunc_begin, unsigned trunc_end, const std::string &trunc_note,
+	bool map, wxFileOffset mapThreshold)
+{
+	if (!wxFile::Access(path, wxFile::read))
+	{
+		AppendText(dest, "[File not found]");
+		return;
+	}
+
+	// Open the file
+	wxFile file(path);
+	
+	if (!file.IsOpened())
+	{
+		AppendText(dest, "[File not found]");
+		return;
+	}
+	
+	wxFileOffset fileLength = file.Length();
+	
+	if ((trunc_begin || trunc_end) && (trunc_begin+trunc_end < fileLength))
+	{
+		// Trim the file, capturing only the head and tail.
+		std::string separator;
+		if (trunc_begin)
+		{
+			CaptureWindow(dest, file, 0, trunc_begin, map);
+			separator += " ...\r\n\r\n";
+		}
+		separator += trunc_note;
+		if (trunc_end)
+		{
+			separator += "\r\n\r\n... ";
+		}
+		if (separator.length()) AppendText(dest, separator);
+		if (trunc_end)
+		{
+			CaptureWindow(dest, file, fileLength - trunc_end, trunc_end, map);
+		}
+	}
+	else
+	{
+		// Large files are mapped rather than copied.
+		if (mapThreshold > 0 && fileLength > mapThreshold) map = true;
+
+		CaptureWindow(dest, file, 0, size_t(fileLength), map);
+	}
+}
+
+
+static bool MatchesAny(const std::vector<std::string> &patterns, const wxString &name)
+{
+	for (auto &pattern : patterns)
+		if (wxMatchWild(wxString::FromUTF8(pattern.data(), pattern.length()), name, false)) return true;
+	return false;
+}
+
+std::shared_ptr<const DirCapture> tattle::CaptureDirectory(const wxString &root,
+	const std::vector<std::string> &include, const std::vector<std::string> &exclude,
+	wxFileOffset maxFileSize, wxFileOffset maxTotalSize, wxFileOffset mapThreshold)
+{
+	struct Found
+	{
+		wxString     name; // Relative path
+		wxFileOffset size;
+		wxDateTime   time;
+	};
+
+	std::vector<Found> found;
+
+	// Walk the tree with a pool of workers, each listing one directory at a time.
+	{
+		std::mutex              mutex;
+		std::condition_variable wake;
+		std::vector<wxString>   pending = {wxString()};
+		size_t                  active = 0;
+
+		auto walker = [&]()
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			while (true)
+			{
+				wake.wait(lock, [&]() {return pending.size() || !active;});
+				if (pending.empty()) break;
+
+				wxString relDir = pending.back();
+				pending.pop_back();
+				++active;
+				lock.unlock();
+
+				std::vector<wxString> subdirs;
+				std::vector<Found>    files;
+
+				wxString absDir = relDir.length() ? (root + "/" + relDir) : root;
+				wxDir dir(absDir);
+				if (dir.IsOpened())
+				{
+					wxString name;
+					for (bool ok = dir.GetFirst(&name, wxString(), wxDIR_DIRS | wxDIR_NO_FOLLOW); ok; ok = dir.GetNext(&name))
+					{
+						wxString relPath = relDir.length() ? (relDir + "/" + name) : name;
+						if (!MatchesAny(exclude, relPath)) subdirs.push_back(relPath);
+					}
+					for (bool ok = dir.GetFirst(&name, wxString(), wxDIR_FILES | wxDIR_NO_FOLLOW); ok; ok = dir.GetNext(&name))
+					{
+						wxString relPath = relDir.length() ? (relDir + "/" + name) : name;
+						if (!MatchesAny(include, relPath) || MatchesAny(exclude, relPath)) continue;
+
+						wxFileName fileName(absDir, name);
+						files.push_back({relPath, wxFileOffset(fileName.GetSize().GetValue()), fileName.GetModificationTime()});
+					}
+				}
+
+				lock.lock();
+				pending.insert(pending.end(), subdirs.begin(), subdirs.end());
+				found.insert(found.end(), files.begin(), files.end());
+				--active;
+				wake.notify_all();
+			}
+		};
+
+		std::vector<std::thread> walkers;
+		for (unsigned n = 1; n < std::max(1u, std::min(4u, std::thread::hardware_concurrency())); ++n)
+			walkers.emplace_back(walker);
+		walker();
+		for (auto &thread : walkers) thread.join();
+	}
+
+	// Apply the byte budgets in a stable order.
+	std::sort(found.begin(), found.end(), [](const Found &a, const Found &b) {return a.name < b.name;});
+
+	auto capture = std::make_shared<DirCapture>();
+	std::vector<Found> selected;
+	wxFileOffset total = 0;
+
+	for (auto &file : found)
+	{
+		wxFileOffset size = file.size;
+		if (maxFileSize > 0) size = std::min(size, maxFileSize);
+		if (maxTotalSize > 0 && total + size > maxTotalSize) continue;
+
+		total += size;
+		file.size = size;
+		selected.push_back(file);
+
+		DirCapture::Entry entry;
+		entry.name = file.name.ToUTF8().data();
+		entry.time = file.time;
+		capture->entries.push_back(std::move(entry));
+	}
+
+	// Capture the files, keeping the tail of any which are over budget.
+	ParallelFor(selected.size(), [&](size_t n)
+	{
+		wxString path = root + "/" + selected[n].name;
+
+		wxFile file(path);
+		if (!file.IsOpened()) return;
+
+		wxFileOffset length = file.Length(), size = std::min(length, selected[n].size);
+		CaptureWindow(capture->entries[n].data, file, length - size, size_t(size),
+			mapThreshold > 0 && size > mapThreshold);
+	});
+
+	capture->archiveSize = ArchiveStream::Measure(*capture);
+
+	return capture;
+}
@@ -0,0 +1,212 @@
+//
+//  cli.cpp
+//  tattle
+//
+//  Console entry point for tattle-cli, which runs the query and post
+//    steps without a prompt and without linking wx core.
+//
+
+#include "tattle.h"
+
+#include <wx/init.h>
+#include <wx/cmdline.h>
+#include <wx/file.h>
+
+
+using namespace tattle;
+
+
+namespace tattle
+{
+	extern void Tattle_OnInitCmdLine (wxCmdLineParser& parser);
+	extern bool Tattle_ExecCmdLine   (Json& config, wxCmdLineParser& parser);
+}
+
+enum CLI_EXIT
+{
+	CLI_OK = 0,
+	CLI_BAD_COMMAND_LINE = 1,
+	CLI_FAILED = 2,
+};
+
+static void PrintReply(const char *step, const Report::Reply &reply)
+{
+	if (!reply.valid()) return;
+
+	cout << step << (reply.cached ? " reply (saved):" : " reply:") << endl;
+	if (reply.title  .length()) cout << "  " << reply.title << endl;
+	if (reply.message.length()) cout << "  " << reply.message << endl;
+	if (reply.link   .length()) cout << "  " << reply.link << endl;
+}
+
+// Count the report instead of sending it, if one like it was sent recently.
+static bool SuppressDuplicate(const Report &report, PersistentData &persist, Admission *admission)
+{
+	unsigned occurrences = report.suppressDuplicate(persist, admission);
+	if (!occurrences) return false;
+
+	cout << "A matching report was sent recently; counted " << occurrences << " occurrence(s)." << endl;
+	return true;
+}
+
+// Keep connection data for the next run and expire old state once the report is done with, then exit.
+static int Finish(const Report &report, PersistentData &persist, int exitCode)
+{
+	if (report.path_tattleData().length())
+	{
+		SaveConnectionCache(persist);
+		persist.maintain(report.state_max_entries(), report.state_ttl());
+	}
+	return exitCode;
+}
+
+int main(int argc, char **argv)
+{
+	wxInitializer initializer(argc, argv);
+	if (!initializer.IsOk())
+	{
+		cout << "Failed to initialize wxWidgets." << endl;
+		return CLI_FAILED;
+	}
+
+	PersistentData persist;
+	Report         report;
+
+	wxCmdLineParser parser(argc, argv);
+	Tattle_OnInitCmdLine(parser);
+
+	switch (parser.Parse())
+	{
+	case -1: return CLI_OK; // Displayed help
+	case 0:  break;
+	default: return CLI_BAD_COMMAND_LINE;
+	}
+
+	if (!Tattle_ExecCmdLine(report.config, parser))
+		return CLI_BAD_COMMAND_LINE;
+
+	// DEBUG: dump the config to CWD
+	if (report.path_configDump().length())
+	{
+		wxFile file(wxString::FromUTF8(report.path_configDump()), wxFile::OpenMode::write);
+		if (!file.IsOpened()) return CLI_FAILED;
+
+		file.Write(report.config.dump(1, '\t', false, nlohmann::detail::error_handler_t::replace));
+
+		file.Close();
+	}
+
+	if (report.configWarnings().size())
+	{
+		cout << "Ignoring configuration the schema doesn't describe:" << endl;
+		for (auto &warning : report.configWarnings()) cout << "  " << warning << endl;
+	}
+
+	if (report.configErrors().size())
+	{
+		cout << "The configuration does not match the schema:" << endl;
+		for (auto &error : report.configErrors()) cout << "  " << error << endl;
+		return CLI_BAD_COMMAND_LINE;
+	}
+
+	if (report.path_tattleData().length())
+	{
+		persist.load(wxString::FromUTF8(report.path_tattleData()), report.state_binary());
+		LoadConnectionCache(persist, wxString::FromUTF8(report.path_tattleData()) + ".tls", report.state_connection_ttl());
+	}
+
+	// Receives request events, which the requests' nested event loops dispatch on this thread.
+	wxEvtHandler handler;
+
+	// Deliver previously spooled reports and exit.
+	if (report.spool_flush())
+	{
+		if (!report.path_spool().length())
+		{
+			cout << "Flushing the spool requires a spool directory (path.spool)." << endl;
+			return CLI_BAD_COMMAND_LINE;
+		}
+
+		Spool spool(wxString::FromUTF8(report.path_spool()));
+		Spool::FlushResult flushed = spool.flush(handler, report.spool_concurrency(),
+			report.spool_retry_policy(), report.timeouts(false), &persist.connections);
+		cout << "Sent " << flushed.sent << " spooled report(s)";
+		if (flushed.failed)  cout << "; " << flushed.failed << " will be retried";
+		if (flushed.dropped) cout << "; " << flushed.dropped << " dropped";
+		cout << "." << endl;
+		return Finish(report, persist, (flushed.failed || flushed.dropped) ? CLI_FAILED : CLI_OK);
+	}
+
+	if (!report.url_post().isSet() && !report.url_query().isSet())
+	{
+		cout << "At least one URL must be set with the --url-* options." << endl;
+		cout << "  Execute tattle-cli --help for more information." << endl;
+		return CLI_BAD_COMMAND_LINE;
+	}
+
+	// In a crash storm, let one instance report for the others.
+	std::unique_ptr<Admission> admission;
+	if (report.path_locks().length())
+	{
+		admission.reset(new Admission(wxString::FromUTF8(report.path_locks()), report.identity()));
+		if (!admission->enter(report.admission_max_instances(), report.admission_wait()))
+			return CLI_OK;
+	}
+
+	if (!report.dedupe_by_contents() && SuppressDuplicate(report, persist, admission.get()))
+		return CLI_OK;
+
+	report.compile();
+
+	if (report.dedupe_by_contents() && SuppressDuplicate(report, persist, admission.get()))
+		return CLI_OK;
+
+	if (report.contents().size() == 0)
+	{
+		cout << "The report is empty.  Supply at least one piece of content (string, input or file)." << endl;
+		return CLI_BAD_COMMAND_LINE;
+	}
+
+	/*
+		Query step, if applicable.  Fields are never prompted for.
+	*/
+	if (report.url_query().isSet())
+	{
+		// A fresh reply from an earlier run saves the round trip.
+		Report::Reply reply;
+		bool fresh = false;
+		if (!report.cachedReply(persist, reply, &fresh) || !fresh)
+			reply = report.httpQuery(handler, nullptr, &persist);
+		PrintReply("Query", reply);
+
+		if (reply.serverValues.size()) persist.mergePatch(reply.serverValues);
+
+		if (reply.command == Report::SC_STOP || reply.command == Report::SC_STOP_ON_LINK)
+			return Finish(report, persist, CLI_OK);
+	}
+
+	/*
+		Post step; undeliverable posts are spooled.
+	*/
+	if (report.url_post().isSet())
+	{
+		// Count other instances and recently suppressed duplicates.
+		Report::Occurrences occurrences = report.stampOccurrences(persist, admission.get());
+
+		Report::Reply reply = report.httpPost(handler, nullptr, &persist);
+		PrintReply("Post", reply);
+
+		if (reply.serverValues.size()) persist.mergePatch(reply.serverValues);
+
+		bool spooled = false;
+		if ((!reply.connected() || reply.statusCode >= 500) && report.path_spool().length())
+			spooled = Spool(wxString::FromUTF8(report.path_spool())).store(report, report.url_post()).length() != 0;
+
+		report.markDelivered(persist, occurrences, reply, spooled);
+
+		if (!reply.connected() || reply.statusCode >= 500)
+			return Finish(report, persist, CLI_FAILED);
+	}
+
+	return Finish(report, persist, CLI_OK);
+}
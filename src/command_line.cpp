@@ -1,9 +1,16 @@
 #include <fstream>
 #include <sstream>
+#include <ctime>
 
 #include "tattle.h"
 
 #include <wx/cmdline.h>
+#include <wx/filename.h>
+#include <wx/dir.h>
+
+#if wxUSE_GUI
+	#include "tattle_gui.h"
+#endif
 
 
 #ifndef TATTLE_LEGACY_COMMAND_LINE
@@ -30,6 +37,8 @@ namespace tattle
 		CMD_HELP          ("h", "help",           "Displays help on command-line parameters.")
 
 		CMD_OPTION_STRINGS("D",  "dump",          "<fname>  (Debug) Dump full configuration to a JSON file.")
+		CMD_SWITCH        ("F",  "flush-spool",   "Send reports saved in the spool directory, then exit.")
+		CMD_OPTION_STRING ("C",  "config-cache",  "<dir>    Reuse parsed command files while they are unchanged.")
 
 #if TATTLE_LEGACY_COMMAND_LINE
 		CMD_OPTION_STRINGS("c",  "config-file",   "<fname>  Config file with more command-line arguments.")
@@ -135,6 +144,14 @@ namespace tattle
 			config["path"]["config_dump"] = std::string(arg.GetStrVal().ToUTF8());
 			break;
 
+		case int('F'):
+			config["spool"]["flush"] = true;
+			break;
+
+		case int('C'):
+			// Handled by Tattle_ExecCmdLine.
+			break;
+
 #if TATTLE_LEGACY_COMMAND_LINE
 		case int('l'):
 			if (c1 == 0)
@@ -167,11 +184,11 @@ namespace tattle
 				switch (c1)
 				{
 				case 0:
-					uiConfig.config["gui"]["query"] = "silent";
-					uiConfig.config["gui"]["post"] = "silent";
+					config["gui"]["query"] = "silent";
+					config["gui"]["post"] = "silent";
 					break;
-				case int('q'): uiConfig.config["gui"]["query"] = "silent"; break;
-				case int('p'): uiConfig.config["gui"]["post"]  = "silent"; break;
+				case int('q'): config["gui"]["query"] = "silent"; break;
+				case int('p'): config["gui"]["post"]  = "silent"; break;
 				default:
 					err = CMD_ERR_UNKNOWN;
 				}
@@ -187,8 +204,10 @@ namespace tattle
 				case int('i'):
 					{
 					config["gui"]["icon"] = arg.GetStrVal();
-						wxArtID id = uiConfig.GetIconID(arg.GetStrVal());
+#if wxUSE_GUI
+						wxArtID id = GetIconArtID(arg.GetStrVal());
 						if (!id.length()) err = CMD_ERR_CONTENT_NOT_APPLICABLE;
+#endif
 					}
 					break;
 				default:
@@ -532,8 +551,85 @@ namespace tattle
 		return success;
 	}
 
+	/*
+		The config cache holds parsed command files as CBOR, each keyed by its path,
+			modification time and size.  Shared and locale files repeat between runs and
+			are read back from the cache.  Files changed within the last minute, like one
+			written for this report, are parsed but not cached.  The least recently used
+			entries beyond a limit are removed.
+	*/
+	enum
+	{
+		CONFIG_CACHE_MAX_ENTRIES = 16,
+		CONFIG_CACHE_MIN_AGE     = 60, // Seconds
+	};
+
+	static void Tattle_PruneConfigCache(const wxString &cacheDir)
+	{
+		wxDir dir(cacheDir);
+		if (!dir.IsOpened()) return;
+
+		std::vector<std::pair<time_t, wxString>> entries;
+
+		wxString name;
+		for (bool ok = dir.GetFirst(&name, "config-*.cbor", wxDIR_FILES); ok; ok = dir.GetNext(&name))
+		{
+			wxFileName file(cacheDir, name);
+			entries.emplace_back(file.GetModificationTime().GetTicks(), file.GetFullPath());
+		}
+		if (entries.size() <= CONFIG_CACHE_MAX_ENTRIES) return;
+
+		// Most recently used first
+		std::sort(entries.begin(), entries.end(),
+			[](const std::pair<time_t, wxString> &a, const std::pair<time_t, wxString> &b) {return a.first > b.first;});
+
+		for (size_t i = CONFIG_CACHE_MAX_ENTRIES; i < entries.size(); ++i) wxRemoveFile(entries[i].second);
+	}
+
+	static bool Tattle_ReadCommandFile(const wxString &path, const wxString &cacheDir, Json &json, std::string &error)
+	{
+		if (!cacheDir.length()) return ReadJsonFile(path, json, error);
+
+		wxFileName file(path);
+		file.MakeAbsolute();
+
+		const wxDateTime modified = file.GetModificationTime();
+		const std::string key = std::string(file.GetFullPath().ToUTF8()) + wxString::Format("|%lld|%llu",
+			(long long) modified.GetValue().GetValue(),
+			(unsigned long long) file.GetSize().GetValue()).ToStdString();
+
+		wxFileName cached(cacheDir, wxString::Format("config-%08x.cbor", unsigned(Crc32(key.data(), key.length()))));
+
+		std::string bytes;
+		if (ReadFileBytes(cached.GetFullPath(), bytes)) try
+		{
+			Json entry = Json::from_cbor(bytes);
+			if (JsonMember(entry, "key", "") == key && entry["config"].is_object())
+			{
+				json = std::move(entry["config"]);
+				cached.Touch(); // Recently used
+				return true;
+			}
+		}
+		catch (Json::exception&) {}
+
+		if (!ReadJsonFile(path, json, error)) return false;
+
+		if (modified.IsValid() && std::time(nullptr) - modified.GetTicks() >= CONFIG_CACHE_MIN_AGE)
+		{
+			if (!wxFileName::DirExists(cacheDir)) wxFileName::Mkdir(cacheDir, wxS_DIR_DEFAULT, wxPATH_MKDIR_FULL);
+
+			std::vector<std::uint8_t> cbor = Json::to_cbor(Json({{"key", key}, {"config", json}}));
+			if (WriteFileAtomic(cached.GetFullPath(), cbor.data(), cbor.size())) Tattle_PruneConfigCache(cacheDir);
+		}
+		return true;
+	}
+
 	bool Tattle_ExecCmdLine(Json& config, wxCmdLineParser& parser)
 	{
+		wxString cacheDir;
+		parser.Found("C", &cacheDir);
+
 		wxCmdLineArgs args = parser.GetArguments();
 
 		bool success = true;
@@ -546,36 +642,21 @@ namespace tattle
 
 				if (!wxFile::Exists(path)) return false;
 
-				wxFile file(path);
-				if (!file.IsOpened()) return false;
-
-				try
-				{
-					Json json;
-
-					wxString contents_str;
-					file.ReadAll(&contents_str);
-					file.Close();
-
-					const auto text = contents_str.ToUTF8();
-
-					config.merge_patch(
-						Json::parse(text.data(), text.data() + text.length(),
-							nullptr, true, true));
-				}
-				catch (Json::parse_error& e)
+				// Parsed straight from the file's bytes, or read back from the cache.
+				Json        json;
+				std::string error;
+				if (Tattle_ReadCommandFile(path, cacheDir, json, error))
 				{
-					std::stringstream ss;
-					ss << "Failed to read configuration `" << path << "' : " << e.what();
-					std::cout << ss.str() << std::endl;
-					wxMessageBox(ss.str(), "Problem while making a report");
+					config.merge_patch(json);
 				}
-				catch (...)
+				else
 				{
 					std::stringstream ss;
-					ss << "Failed to read configuration `" << path << "' : unknown exception";
+					ss << "Failed to read configuration `" << path << "' at " << error;
 					std::cout << ss.str() << std::endl;
+#if wxUSE_GUI
 					wxMessageBox(ss.str(), "Problem while making a report");
+#endif
 				}
 			}
 			else
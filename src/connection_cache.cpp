@@ -0,0 +1,437 @@
+//
+//  connection_cache.cpp
+//  tattle
+//
+
+#include <wx/defs.h>
+
+#include <cstdio>
+#include <ctime>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include "tattle.h"
+
+#include <wx/file.h>
+#include <wx/uri.h>
+
+#if defined(TATTLE_HAVE_CURL) && wxUSE_WEBREQUEST_CURL && wxCHECK_VERSION(3, 2, 0)
+	#include <curl/curl.h>
+	#define TATTLE_CONNECTION_CACHE 1
+#else
+	#define TATTLE_CONNECTION_CACHE 0
+#endif
+
+// Exporting and importing TLS sessions came with libcurl 8.12.
+#if TATTLE_CONNECTION_CACHE && LIBCURL_VERSION_NUM >= 0x080C00
+	#define TATTLE_TLS_SESSIONS 1
+#else
+	#define TATTLE_TLS_SESSIONS 0
+#endif
+
+
+using namespace tattle;
+
+
+enum {CONNECTION_MAX_SESSIONS = 16};
+
+/*
+	Addresses are kept under $hosts by "host:port" and pinned on later requests
+		with CURLOPT_RESOLVE, which skips the DNS lookup.  An address is trusted
+		until it expires or a request to it fails; it is not renewed while pinned,
+		so a moved server is found within the TTL.  Every cached request shares one
+		libcurl session cache, which is restored by the next run so its first handshake
+		can resume.  Session tickets hold the keys to resume with, so they are saved in
+		a file of their own which only the user may read, never in the state file.
+*/
+namespace
+{
+	struct CachedHost
+	{
+		std::string address;
+		long long   expires = 0;
+	};
+
+	struct PinnedHost
+	{
+		std::string  host;
+#if TATTLE_CONNECTION_CACHE
+		curl_slist  *resolve = nullptr; // The request refers to this until it is noted or forgotten
+#endif
+	};
+
+#if TATTLE_CONNECTION_CACHE
+	// libcurl's DNS and TLS session store, which outlives any one cache.
+	struct SharedStore
+	{
+		std::mutex  mutex;
+		CURLSH     *share = nullptr;
+		std::mutex  locks[CURL_LOCK_DATA_LAST];
+	};
+
+	SharedStore &Shared()
+	{
+		static SharedStore store;
+		return store;
+	}
+#endif
+}
+
+struct ConnectionCache::Hosts
+{
+	std::mutex mutex;
+	long long  ttl = 0;
+	wxString   sessionPath;
+
+	std::map<std::string, CachedHost>  hosts;   // By "host:port"
+	std::map<std::string, bool>        changed; // Hosts to save; false to delete
+	std::map<int, PinnedHost>          pinned;  // Each pinned request by ID
+	std::map<int, std::string>         started; // Host of each request by ID, if not pinned
+};
+
+namespace
+{
+#if TATTLE_CONNECTION_CACHE
+	// "host:port" for a URL, or empty if it has no server.
+	std::string HostKey(const wxString &url)
+	{
+		wxURI uri(url);
+		if (!uri.HasServer()) return std::string();
+
+		wxString port = uri.GetPort();
+		if (!port.length()) port = (uri.GetScheme().Lower() == "https") ? "443" : "80";
+
+		return std::string((uri.GetServer() + ":" + port).ToUTF8());
+	}
+#endif
+
+#if TATTLE_TLS_SESSIONS
+	std::string ToHex(const unsigned char *data, size_t size)
+	{
+		static const char digits[] = "0123456789abcdef";
+
+		std::string hex;
+		hex.reserve(size * 2);
+		for (size_t i = 0; i < size; ++i) {hex.push_back(digits[data[i] >> 4]); hex.push_back(digits[data[i] & 15]);}
+		return hex;
+	}
+
+	bool FromHex(const std::string &hex, std::vector<unsigned char> &data)
+	{
+		auto digit = [](char c) -> int
+		{
+			if (c >= '0' && c <= '9') return c - '0';
+			if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+			return -1;
+		};
+
+		if (hex.length() % 2) return false;
+
+		data.resize(hex.length() / 2);
+		for (size_t i = 0; i < data.size(); ++i)
+		{
+			int hi = digit(hex[2*i]), lo = digit(hex[2*i+1]);
+			if (hi < 0 || lo < 0) return false;
+			data[i] = (unsigned char) ((hi << 4) | lo);
+		}
+		return true;
+	}
+#endif
+
+#if TATTLE_CONNECTION_CACHE
+	void LockShare(CURL*, curl_lock_data data, curl_lock_access, void*)    {Shared().locks[data].lock();}
+	void UnlockShare(CURL*, curl_lock_data data, void*)                     {Shared().locks[data].unlock();}
+
+	// The process's share handle, created on first use.
+	CURLSH *Share()
+	{
+		SharedStore &store = Shared();
+		std::lock_guard<std::mutex> lock(store.mutex);
+		if (store.share) return store.share;
+
+		store.share = curl_share_init();
+		if (!store.share) return nullptr;
+
+		curl_share_setopt(store.share, CURLSHOPT_LOCKFUNC,   LockShare);
+		curl_share_setopt(store.share, CURLSHOPT_UNLOCKFUNC, UnlockShare);
+		curl_share_setopt(store.share, CURLSHOPT_SHARE,      CURL_LOCK_DATA_DNS);
+		curl_share_setopt(store.share, CURLSHOPT_SHARE,      CURL_LOCK_DATA_SSL_SESSION);
+		return store.share;
+	}
+
+	// The share handle if one was made, without making one.
+	CURLSH *ExistingShare()
+	{
+		SharedStore &store = Shared();
+		std::lock_guard<std::mutex> lock(store.mutex);
+		return store.share;
+	}
+#endif
+
+	// Stop tracking a request.  Call with the cache locked.
+	void Release(ConnectionCache::Hosts &cache, const wxWebRequest &request)
+	{
+		const int id = request.GetId();
+		cache.started.erase(id);
+
+		auto pinned = cache.pinned.find(id);
+		if (pinned == cache.pinned.end()) return;
+
+#if TATTLE_CONNECTION_CACHE
+		if (CURL *curl = static_cast<CURL*>(request.GetNativeHandle()))
+			curl_easy_setopt(curl, CURLOPT_RESOLVE, (curl_slist*) nullptr);
+		curl_slist_free_all(pinned->second.resolve);
+#endif
+		cache.pinned.erase(pinned);
+	}
+}
+
+
+ConnectionCache::ConnectionCache() :
+	_hosts(new Hosts)
+{
+}
+
+ConnectionCache::~ConnectionCache()
+{
+#if TATTLE_CONNECTION_CACHE
+	for (auto &pinned : _hosts->pinned) curl_slist_free_all(pinned.second.resolve);
+#endif
+}
+
+
+void tattle::LoadConnectionCache(PersistentData &state, const wxString &sessionPath, long long ttlSeconds)
+{
+	ConnectionCache::Hosts &cache = *state.connections._hosts;
+	std::lock_guard<std::mutex> lock(cache.mutex);
+
+	cache.ttl         = ttlSeconds;
+	cache.sessionPath = sessionPath;
+	if (ttlSeconds <= 0 || !TATTLE_CONNECTION_CACHE) return;
+
+	const long long now = std::time(nullptr);
+
+	const Json hosts = JsonMember(state.data, "$hosts", Json::object());
+	if (hosts.is_object()) for (auto i = hosts.begin(); i != hosts.end(); ++i)
+	{
+		CachedHost host;
+		host.address = JsonMember(i.value(), "address", "");
+		host.expires = JsonMember(i.value(), "expires", 0ll);
+
+		if (host.address.length() && host.expires > now) cache.hosts[i.key()] = host;
+	}
+
+#if TATTLE_TLS_SESSIONS
+	Json        sessions;
+	std::string error;
+	if (!sessionPath.length() || !ReadJsonFile(sessionPath, sessions, error) ||
+		!sessions.is_object() || sessions.empty()) return;
+
+	CURLSH *share = Share();
+	CURL   *curl  = share ? curl_easy_init() : nullptr;
+	if (!curl) return;
+
+	curl_easy_setopt(curl, CURLOPT_SHARE, share);
+
+	for (auto i = sessions.begin(); i != sessions.end(); ++i)
+	{
+		if (JsonMember(i.value(), "expires", 0ll) <= now) continue;
+
+		std::string key = JsonMember(i.value(), "key", "");
+		std::vector<unsigned char> shmac, data;
+		if (!FromHex(JsonMember(i.value(), "shmac", ""), shmac) ||
+			!FromHex(JsonMember(i.value(), "data",  ""), data) || data.empty()) continue;
+
+		curl_easy_ssls_import(curl, key.length() ? key.c_str() : nullptr,
+			shmac.data(), shmac.size(), data.data(), data.size());
+	}
+
+	curl_easy_cleanup(curl);
+#endif
+}
+
+void tattle::SaveConnectionCache(PersistentData &state)
+{
+	ConnectionCache::Hosts &cache = *state.connections._hosts;
+	std::lock_guard<std::mutex> lock(cache.mutex);
+
+	Json patch = Json::object();
+
+	// Older versions kept TLS sessions in the state file.
+	if (state.data.contains(JsonPointer("/$tls"))) patch["$tls"] = nullptr;
+
+	if (cache.ttl <= 0 || !TATTLE_CONNECTION_CACHE)
+	{
+		if (patch.size()) state.mergePatch(patch);
+		return;
+	}
+
+	for (auto &change : cache.changed)
+	{
+		auto host = cache.hosts.find(change.first);
+		if (change.second && host != cache.hosts.end())
+			patch["$hosts"][change.first] = {{"address", host->second.address}, {"expires", host->second.expires}};
+		else if (state.data.contains(JsonPointer("/$hosts") / change.first))
+			patch["$hosts"][change.first] = nullptr;
+	}
+	cache.changed.clear();
+
+#if TATTLE_TLS_SESSIONS
+	if (CURLSH *share = ExistingShare())
+	{
+		struct Export
+		{
+			Json      sessions = Json::object();
+			long long now, ttl;
+		}
+			exported = {Json::object(), (long long) std::time(nullptr), cache.ttl};
+
+		auto exportSession = [](CURL*, void *userptr, const char *sessionKey,
+			const unsigned char *shmac, size_t shmacLength, const unsigned char *data, size_t dataLength,
+			curl_off_t validUntil, int, const char*, size_t) -> CURLcode
+		{
+			Export &out = *static_cast<Export*>(userptr);
+			if (out.sessions.size() >= CONNECTION_MAX_SESSIONS) return CURLE_OK;
+
+			long long expires = out.now + out.ttl;
+			if (validUntil > 0 && (long long) validUntil < expires) expires = (long long) validUntil;
+			if (expires <= out.now) return CURLE_OK;
+
+			Json session = {
+				{"shmac",   ToHex(shmac, shmacLength)},
+				{"data",    ToHex(data,  dataLength)},
+				{"expires", expires}};
+			if (sessionKey) session["key"] = sessionKey;
+
+			char id[9];
+			std::snprintf(id, sizeof(id), "%08x", unsigned(Crc32(data, dataLength)));
+			out.sessions[id] = std::move(session);
+			return CURLE_OK;
+		};
+
+		if (CURL *curl = curl_easy_init())
+		{
+			curl_easy_setopt(curl, CURLOPT_SHARE, share);
+			curl_easy_ssls_export(curl, exportSession, &exported);
+			curl_easy_cleanup(curl);
+		}
+
+		// Sessions are single-use with TLS 1.3; replace the saved ones.
+		if (cache.sessionPath.length())
+		{
+			if (exported.sessions.size())
+				WriteFileAtomic(cache.sessionPath, exported.sessions.dump(), wxS_IRUSR | wxS_IWUSR);
+			else if (wxFileExists(cache.sessionPath))
+				wxRemoveFile(cache.sessionPath);
+		}
+	}
+#endif
+
+	if (patch.size()) state.mergePatch(patch);
+}
+
+wxWebRequest tattle::NewRequest(ConnectionCache *connections, wxEvtHandler &handler, const wxString &url)
+{
+	wxWebRequest request = WebSession().CreateRequest(&handler, url);
+
+#if TATTLE_CONNECTION_CACHE
+	if (!connections) return request;
+
+	ConnectionCache::Hosts &cache = *connections->_hosts;
+	std::lock_guard<std::mutex> lock(cache.mutex);
+
+	CURL *curl = static_cast<CURL*>(request.IsOk() ? request.GetNativeHandle() : nullptr);
+	if (cache.ttl <= 0 || !curl) return request;
+
+	if (CURLSH *share = Share()) curl_easy_setopt(curl, CURLOPT_SHARE, share);
+
+	const std::string key = HostKey(url);
+	if (!key.length()) return request;
+
+	auto host = cache.hosts.find(key);
+	if (host == cache.hosts.end() || host->second.expires <= std::time(nullptr))
+	{
+		cache.started[request.GetId()] = key;
+		return request;
+	}
+
+	// A leading '+' lets the entry time out like a looked-up one.  IPv6 addresses go in brackets.
+	const std::string &address = host->second.address;
+	std::string entry = "+" + key + ":" + ((address.find(':') != std::string::npos) ? "[" + address + "]" : address);
+
+	curl_slist *resolve = curl_slist_append(nullptr, entry.c_str());
+	if (!resolve) return request;
+
+	curl_easy_setopt(curl, CURLOPT_RESOLVE, resolve);
+
+	PinnedHost &pinned = cache.pinned[request.GetId()];
+	pinned.host    = key;
+	pinned.resolve = resolve;
+#else
+	(void) connections;
+#endif
+
+	return request;
+}
+
+void tattle::NoteConnection(ConnectionCache *connections, const wxWebRequest &request, wxWebRequest::State finalState)
+{
+#if TATTLE_CONNECTION_CACHE
+	if (!connections) return;
+
+	ConnectionCache::Hosts &cache = *connections->_hosts;
+	std::lock_guard<std::mutex> lock(cache.mutex);
+
+	if (cache.ttl <= 0 || !request.IsOk()) return;
+
+	const int id = request.GetId();
+	auto pinned  = cache.pinned .find(id);
+	auto started = cache.started.find(id);
+
+	const wxWebResponse response = request.GetResponse();
+	const bool reached = response.IsOk() && response.GetStatus() != 0;
+
+	if (pinned != cache.pinned.end())
+	{
+		// The saved address may be stale; look it up afresh next time.
+		if (!reached && finalState != wxWebRequest::State_Completed)
+		{
+			cache.hosts.erase(pinned->second.host);
+			cache.changed[pinned->second.host] = false;
+		}
+	}
+	else if (started != cache.started.end())
+	{
+		CURL *curl = static_cast<CURL*>(request.GetNativeHandle());
+
+		char *address = nullptr;
+		long  redirects = 0;
+		if (reached && curl &&
+			curl_easy_getinfo(curl, CURLINFO_REDIRECT_COUNT, &redirects) == CURLE_OK && !redirects &&
+			curl_easy_getinfo(curl, CURLINFO_PRIMARY_IP,     &address)   == CURLE_OK && address && *address)
+		{
+			CachedHost &host = cache.hosts[started->second];
+			host.address = address;
+			host.expires = (long long) std::time(nullptr) + cache.ttl;
+			cache.changed[started->second] = true;
+		}
+	}
+
+	Release(cache, request);
+#else
+	(void) connections;
+	(void) request;
+	(void) finalState;
+#endif
+}
+
+void tattle::ForgetConnection(ConnectionCache *connections, const wxWebRequest &request)
+{
+	if (!connections) return;
+
+	ConnectionCache::Hosts &cache = *connections->_hosts;
+	std::lock_guard<std::mutex> lock(cache.mutex);
+
+	if (request.IsOk()) Release(cache, request);
+}
@@ -0,0 +1,122 @@
+//
+//  crc32.cpp
+//  tattle
+//
+
+#include <wx/defs.h>
+
+#include <array>
+
+#include "tattle.h"
+
+
+using namespace tattle;
+
+
+static const std::array<uint32_t, 256> &Crc32Table()
+{
+	static const std::array<uint32_t, 256> table = []
+	{
+		std::array<uint32_t, 256> t;
+		for (uint32_t n = 0; n < 256; ++n)
+		{
+			uint32_t c = n;
+			for (int k = 0; k < 8; ++k) c = (c & 1) ? (0xEDB88320u ^ (c >> 1)) : (c >> 1);
+			t[n] = c;
+		}
+		return t;
+	}();
+	return table;
+}
+
+uint32_t tattle::Crc32(const void *data, size_t size, uint32_t crc)
+{
+	const auto &table = Crc32Table();
+	const unsigned char *p = static_cast<const unsigned char*>(data);
+
+	crc = ~crc;
+	while (size--) crc = table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
+
+/*
+	Combining checksums of consecutive pieces of data, as zlib's crc32_combine:
+		appending len2 zero bytes to crc1 is a linear operation over GF(2),
+		applied by repeated squaring of the one-zero-bit operator.
+*/
+static uint32_t Crc32_MatrixTimes(const uint32_t *matrix, uint32_t vector)
+{
+	uint32_t sum = 0;
+	for (; vector; vector >>= 1, ++matrix) if (vector & 1) sum ^= *matrix;
+	return sum;
+}
+
+static void Crc32_MatrixSquare(uint32_t *square, const uint32_t *matrix)
+{
+	for (int n = 0; n < 32; ++n) square[n] = Crc32_MatrixTimes(matrix, matrix[n]);
+}
+
+uint32_t tattle::Crc32Combine(uint32_t crc1, uint32_t crc2, uint64_t len2)
+{
+	if (!len2) return crc1;
+
+	uint32_t even[32], odd[32];
+
+	// Operator for one zero bit
+	odd[0] = 0xEDB88320u;
+	for (int n = 1; n < 32; ++n) odd[n] = uint32_t(1) << (n - 1);
+
+	Crc32_MatrixSquare(even, odd); // Two zero bits
+	Crc32_MatrixSquare(odd, even); // Four zero bits
+
+	do
+	{
+		Crc32_MatrixSquare(even, odd);
+		if (len2 & 1) crc1 = Crc32_MatrixTimes(even, crc1);
+		len2 >>= 1;
+		if (!len2) break;
+
+		Crc32_MatrixSquare(odd, even);
+		if (len2 & 1) crc1 = Crc32_MatrixTimes(odd, crc1);
+		len2 >>= 1;
+	}
+	while (len2);
+
+	return crc1 ^ crc2;
+}
+
+
+enum {ADLER32_BASE = 65521, ADLER32_BLOCK = 5552};
+
+uint32_t tattle::Adler32(const void *data, size_t size, uint32_t adler)
+{
+	const unsigned char *p = static_cast<const unsigned char*>(data);
+	uint32_t a = adler & 0xFFFF, b = adler >> 16;
+
+	// Sums are reduced once per block, before they can overflow.
+	while (size)
+	{
+		size_t n = std::min<size_t>(size, ADLER32_BLOCK);
+		size -= n;
+		while (n--) {a += *p++; b += a;}
+		a %= ADLER32_BASE;
+		b %= ADLER32_BASE;
+	}
+	return a | (b << 16);
+}
+
+uint32_t tattle::Adler32Combine(uint32_t adler1, uint32_t adler2, uint64_t len2)
+{
+	const uint32_t rem = uint32_t(len2 % ADLER32_BASE);
+
+	uint32_t a = adler1 & 0xFFFF;
+	uint32_t b = uint32_t((uint64_t(rem) * a) % ADLER32_BASE);
+	a += (adler2 & 0xFFFF) + ADLER32_BASE - 1;
+	b += (adler1 >> 16) + (adler2 >> 16) + ADLER32_BASE - rem;
+
+	if (a >= ADLER32_BASE) a -= ADLER32_BASE;
+	if (a >= ADLER32_BASE) a -= ADLER32_BASE;
+	if (b >= 2 * ADLER32_BASE) b -= 2 * ADLER32_BASE;
+	if (b >= ADLER32_BASE) b -= ADLER32_BASE;
+	return a | (b << 16);
+}
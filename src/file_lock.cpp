@@ -0,0 +1,71 @@
+//
+//  file_lock.cpp
+//  tattle
+//
+
+#include <wx/defs.h>
+
+#include "tattle.h"
+
+#ifdef __WINDOWS__
+	#include <wx/msw/wrapwin.h>
+#else
+	#include <sys/file.h>
+	#include <cerrno>
+	#include <fcntl.h>
+	#include <unistd.h>
+#endif
+
+
+using namespace tattle;
+
+
+bool FileLock::lock(const wxString &path, bool wait)
+{
+	unlock();
+
+#ifdef __WINDOWS__
+	HANDLE file = CreateFileW(path.wc_str(), GENERIC_READ | GENERIC_WRITE,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) return false;
+
+	OVERLAPPED overlapped = {};
+	DWORD flags = LOCKFILE_EXCLUSIVE_LOCK | (wait ? 0 : LOCKFILE_FAIL_IMMEDIATELY);
+	if (!LockFileEx(file, flags, 0, 1, 0, &overlapped))
+	{
+		CloseHandle(file);
+		return false;
+	}
+	_handle = reinterpret_cast<intptr_t>(file);
+#else
+	int fd = open(path.fn_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) return false;
+
+	int result;
+	do result = flock(fd, LOCK_EX | (wait ? 0 : LOCK_NB));
+	while (result != 0 && errno == EINTR);
+
+	if (result != 0)
+	{
+		close(fd);
+		return false;
+	}
+	_handle = fd;
+#endif
+
+	return true;
+}
+
+void FileLock::unlock()
+{
+	if (_handle == -1) return;
+
+	// Closing the file releases the lock.
+#ifdef __WINDOWS__
+	CloseHandle(reinterpret_cast<HANDLE>(_handle));
+#else
+	close(int(_handle));
+#endif
+	_handle = -1;
+}
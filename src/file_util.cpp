@@ -0,0 +1,132 @@
+//
+//  file_util.cpp
+//  tattle
+//
+
+#include <wx/defs.h>
+
+#include <algorithm>
+
+#include "tattle.h"
+
+#include <wx/file.h>
+
+#ifdef __WINDOWS__
+	#include <wx/msw/wrapwin.h>
+#else
+	#include <cstdio>
+#endif
+
+
+using namespace tattle;
+
+
+bool tattle::ReplaceFile(const wxString &from, const wxString &to)
+{
+#ifdef __WINDOWS__
+	return MoveFileExW(from.wc_str(), to.wc_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+	return std::rename(from.fn_str(), to.fn_str()) == 0;
+#endif
+}
+
+bool tattle::WriteFileAtomic(const wxString &path, const void *data, size_t size, int access)
+{
+	wxString temp = path + ".tmp";
+
+	{
+		// A leftover file would keep its permissions.
+		if (wxFileExists(temp)) wxRemoveFile(temp);
+
+		wxFile file;
+		if (!file.Create(temp, true, access)) return false;
+
+		if (file.Write(data, size) != size || !file.Flush())
+		{
+			file.Close();
+			wxRemoveFile(temp);
+			return false;
+		}
+	}
+
+	if (!ReplaceFile(temp, path))
+	{
+		wxRemoveFile(temp);
+		return false;
+	}
+	return true;
+}
+
+bool tattle::WriteFileAtomic(const wxString &path, const std::string &contents, int access)
+{
+	return WriteFileAtomic(path, contents.data(), contents.length(), access);
+}
+
+bool tattle::ReadFileBytes(const wxString &path, std::string &contents)
+{
+	contents.clear();
+
+	wxFile file;
+	if (!wxFile::Exists(path) || !file.Open(path)) return false;
+
+	wxFileOffset length = file.Length();
+	if (length < 0) return false;
+
+	contents.resize(size_t(length));
+	auto consumed = file.Read(&contents[0], contents.length());
+	if (consumed < 0) return false;
+
+	contents.resize(size_t(consumed));
+	return true;
+}
+
+bool tattle::ParseJson(const char *begin, const char *end, Json &json, std::string &error)
+{
+	try
+	{
+		json = Json::parse(begin, end, nullptr, true, true);
+		return true;
+	}
+	catch (Json::parse_error &e)
+	{
+		// Locate the byte where parsing stopped.
+		size_t line = 1, column = 1;
+		const char *stop = begin + std::min<size_t>(e.byte ? e.byte - 1 : 0, size_t(end - begin));
+		for (const char *c = begin; c < stop; ++c)
+		{
+			if (*c == '\n') {++line; column = 1;}
+			else if ((*c & 0xC0) != 0x80) ++column; // Count UTF-8 characters
+		}
+
+		std::string what = e.what();
+		auto detail = what.find(": ");
+		if (detail != std::string::npos && what.compare(0, 5, "[json") == 0) what = what.substr(detail + 2);
+
+		error = std::to_string(line) + ":" + std::to_string(column) + ": " + what;
+		json = nullptr;
+		return false;
+	}
+}
+
+bool tattle::ReadJsonFile(const wxString &path, Json &json, std::string &error)
+{
+	json = nullptr;
+
+	wxFile file;
+	if (!wxFile::Exists(path) || !file.Open(path)) {error = "could not open the file"; return false;}
+
+	wxFileOffset length = file.Length();
+	file.Close();
+	if (length < 0) {error = "could not read the file"; return false;}
+
+	// Parse the bytes in place when the file can be mapped.
+	if (length > 0)
+	{
+		MappedFile mapping(path, 0, size_t(length));
+		if (mapping.isOpen()) return ParseJson(mapping.data(), mapping.data() + mapping.size(), json, error);
+	}
+
+	std::string contents;
+	if (!ReadFileBytes(path, contents)) {error = "could not read the file"; return false;}
+	return ParseJson(contents.data(), contents.data() + contents.length(), json, error);
+}
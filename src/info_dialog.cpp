@@ -1,4 +1,4 @@
-#include "tattle.h"
+#include "tattle_gui.h"
 
 #include <wx/button.h>
 #include <wx/stattext.h>
@@ -10,6 +10,18 @@
 
 using namespace tattle;
 
+wxArtID tattle::GetIconArtID(const wxString &tattleName)
+{
+	if (tattleName == "information") return wxART_INFORMATION;
+	if (tattleName == "info")        return wxART_INFORMATION;
+	if (tattleName == "warning")     return wxART_WARNING;
+	if (tattleName == "error")       return wxART_ERROR;
+	if (tattleName == "question")    return wxART_QUESTION;
+	if (tattleName == "help")        return wxART_HELP;
+	if (tattleName == "tip")         return wxART_TIP;
+	return "";
+}
+
 wxBEGIN_EVENT_TABLE(InfoDialog, wxDialog)
 	EVT_BUTTON(wxID_OK, InfoDialog::OnOk)
 	EVT_BUTTON(wxID_OPEN, InfoDialog::OnOpen)
@@ -38,8 +50,10 @@ InfoDialog::InfoDialog(wxWindow *parent, wxString title, wxString message,
 	wxSize badgeSize(32, 32);
 #endif
 
-	wxIcon iconInfo = wxArtProvider::GetIcon(iconArtID.length() ? iconArtID : uiConfig.defaultIcon());
-	wxBitmap bmpInfo = wxArtProvider::GetBitmap(iconArtID.length() ? iconArtID : uiConfig.defaultIcon(), "wxART_OTHER_C", badgeSize);
+	if (!iconArtID.length()) iconArtID = GetIconArtID(uiConfig.defaultIcon());
+
+	wxIcon iconInfo = wxArtProvider::GetIcon(iconArtID);
+	wxBitmap bmpInfo = wxArtProvider::GetBitmap(iconArtID, "wxART_OTHER_C", badgeSize);
 
 	SetIcon(iconInfo);
 
@@ -0,0 +1,114 @@
+//
+//  mapped_file.cpp
+//  tattle
+//
+
+#include <wx/defs.h>
+
+#include <vector>
+
+#include "tattle.h"
+
+#include <wx/file.h>
+#include <wx/filename.h>
+
+#ifdef __WINDOWS__
+	#include <wx/msw/wrapwin.h>
+#else
+	#include <sys/mman.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+#endif
+
+
+using namespace tattle;
+
+
+MappedFile::MappedFile(const wxString &path, wxFileOffset offset, size_t length)
+{
+	if (!length || offset < 0) return;
+
+#ifdef __WINDOWS__
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	wxFileOffset aligned = offset - (offset % info.dwAllocationGranularity);
+
+	HANDLE file = CreateFileW(path.wc_str(), GENERIC_READ,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) return;
+
+	HANDLE mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(file);
+	if (!mapping) return;
+
+	_baseSize = size_t(offset - aligned) + length;
+	_base = MapViewOfFile(mapping, FILE_MAP_READ,
+		DWORD(aligned >> 32), DWORD(aligned & 0xFFFFFFFF), _baseSize);
+	CloseHandle(mapping); // The view keeps the mapping alive.
+#else
+	wxFileOffset aligned = offset - (offset % sysconf(_SC_PAGESIZE));
+
+	int fd = open(path.fn_str(), O_RDONLY);
+	if (fd < 0) return;
+
+	_baseSize = size_t(offset - aligned) + length;
+	_base = mmap(NULL, _baseSize, PROT_READ, MAP_PRIVATE, fd, off_t(aligned));
+	close(fd); // The mapping keeps the file alive.
+
+	if (_base == MAP_FAILED) _base = nullptr;
+#endif
+
+	if (_base)
+	{
+		_data = static_cast<const char*>(_base) + (offset - aligned);
+		_size = length;
+	}
+}
+
+std::shared_ptr<const MappedFile> MappedFile::Snapshot(wxFile &file, wxFileOffset offset, size_t length)
+{
+	if (!length || offset < 0 || file.Seek(offset) == wxInvalidOffset) return nullptr;
+
+	// Created readable only by this user.
+	wxFile   copy;
+	wxString path = wxFileName::CreateTempFileName(wxFileName::GetTempDir() + "/tattle-capture", &copy);
+	if (!path.length() || !copy.IsOpened()) return nullptr;
+
+	std::vector<char> chunk(256 * 1024);
+	size_t copied = 0;
+	while (copied < length)
+	{
+		auto n = file.Read(chunk.data(), std::min(chunk.size(), length - copied));
+		if (n <= 0 || copy.Write(chunk.data(), size_t(n)) != size_t(n)) break;
+		copied += size_t(n);
+	}
+	copy.Close();
+
+	// A file which shrank while being copied is captured as far as it went.
+	std::shared_ptr<MappedFile> mapping;
+	if (copied) mapping = std::make_shared<MappedFile>(path, 0, copied);
+
+	if (!mapping || !mapping->isOpen()) {wxRemoveFile(path); return nullptr;}
+
+#ifdef __WINDOWS__
+	mapping->_temporary = path; // Windows keeps mapped files from being removed.
+#else
+	wxRemoveFile(path);         // The mapping keeps the data until it is unmapped.
+#endif
+	return mapping;
+}
+
+MappedFile::~MappedFile()
+{
+	if (_base)
+	{
+#ifdef __WINDOWS__
+		UnmapViewOfFile(_base);
+#else
+		munmap(_base, _baseSize);
+#endif
+	}
+
+	if (_temporary.length()) wxRemoveFile(_temporary);
+}
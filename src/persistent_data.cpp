@@ -1,4 +1,8 @@
 #include <sstream>
+#include <ctime>
+#include <set>
+#include <algorithm>
+#include <cstring>
 
 #include "tattle.h"
 
@@ -12,24 +16,42 @@ PersistentData::PersistentData() :
 {
 }
 
-static bool PersistentData_Load(const wxString &path, Json& json)
+/*
+	The state file is JSON text, or CBOR beginning with the self-describe tag.
+		Either is read; PersistentData::load chooses which is written.
+*/
+static const unsigned char PersistentData_CborMagic[3] = {0xD9, 0xD9, 0xF7};
+
+static bool PersistentData_IsCbor(const std::string &bytes)
+{
+	return bytes.length() >= 3 && std::equal(PersistentData_CborMagic, PersistentData_CborMagic + 3,
+		reinterpret_cast<const unsigned char*>(bytes.data()));
+}
+
+static bool PersistentData_Load(const wxString &path, Json& json, bool *isCbor = nullptr)
 {
 	json = nullptr;
 
-	if (!wxFile::Exists(path)) return false;
-
-	wxFile file(path);
-	if (!file.IsOpened()) return false;
+	std::string bytes;
+	if (!ReadFileBytes(path, bytes)) return false;
 
 	try
 	{
-		wxString contents_str;
-		file.ReadAll(&contents_str);
-		file.Close();
-
-		const auto contents_utf8 = contents_str.ToUTF8();
-
-		json = Json::parse(contents_utf8.data(), contents_utf8.data() + contents_utf8.length(), nullptr, true, true);
+		if (PersistentData_IsCbor(bytes))
+		{
+			json = Json::from_cbor(bytes, true, true, Json::cbor_tag_handler_t::ignore);
+			if (isCbor) *isCbor = true;
+		}
+		else
+		{
+			std::string error;
+			if (!ParseJson(bytes.data(), bytes.data() + bytes.length(), json, error))
+			{
+				std::cout << "Failed to read persistent data from `" << path << "' at " << error << std::endl;
+				return false;
+			}
+			if (isCbor) *isCbor = false;
+		}
 
 		return true;
 	}
@@ -45,47 +67,349 @@ static bool PersistentData_Load(const wxString &path, Json& json)
 	}
 }
 
-static bool PersistentData_Store(const wxString& path, const Json& json)
+static bool PersistentData_Store(const wxString& path, const Json& json, bool cbor)
 {
-	wxFile file(path, wxFile::OpenMode::write);
-	if (!file.IsOpened()) return false;
+	if (cbor)
+	{
+		std::string bytes(reinterpret_cast<const char*>(PersistentData_CborMagic), 3);
+		Json::to_cbor(json, bytes);
+		return WriteFileAtomic(path, bytes);
+	}
+
+	return WriteFileAtomic(path, json.dump(1, '\t', false, nlohmann::detail::error_handler_t::replace));
+}
 
-	file.Write(json.dump(1, '\t', false, nlohmann::detail::error_handler_t::replace));
+/*
+	Updates are appended to a journal beside the state file, one merge patch per line.
+		The journal starts with a header naming it; compaction folds it into the
+		state file and starts a new journal, so other instances know to reload.
+*/
+static const wxFileOffset PersistentData_CompactSize  = 64 * 1024;   // Compacted by maintain()
+static const wxFileOffset PersistentData_JournalLimit = 1024 * 1024; // Compacted on the spot
 
-	file.Close();
+static wxString PersistentData_JournalPath(const wxString &path)    {return path + ".journal";}
+static wxString PersistentData_LockPath   (const wxString &path)    {return path + ".lock";}
 
+static bool PersistentData_NewJournal(const wxString &path, std::string &id, size_t &length)
+{
+	std::string header = Json({{"$journal", Report::makeUUID()}}).dump() + "\n";
+	if (!WriteFileAtomic(PersistentData_JournalPath(path), header)) return false;
+
+	id     = JsonMember(Json::parse(header), "$journal", "");
+	length = header.length();
 	return true;
 }
 
-bool PersistentData::load(wxString path)
+/*
+	Entries are what expire: top-level values, and single records under
+		$show (by type and id), $sent, $uploads, $etags, $replies and $hosts.  $meta holds when each entry
+		was last updated and any TTL in seconds, keyed by JSON pointer.
+*/
+using PersistentData_Visitor = std::function<void(const JsonPointer &entry, const Json &value)>;
+
+static void PersistentData_VisitEntries(const JsonPointer &pointer, const Json &value, size_t depth, const PersistentData_Visitor &visit)
+{
+	if (!depth || !value.is_object()) {visit(pointer, value); return;}
+
+	for (auto i = value.begin(); i != value.end(); ++i)
+		PersistentData_VisitEntries(pointer / i.key(), i.value(), depth - 1, visit);
+}
+
+static void PersistentData_VisitEntries(const Json &data, const PersistentData_Visitor &visit)
 {
-	if (PersistentData_Load(path, _data))
+	if (!data.is_object()) return;
+
+	for (auto i = data.begin(); i != data.end(); ++i)
 	{
-		_path = path;
-		return true;
+		const std::string &key = i.key();
+		if (key == "$meta" || key == "$ttl") continue;
+
+		size_t depth = (key == "$show") ? 2 : ((key == "$sent" || key == "$uploads" || key == "$etags" || key == "$replies" ||
+			key == "$hosts") ? 1 : 0);
+		PersistentData_VisitEntries(JsonPointer() / key, i.value(), depth, visit);
 	}
-	else
+}
+
+// Timestamp the entries a patch touches, and apply TTLs it sets with "$ttl" : {key : seconds}.
+static Json PersistentData_Stamp(Json patch)
+{
+	if (!patch.is_object()) return patch;
+
+	Json ttl = JsonMember(patch, "$ttl", Json::object());
+	patch.erase("$ttl");
+
+	const long long now = std::time(nullptr);
+
+	Json meta = Json::object();
+	PersistentData_VisitEntries(patch, [&](const JsonPointer &entry, const Json &value)
 	{
-		if (_data.is_null()) _data = Json::object({
-			/*{"consent", {}},
-			{"cookies", {}},
-			{"input", {}},*/
-		});
-		if (!_path.length()) _path = path;
-		return false;
+		if (value.is_null()) meta[entry.to_string()] = nullptr;
+		else                 meta[entry.to_string()] = {{"t", now}};
+	});
+
+	if (ttl.is_object()) for (auto i = ttl.begin(); i != ttl.end(); ++i)
+	{
+		auto entry = meta.find((JsonPointer() / i.key()).to_string());
+		if (entry == meta.end() || entry->is_null()) continue; // Deleted or not in this patch
+
+		if (i.value().is_number() && i.value().get<double>() > 0) (*entry)["ttl"] = i.value().get<long long>();
+		else                                                       (*entry)["ttl"] = nullptr;
 	}
+
+	if (meta.size()) patch["$meta"] = std::move(meta);
+	return patch;
+}
+
+// Remove an entry, and any groups it leaves empty.
+static void PersistentData_Erase(Json &data, JsonPointer entry)
+{
+	while (!entry.empty() && data.contains(entry))
+	{
+		JsonPointer parent = entry.parent_pointer();
+		Json &container = data[parent];
+		container.erase(entry.back());
+
+		if (!container.empty()) break;
+		entry = parent;
+	}
+}
+
+bool PersistentData::load(wxString path, bool binary)
+{
+	if (!path.length()) return false;
+	_path   = path;
+	_binary = binary;
+
+	FileLock lock;
+	lock.lock(PersistentData_LockPath(_path));
+
+	_journalId.clear();
+	_journalOffset = 0;
+
+	bool isCbor = false;
+	bool loaded = PersistentData_Load(_path, _data, &isCbor);
+	if (!_data.is_object()) _data = Json::object();
+
+	if (_sync(true)) loaded = true;
+
+	// Convert the file once when switching formats.
+	if (loaded && isCbor != _binary) _compact();
+	return loaded;
+}
+
+bool PersistentData::_sync(bool baseFresh)
+{
+	wxFile file;
+	if (!wxFile::Exists(PersistentData_JournalPath(_path)) || !file.Open(PersistentData_JournalPath(_path))) return false;
+
+	const wxFileOffset length = file.Length();
+	if (length < 0) return false;
+
+	// Read the header; a different journal means the state file was compacted.
+	char head[256];
+	auto headLength = file.Read(head, sizeof(head));
+	if (headLength <= 0) return false;
+
+	const char *headerEnd = static_cast<const char*>(std::memchr(head, '\n', size_t(headLength)));
+	if (!headerEnd) return false;
+
+	std::string id;
+	try {id = JsonMember(Json::parse(static_cast<const char*>(head), headerEnd), "$journal", "");}
+	catch (Json::exception&) {}
+
+	if (id != _journalId || length < wxFileOffset(_journalOffset))
+	{
+		if (!baseFresh)
+		{
+			PersistentData_Load(_path, _data);
+			if (!_data.is_object()) _data = Json::object();
+		}
+		_journalId     = id;
+		_journalOffset = size_t(headerEnd - head) + 1;
+	}
+
+	// Read only what other instances have appended since.
+	if (length <= wxFileOffset(_journalOffset)) return true;
+
+	std::string added(size_t(length - wxFileOffset(_journalOffset)), '\0');
+	if (file.Seek(wxFileOffset(_journalOffset)) == wxInvalidOffset) return false;
+
+	auto consumed = file.Read(&added[0], added.length());
+	if (consumed < 0) return false;
+	added.resize(size_t(consumed));
+
+	// Apply complete lines.  A line cut short by a crash is skipped.
+	size_t lineStart = 0;
+	for (size_t lineEnd; (lineEnd = added.find('\n', lineStart)) != std::string::npos; lineStart = lineEnd + 1)
+	{
+		if (lineEnd == lineStart) continue;
+		try {_data.merge_patch(Json::parse(added.begin() + lineStart, added.begin() + lineEnd));}
+		catch (Json::exception&) {}
+	}
+	_journalOffset += lineStart;
+
+	return true;
+}
+
+bool PersistentData::_append(const Json &patch)
+{
+	if (!_journalId.length() && !PersistentData_NewJournal(_path, _journalId, _journalOffset)) return false;
+
+	wxFile file(PersistentData_JournalPath(_path), wxFile::write_append);
+	if (!file.IsOpened()) return false;
+
+	// Terminate any line left incomplete by a crash.
+	std::string line = patch.dump(-1, ' ', false, nlohmann::detail::error_handler_t::replace) + "\n";
+	if (file.Length() > wxFileOffset(_journalOffset)) line.insert(0, "\n");
+
+	if (file.Write(line.data(), line.length()) != line.length()) return false;
+	file.Flush();
+
+	_journalOffset = size_t(file.Length());
+	_data.merge_patch(patch);
+
+	if (wxFileOffset(_journalOffset) >= PersistentData_JournalLimit) _compact();
+	return true;
+}
+
+bool PersistentData::_compact()
+{
+	// The journal is replaced only after the state file holds everything in it.
+	//   Should we crash between the two, replaying the old journal changes nothing.
+	if (!PersistentData_Store(_path, _data, _binary)) return false;
+	return PersistentData_NewJournal(_path, _journalId, _journalOffset);
 }
 
 bool PersistentData::mergePatch(const Json& patch)
+{
+	return update([&patch](const Json &) {return patch;});
+}
+
+bool PersistentData::update(const std::function<Json(const Json &data)> &makePatch)
 {
 	if (!_path.length()) return false;
 
-	// Attempt to load the latest file data; otherwise use what's in memory
-	Json data;
-	if (!PersistentData_Load(_path, data)) data = this->_data;
-	
-	// Merge patch and store to file.
-	//   merge_patch operation cannot fail, barring an out-of-memory condition.
-	data.merge_patch(patch);
-	return PersistentData_Store(_path, data);
+	FileLock lock;
+	if (!lock.lock(PersistentData_LockPath(_path))) return false;
+
+	// Catch up with other instances, then record the patch.
+	_sync(false);
+
+	Json patch = makePatch(_data);
+	if (patch.is_null() || (patch.is_object() && patch.empty())) return true;
+
+	return _append(PersistentData_Stamp(std::move(patch)));
+}
+
+bool PersistentData::compact()
+{
+	if (!_path.length()) return false;
+
+	FileLock lock;
+	if (!lock.lock(PersistentData_LockPath(_path))) return false;
+
+	_sync(false);
+	return _compact();
+}
+
+bool PersistentData::maintain(size_t maxEntries, long long defaultTTL)
+{
+	if (!_path.length()) return false;
+
+	FileLock lock;
+	if (!lock.lock(PersistentData_LockPath(_path))) return false;
+
+	_sync(false);
+
+	const long long now = std::time(nullptr);
+	bool changed = false;
+
+	if (!_data.is_object()) _data = Json::object();
+	if (!_data["$meta"].is_object()) _data["$meta"] = Json::object();
+	Json &meta = _data["$meta"];
+
+	struct Entry {JsonPointer pointer; long long time;};
+	std::vector<Entry>       live;
+	std::vector<JsonPointer> remove;
+	std::set<std::string>    keep;
+
+	PersistentData_VisitEntries(_data, [&](const JsonPointer &entry, const Json &)
+	{
+		Json &info = meta[entry.to_string()];
+
+		// Entries from before timestamps were kept start aging now.
+		if (!info.is_object()) {info = {{"t", now}}; changed = true;}
+
+		long long time = JsonMember(info, "t", (long long) now), ttl = JsonMember(info, "ttl", (long long) defaultTTL);
+		if (ttl > 0 && time + ttl <= now) remove.push_back(entry);
+		else                              live.push_back({entry, time});
+	});
+
+	// Evict the least recently updated entries beyond the limit.
+	if (maxEntries && live.size() > maxEntries)
+	{
+		std::sort(live.begin(), live.end(), [](const Entry &a, const Entry &b) {return a.time < b.time;});
+		for (size_t i = 0; i < live.size() - maxEntries; ++i) remove.push_back(live[i].pointer);
+		live.erase(live.begin(), live.end() - maxEntries);
+	}
+
+	for (auto &entry : live) keep.insert(entry.pointer.to_string());
+	for (auto &entry : remove) {PersistentData_Erase(_data, entry); changed = true;}
+
+	// Forget timestamps of entries which are gone.
+	for (auto i = meta.begin(); i != meta.end(); )
+	{
+		if (keep.count(i.key())) {++i; continue;}
+		i = meta.erase(i);
+		changed = true;
+	}
+
+	if (changed) std::cout << "Tattle: expired " << remove.size() << " state entries." << std::endl;
+
+	if (changed || wxFileOffset(_journalOffset) >= PersistentData_CompactSize) return _compact();
+	return true;
+}
+
+static Json PersistentData_SentEntry(const Json &data, const std::string &key)
+{
+	Json sent = JsonMember(data, "$sent", Json::object());
+	if (sent.is_object() && sent.contains(key)) return sent[key];
+	return Json::object();
+}
+
+bool PersistentData::sentRecently(const std::string &key, int windowSeconds) const
+{
+	if (windowSeconds <= 0) return false;
+
+	long long last = JsonMember(PersistentData_SentEntry(data, key), "time", 0ll);
+	return std::time(nullptr) - last < windowSeconds;
+}
+
+unsigned PersistentData::suppressedCount(const std::string &key) const
+{
+	return JsonMember(PersistentData_SentEntry(data, key), "suppressed", 0u);
+}
+
+bool PersistentData::countSuppressed(const std::string &key, unsigned occurrences)
+{
+	return update([&](const Json &latest) -> Json
+	{
+		return {{"$sent", {{key, {
+			{"suppressed", JsonMember(PersistentData_SentEntry(latest, key), "suppressed", 0u) + occurrences},
+			{"last_suppressed", (long long) std::time(nullptr)}}}}}};
+	});
+}
+
+bool PersistentData::markSent(const std::string &key, unsigned flushedCount)
+{
+	// Occurrences counted since the report was built stay for the next one.
+	return update([&](const Json &latest) -> Json
+	{
+		unsigned remaining = JsonMember(PersistentData_SentEntry(latest, key), "suppressed", 0u);
+		remaining -= std::min(remaining, flushedCount);
+
+		return {{"$sent", {{key, {
+			{"time", (long long) std::time(nullptr)},
+			{"suppressed", remaining}}}}}};
+	});
 }
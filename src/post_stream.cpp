@@ -0,0 +1,370 @@
+//
+//  post_stream.cpp
+//  tattle
+//
+
+#include <wx/defs.h>
+
+#include <cstring>
+#include <algorithm>
+
+#include "tattle.h"
+
+
+using namespace tattle;
+
+
+PostStream::PostStream(const Report &report, const std::string &boundary_id, bool preQuery,
+	const Report::UploadRefs *uploads) :
+	_contents(report.contents()), _boundary(boundary_id), _preQuery(preQuery),
+	_end(_contents.end()), _closing(true)
+{
+	_start(_contents.begin(), uploads);
+}
+
+PostStream::PostStream(const Report &report, const std::string &boundary_id, size_t first, size_t last, bool closing,
+	const Report::UploadRefs *uploads) :
+	_contents(report.contents()), _boundary(boundary_id), _preQuery(false),
+	_end(_contents.begin() + last), _closing(closing)
+{
+	_start(_contents.begin() + first, uploads);
+}
+
+void PostStream::_start(Part first, const Report::UploadRefs *uploads)
+{
+	if (uploads) _uploads = *uploads;
+
+	// Measure the body without encoding any of it.
+	for (Part i = _nextPart(first); i != _end; i = _nextPart(std::next(i)))
+	{
+		_length += _partHeader(*i).length();
+
+		if      (_uploadRef(*i))        _length += _uploadRef(*i)->length();
+		else if (i->type == PARAM_FILE) _length += i->fileSize();
+		else if (i->type == PARAM_DIR)  _length += i->dirContents ? i->dirContents->archiveSize : 0;
+		else                            _length += _partValue(*i).length();
+	}
+	if (_closing) _length += _finalDivider().length();
+
+	_enterPart(_nextPart(first));
+}
+
+bool PostStream::_includes(const Report::Content &content) const
+{
+	// Only send strings marked for pre-querying
+	return !_preQuery || (content.preQuery && content.type == PARAM_STRING);
+}
+
+PostStream::Part PostStream::_nextPart(Part part) const
+{
+	while (part != _end && !_includes(*part)) ++part;
+	return part;
+}
+
+const std::string *PostStream::_uploadRef(const Report::Content &content) const
+{
+	if (content.type != PARAM_FILE) return nullptr;
+
+	auto i = _uploads.find(content.name);
+	return (i != _uploads.end()) ? &i->second : nullptr;
+}
+
+std::string PostStream::_partHeader(const Report::Content &content) const
+{
+	// All items are preceded and succeeded by a boundary beginning with two hyphen-minus characters.
+	std::string header = "\r\n--" + _boundary + "\r\n";
+
+	// Content disposition and name
+	header += "Content-Disposition: form-data; name=\"";
+	header += content.name;
+	header += "\"";
+
+	auto path = content.filename();
+	if (path.length())
+	{
+		// Filename
+		header += "; filename=\"";
+		header += path;
+		header += "\"";
+	}
+	header += "\r\n";
+
+	// Additional content type info
+	if (_uploadRef(content))
+	{
+		header += "Content-Type: application/x-tattle-upload+json\r\n";
+	}
+	else if (path.length() && content.content_type().length())
+	{
+		header += "Content-Type: ";
+		header += content.content_type();
+		header += "\r\n";
+	}
+	if (content.content_transfer_encoding().length())
+	{
+		header += "Content-Transfer-Encoding: ";
+		header += content.content_transfer_encoding();
+		header += "\r\n";
+	}
+
+	// Empty line...
+	header += "\r\n";
+
+	return header;
+}
+
+std::string PostStream::_partValue(const Report::Content &content) const
+{
+	switch (content.type)
+	{
+	case PARAM_STRING:
+	case PARAM_FIELD:
+	case PARAM_FIELD_MULTI:
+		return content.value();
+
+	case PARAM_FILE:
+	case PARAM_DIR:
+		return std::string(); // Read from fileContents or dirContents instead
+
+	case PARAM_NONE:
+	default:
+		return "Unknown Data:\r\n" + content.value();
+	}
+}
+
+std::string PostStream::_finalDivider() const
+{
+	return "\r\n--" + _boundary + "--\r\n";
+}
+
+void PostStream::_setText(STAGE stage, std::string text)
+{
+	_stage  = stage;
+	_text   = std::move(text);
+	_data   = _text.data();
+	_size   = _text.length();
+	_offset = 0;
+}
+
+void PostStream::_enterPart(Part part)
+{
+	_part = part;
+	if      (_part != _end) _setText(STAGE_HEADER, _partHeader(*_part));
+	else if (_closing)      _setText(STAGE_FINAL,  _finalDivider());
+	else                    _setText(STAGE_DONE,   std::string());
+}
+
+void PostStream::_enterView(size_t view)
+{
+	// Refer to the file contents directly.
+	_setText(STAGE_BODY, std::string());
+	_view = view;
+	if (_view < _part->fileContents.size())
+	{
+		_data = _part->fileContents[_view].data();
+		_size = _part->fileContents[_view].size();
+	}
+}
+
+void PostStream::_advance()
+{
+	switch (_stage)
+	{
+	case STAGE_HEADER:
+		if (_uploadRef(*_part)) _setText(STAGE_BODY, *_uploadRef(*_part));
+		else if (_part->type == PARAM_FILE) _enterView(0);
+		else _setText(STAGE_BODY, _partValue(*_part));
+
+		// Directories are archived as they are sent.
+		if (_part->type == PARAM_DIR && _part->dirContents)
+			_body.reset(new ArchiveStream(*_part->dirContents));
+		break;
+
+	case STAGE_BODY:
+		if (_part->type == PARAM_FILE && !_uploadRef(*_part) && _view+1 < _part->fileContents.size())
+			_enterView(_view+1);
+		else
+			_enterPart(_nextPart(std::next(_part)));
+		break;
+
+	case STAGE_FINAL:
+	case STAGE_DONE:
+		_setText(STAGE_DONE, std::string());
+		break;
+	}
+}
+
+size_t PostStream::OnSysRead(void *buffer, size_t size)
+{
+	char *out = static_cast<char*>(buffer);
+	size_t total = 0;
+
+	while (total < size && _stage != STAGE_DONE)
+	{
+		if (_body)
+		{
+			size_t n = _body->Read(out + total, size - total).LastRead();
+			total += n;
+			if (!n) _body.reset();
+			continue;
+		}
+
+		if (_offset == _size) {_advance(); continue;}
+
+		size_t n = std::min(size - total, _size - _offset);
+		std::memcpy(out + total, _data + _offset, n);
+		_offset += n;
+		total   += n;
+	}
+
+	_position += total;
+
+	if (!total) m_lasterror = wxSTREAM_EOF;
+
+	return total;
+}
+
+
+/*
+	GeneratedStream
+*/
+
+enum {GENERATE_CHUNK = 64 * 1024};
+
+size_t GeneratedStream::Window::OnSysWrite(const void *buffer, size_t size)
+{
+	data.append(static_cast<const char*>(buffer), size);
+	return size;
+}
+
+size_t GeneratedStream::OnSysRead(void *buffer, size_t size)
+{
+	char *out = static_cast<char*>(buffer);
+	size_t total = 0;
+
+	while (total < size)
+	{
+		if (_window.offset == _window.data.length())
+		{
+			_window.data.clear();
+			_window.offset = 0;
+
+			if (_finished) break;
+
+			if (!_generate()) _finished = true;
+			continue;
+		}
+
+		size_t n = std::min(size - total, _window.data.length() - _window.offset);
+		std::memcpy(out + total, _window.data.data() + _window.offset, n);
+		_window.offset += n;
+		total          += n;
+	}
+
+	_position += total;
+
+	if (!total) m_lasterror = wxSTREAM_EOF;
+
+	return total;
+}
+
+
+/*
+	DeflateStream
+*/
+
+bool DeflateStream::_pump(wxInputStream &source, wxZlibOutputStream &zlib)
+{
+	char chunk[GENERATE_CHUNK];
+
+	// Chunks are always the same size, so compression is deterministic.
+	size_t consumed = source.Read(chunk, GENERATE_CHUNK).LastRead();
+	if (!consumed) return false;
+
+	zlib.Write(chunk, consumed);
+	return true;
+}
+
+DeflateStream::DeflateStream(wxInputStream *source, wxInputStream *measure, int zlibFlags) :
+	_source(source),
+	_zlib(_window, wxZ_DEFAULT_COMPRESSION, zlibFlags)
+{
+	// Measure the compressed data without keeping it.
+	{
+		std::unique_ptr<wxInputStream> measureOwner(measure);
+		wxCountingOutputStream counter;
+		{
+			wxZlibOutputStream zlib(counter, wxZ_DEFAULT_COMPRESSION, zlibFlags);
+			while (_pump(*measure, zlib)) {}
+			zlib.Close();
+		}
+		_length = counter.GetLength();
+	}
+}
+
+bool DeflateStream::_generate()
+{
+	// Compress more data, flushing the compressor at the end.
+	if (_pump(*_source, _zlib)) return true;
+
+	_zlib.Close();
+	return false;
+}
+
+
+/*
+	ArchiveStream
+*/
+
+ArchiveStream::ArchiveStream(const DirCapture &capture) :
+	_capture(capture),
+	_zip(_window)
+{
+	_length = _capture.archiveSize;
+}
+
+wxFileOffset ArchiveStream::Measure(const DirCapture &capture)
+{
+	ArchiveStream archive(capture);
+
+	char chunk[GENERATE_CHUNK];
+	wxFileOffset length = 0;
+	while (size_t consumed = archive.Read(chunk, GENERATE_CHUNK).LastRead()) length += consumed;
+	return length;
+}
+
+bool ArchiveStream::_generate()
+{
+	if (_entry == _capture.entries.size())
+	{
+		// Write the central directory.
+		_zip.Close();
+		return false;
+	}
+
+	auto &entry = _capture.entries[_entry];
+
+	if (!_entryOpen)
+	{
+		_zip.PutNextEntry(wxString::FromUTF8(entry.name.data(), entry.name.length()), entry.time);
+		_entryOpen = true;
+		_view = 0;
+		_offset = 0;
+	}
+	else if (_view < entry.data.size())
+	{
+		// Compress one chunk of the file.
+		auto &view = entry.data[_view];
+		size_t n = std::min<size_t>(GENERATE_CHUNK, view.size() - _offset);
+		_zip.Write(view.data() + _offset, n);
+		_offset += n;
+		if (_offset >= view.size()) {++_view; _offset = 0;}
+	}
+	else
+	{
+		_zip.CloseEntry();
+		_entryOpen = false;
+		++_entry;
+	}
+	return true;
+}
@@ -0,0 +1,336 @@
+//
+//  prepared_post.cpp
+//  tattle
+//
+
+#include <wx/defs.h>
+
+#include <cstring>
+#include <deque>
+
+#include "tattle.h"
+
+#include <wx/file.h>
+#include <wx/filename.h>
+
+
+using namespace tattle;
+
+
+enum
+{
+	PREPARE_CHUNK = 64 * 1024,
+};
+
+namespace
+{
+	// Collects compressed output in memory, moving it to a temporary file past the limit (0 = none).
+	class SpillSink : public wxOutputStream
+	{
+	public:
+		SpillSink(PreparedPost::Deflated &out, uint64_t limit) : _out(out), _limit(limit) {}
+
+		uint64_t written() const    {return _written;}
+
+	protected:
+		size_t OnSysWrite(const void *buffer, size_t size) wxOVERRIDE
+		{
+			if (!_file.IsOpened() && _limit && _out.memory.length() + size > _limit && !_spill()) return 0;
+
+			if (_file.IsOpened())
+			{
+				if (_file.Write(buffer, size) != size) {m_lasterror = wxSTREAM_WRITE_ERROR; return 0;}
+			}
+			else _out.memory.append(static_cast<const char*>(buffer), size);
+
+			_written += size;
+			return size;
+		}
+
+	private:
+		bool _spill()
+		{
+			wxString path = wxFileName::CreateTempFileName(wxFileName::GetTempDir() + "/tattle-post", &_file);
+			if (!path.length() || !_file.IsOpened()) {m_lasterror = wxSTREAM_WRITE_ERROR; return false;}
+
+			_out.file = std::shared_ptr<const wxString>(new wxString(path), [](const wxString *path)
+			{
+				wxRemoveFile(*path);
+				delete path;
+			});
+
+			if (_file.Write(_out.memory.data(), _out.memory.length()) != _out.memory.length())
+			{
+				m_lasterror = wxSTREAM_WRITE_ERROR;
+				return false;
+			}
+			std::string().swap(_out.memory);
+			return true;
+		}
+
+		PreparedPost::Deflated &_out;
+		const uint64_t          _limit;
+		wxFile                  _file;
+		uint64_t                _written = 0;
+	};
+
+	// Reads a series of pieces as one stream.
+	class JoinedStream : public wxInputStream
+	{
+	public:
+		// Pieces in memory are referred to, not copied; keep() takes a string to own.
+		void add (const PreparedPost::Deflated &piece)
+		{
+			_pieces.push_back(Piece{piece.file ? nullptr : &piece.memory, piece.file, piece.length});
+			_length += piece.length;
+		}
+		void keep(std::string piece)
+		{
+			_owned.push_back(std::move(piece));
+			_pieces.push_back(Piece{&_owned.back(), nullptr, _owned.back().length()});
+			_length += _owned.back().length();
+		}
+		void keep(PreparedPost::Deflated piece)
+		{
+			if (piece.file) {add(piece); return;}
+
+			piece.memory.resize(size_t(piece.length));
+			keep(std::move(piece.memory));
+		}
+
+		// Something the pieces belong to, kept alive with the stream.
+		void hold(std::shared_ptr<const void> owner)    {_owner = std::move(owner);}
+
+		wxFileOffset GetLength() const wxOVERRIDE    {return wxFileOffset(_length);}
+
+	protected:
+		size_t OnSysRead(void *buffer, size_t size) wxOVERRIDE
+		{
+			char *out = static_cast<char*>(buffer);
+			size_t total = 0;
+
+			while (total < size && _piece < _pieces.size())
+			{
+				const Piece &piece = _pieces[_piece];
+				if (_offset == piece.length) {++_piece; _offset = 0; _file.reset(); continue;}
+
+				size_t n = size_t(std::min<uint64_t>(size - total, piece.length - _offset));
+				if (piece.memory)
+				{
+					std::memcpy(out + total, piece.memory->data() + _offset, n);
+				}
+				else
+				{
+					if (!_file) _file.reset(new wxFile(*piece.file));
+					if (!_file->IsOpened() || _file->Seek(wxFileOffset(_offset)) == wxInvalidOffset ||
+						_file->Read(out + total, n) != ssize_t(n))
+					{
+						m_lasterror = wxSTREAM_READ_ERROR;
+						break;
+					}
+				}
+				_offset += n;
+				total   += n;
+			}
+
+			_position += total;
+
+			if (!total && m_lasterror == wxSTREAM_NO_ERROR) m_lasterror = wxSTREAM_EOF;
+
+			return total;
+		}
+		wxFileOffset OnSysTell() const wxOVERRIDE    {return wxFileOffset(_position);}
+
+	private:
+		struct Piece
+		{
+			const std::string              *memory;
+			std::shared_ptr<const wxString> file;
+			uint64_t                        length;
+		};
+
+		std::shared_ptr<const void>  _owner;
+		std::deque<std::string>      _owned; // Stable addresses as it grows
+		std::vector<Piece>           _pieces;
+		std::unique_ptr<wxFile>      _file;  // Open on the current piece, if a file
+		uint64_t _length = 0, _position = 0, _offset = 0;
+		size_t   _piece = 0;
+	};
+}
+
+
+/*
+	Raw deflate data from separate compressors can be concatenated into one stream
+		if each but the last ends on a byte boundary without a final block, as after
+		a full flush.  The gzip or zlib wrapper is added around the joined data,
+		with a checksum combined from those of the pieces.
+*/
+bool PreparedPost::_compress(Segment &segment, wxInputStream &source, bool last, const std::atomic<bool> *cancel)
+{
+	segment.deflated = Deflated();
+	segment.crc   = 0;
+	segment.adler = 1;
+	segment.size  = 0;
+
+	SpillSink sink(segment.deflated, segment.spillLimit);
+	uint64_t  flushed = 0;
+	{
+		wxZlibOutputStream zlib(sink, wxZ_DEFAULT_COMPRESSION, wxZLIB_NO_HEADER);
+
+		std::vector<char> chunk(PREPARE_CHUNK);
+		while (size_t n = source.Read(chunk.data(), chunk.size()).LastRead())
+		{
+			if (cancel && *cancel) return false;
+
+			segment.crc   = Crc32  (chunk.data(), n, segment.crc);
+			segment.adler = Adler32(chunk.data(), n, segment.adler);
+			segment.size += n;
+
+			zlib.Write(chunk.data(), n);
+		}
+
+		if (last)
+		{
+			zlib.Close();
+			if (!zlib.IsOk() || !sink.IsOk()) return false;
+			flushed = sink.written();
+		}
+		else
+		{
+			zlib.Sync();
+			if (!zlib.IsOk() || !sink.IsOk()) return false;
+			flushed = sink.written();
+		}
+	}
+
+	// The compressor ends its stream when destroyed; keep only the flushed data.
+	segment.deflated.length = flushed;
+	if (!segment.deflated.file) segment.deflated.memory.resize(size_t(flushed));
+	return true;
+}
+
+PreparedPost::PreparedPost(const Report &report, int zlibFlags, std::string boundary, bool background) :
+	_report(report), _zlibFlags(zlibFlags), _boundary(std::move(boundary))
+{
+	const Report::Contents &contents = _report.contents();
+	_covered = contents.size();
+
+	// Group the contents into runs which can or can't be compressed now.
+	for (size_t n = 0; n < _covered; ++n)
+	{
+		const Report::Content &content = contents[n];
+		const bool fixed = content.type != PARAM_FIELD && content.type != PARAM_FIELD_MULTI &&
+			!_report.uploadsSeparately(content);
+
+		if (_segments.empty() || _segments.back().fixed != fixed)
+		{
+			Segment segment;
+			segment.first = n;
+			segment.fixed = fixed;
+			_segments.push_back(segment);
+		}
+		_segments.back().last = n + 1;
+	}
+
+	for (auto &segment : _segments) segment.spillLimit = _spillLimit(segment.first, segment.last);
+
+	if (!background) return;
+
+	_worker = std::thread([this]()
+	{
+		for (auto &segment : _segments)
+		{
+			if (!segment.fixed) continue;
+
+			PostStream source(_report, _boundary, segment.first, segment.last, false);
+			segment.prepared = _compress(segment, source, false, &_cancel);
+			if (_cancel) break;
+		}
+	});
+}
+
+PreparedPost::~PreparedPost()
+{
+	_cancel = true;
+	wait();
+}
+
+void PreparedPost::wait()
+{
+	if (_worker.joinable()) _worker.join();
+}
+
+uint64_t PreparedPost::_spillLimit(size_t first, size_t last) const
+{
+	const Report::Contents &contents = _report.contents();
+	for (size_t n = first; n < last; ++n)
+		if (contents[n].type == PARAM_DIR) return 0;
+
+	return uint64_t(std::max<wxFileOffset>(_report.spill_threshold(), 0));
+}
+
+wxInputStream *PreparedPost::open(const Report::UploadRefs *uploads)
+{
+	wait();
+
+	std::unique_ptr<JoinedStream> body(new JoinedStream);
+	body->hold(shared_from_this());
+
+	const bool gzip = (_zlibFlags == wxZLIB_GZIP);
+
+	if (gzip) body->keep(std::string("\x1f\x8b\x08\0\0\0\0\0\0\xff", 10)); // No name or time; unknown OS
+	else      body->keep(std::string("\x78\x9c", 2));                      // 32K window, default level
+
+	uint32_t crc = 0, adler = 1;
+	uint64_t size = 0;
+
+	auto append = [&](Segment &segment, bool own)
+	{
+		if (own) body->keep(std::move(segment.deflated));
+		else     body->add (segment.deflated);
+
+		crc   = Crc32Combine  (crc,   segment.crc,   segment.size);
+		adler = Adler32Combine(adler, segment.adler, segment.size);
+		size += segment.size;
+	};
+
+	for (auto &segment : _segments)
+	{
+		if (segment.prepared) {append(segment, false); continue;}
+
+		// Fields, uploads and anything the background thread didn't finish.
+		Segment fresh;
+		fresh.first      = segment.first;
+		fresh.last       = segment.last;
+		fresh.spillLimit = segment.spillLimit;
+		PostStream source(_report, _boundary, segment.first, segment.last, false, uploads);
+		if (!_compress(fresh, source, false, nullptr)) return nullptr;
+		append(fresh, true);
+	}
+
+	// Contents added since, and the final boundary.
+	Segment tail;
+	tail.first      = _covered;
+	tail.last       = _report.contents().size();
+	tail.spillLimit = _spillLimit(tail.first, tail.last);
+	{
+		PostStream source(_report, _boundary, tail.first, tail.last, true, uploads);
+		if (!_compress(tail, source, true, nullptr)) return nullptr;
+	}
+	append(tail, true);
+
+	std::string trailer;
+	if (gzip)
+	{
+		const uint32_t isize = uint32_t(size);
+		for (int i = 0; i < 32; i += 8) trailer.push_back(char((crc   >> i) & 0xFF));
+		for (int i = 0; i < 32; i += 8) trailer.push_back(char((isize >> i) & 0xFF));
+	}
+	else
+	{
+		for (int i = 24; i >= 0; i -= 8) trailer.push_back(char((adler >> i) & 0xFF));
+	}
+	body->keep(std::move(trailer));
+
+	return body.release();
+}
@@ -0,0 +1,49 @@
+//
+//  progress_dialog.cpp
+//  tattle
+//
+
+#include "tattle_gui.h"
+
+#include <wx/app.h>
+
+
+using namespace tattle;
+
+
+wxWindow *ProgressDialog::HideParent(wxEvtHandler &parent)
+{
+	wxWindow *parentWindow = dynamic_cast<wxWindow*>(&parent);
+
+	// Hack for ordering issue
+	if (parentWindow && uiConfig.stayOnTop())
+	{
+		parentWindow->Hide();
+		return parentWindow;
+	}
+	return nullptr;
+}
+
+ProgressDialog::ProgressDialog(const wxString &title, const wxString &message, wxEvtHandler &parent) :
+	_hiddenParent(HideParent(parent)),
+	_dialog(title, message, 100, _hiddenParent ? nullptr : dynamic_cast<wxWindow*>(&parent),
+		wxPD_APP_MODAL | wxPD_AUTO_HIDE | uiConfig.style())
+{
+	_dialog.SetIcon(wxArtProvider::GetIcon(GetIconArtID(uiConfig.defaultIcon())));
+	_dialog.Show();
+	_dialog.Raise();
+}
+
+ProgressDialog::~ProgressDialog()
+{
+	// Ordering issue hack
+	//  TODO this causes the prompt window to "blink in" after posting
+	_dialog.Hide();
+	if (_hiddenParent) _hiddenParent->Show();
+}
+
+void ProgressDialog::update(int percent, const wxString &message)
+{
+	_dialog.Update(percent, message);
+	wxYield();
+}
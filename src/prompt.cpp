@@ -5,7 +5,7 @@
 //  Created by Evan Balster on 11/12/16.
 //
 
-#include "tattle.h"
+#include "tattle_gui.h"
 
 //Dialog stuff
 #include <wx/button.h>
@@ -42,9 +42,10 @@ void Prompt::OnSubmit(wxCommandEvent & event)
 
 	for (Fields::iterator i = fields.begin(); i != fields.end(); ++i)
 	{
-		if (i->content->input_warning().length() && !i->control->GetValue().length())
+		const Report::Content &content = report.contents()[i->content];
+		if (content.input_warning().length() && !i->control->GetValue().length())
 		{
-			input_warnings += i->content->input_warning();
+			input_warnings += content.input_warning();
 			input_warnings += "\n";
 		}
 	}
@@ -97,12 +98,13 @@ void Prompt::UpdateReportFromFields()
 
 	for (Fields::iterator i = fields.begin(); i != fields.end(); ++i)
 	{
-		if (i->content->persist())
+		const Report::Content &content = report.contents()[i->content];
+		if (content.persist())
 		{
-			persistInputs[i->content->name] = i->control->GetValue();
+			persistInputs[content.name] = i->control->GetValue();
 		}
 
-		i->content->user_input = i->control->GetValue();
+		content.user_input = i->control->GetValue();
 	}
 
 	if (dontShowAgainBox && dontShowAgainBox->GetValue())
@@ -217,7 +219,7 @@ wxWindow *Prompt::DisplayReply(const Report::Reply &reply, wxWindow *parent)
 
 		if (shouldDisplayInfoDialog && (!reply.identity || persist.shouldShow(reply.identity)))
 		{
-			return new InfoDialog(parent, title, msg, reply.link, reply.command, reply.icon, reply.identity);
+			return new InfoDialog(parent, title, msg, reply.link, reply.command, GetIconArtID(reply.icon), reply.identity);
 		}
 		else
 		{
@@ -239,7 +241,7 @@ wxWindow *Prompt::DisplayReply(const Report::Reply &reply, wxWindow *parent)
 
 	if (errorMessage.Length())
 	{
-		return new InfoDialog(parent, wxT("Send Failed"), errorMessage, "", Report::SC_PROMPT, reply.icon, reply.identity);
+		return new InfoDialog(parent, wxT("Send Failed"), errorMessage, "", Report::SC_PROMPT, GetIconArtID(reply.icon), reply.identity);
 	}
 
 	return NULL;
@@ -253,7 +255,7 @@ Prompt::Prompt(wxWindow * parent, wxWindowID id, Report &_report)
 	report(_report),
 	fontTechnical(8, wxFONTFAMILY_TELETYPE, wxFONTSTYLE_NORMAL, wxFONTWEIGHT_NORMAL)
 {
-	SetIcon(wxArtProvider::GetIcon(uiConfig.defaultIcon()));
+	SetIcon(wxArtProvider::GetIcon(GetIconArtID(uiConfig.defaultIcon())));
 
 
 	const unsigned MARGIN = uiConfig.marginSm();
@@ -279,6 +281,10 @@ Prompt::Prompt(wxWindow * parent, wxWindowID id, Report &_report)
 			sizerTop->Add(new wxStaticLine(this), 0, wxEXPAND | wxALL, MARGIN);
 	}
 
+	// Filled by ShowReply if the query runs alongside the prompt.
+	replyArea = new wxBoxSizer(wxVERTICAL);
+	sizerTop->Add(replyArea, 0, wxEXPAND);
+
 	const bool layout_displayTechBox = (report.identity() || uiConfig.promptTechnical().length());
 
 	wxButton *reviewButton = nullptr;
@@ -353,75 +359,97 @@ Prompt::Prompt(wxWindow * parent, wxWindowID id, Report &_report)
 	
 	wxTextCtrl *firstField = NULL;
 
-	for (Report::Contents::const_iterator i = report.contents().begin(); i != report.contents().end(); ++i)
-		switch (i->type)
+	// Fields named in gui.prompt.input_order come first, then the rest in report order.
+	std::vector<size_t> inputs;
 	{
-	case PARAM_FIELD:
+		const Report::Contents &contents = report.contents();
+		std::vector<bool> placed(contents.size(), false);
+
+		auto isInput = [&contents](size_t n)    {return contents[n].type == PARAM_FIELD || contents[n].type == PARAM_FIELD_MULTI;};
+
+		for (auto &name : uiConfig.inputOrder())
 		{
-			wxStaticText *label = new wxStaticText(this, -1, i->label());
-			
-			ApplyMarkup(label, i->label());
+			size_t n = contents.indexOf(name);
+			if (n != Report::Contents::npos && isInput(n) && !placed[n]) {placed[n] = true; inputs.push_back(n);}
+		}
+		for (size_t n = 0; n < contents.size(); ++n)
+			if (isInput(n) && !placed[n]) inputs.push_back(n);
+	}
 
-			// Initial field value may come from persistent data store.
-			wxString initialFieldValue = i->value();
-			if (i->persist()) // TODO potential encoding problems here??
-			{
-				if (persist.data.contains(i->name))
-					initialFieldValue = persist.data.value(i->name, std::string(initialFieldValue));
-			}
+	for (size_t index : inputs)
+	{
+		const Report::Content *i = &report.contents()[index];
 
-			wxTextCtrl *field = new wxTextCtrl(this, -1, initialFieldValue,
-				wxDefaultPosition, wxDefaultSize, 0, wxDefaultValidator, i->name);
+		switch (i->type)
+		{
+		case PARAM_FIELD:
+			{
+				wxStaticText *label = new wxStaticText(this, -1, i->label());
 				
-			Field fieldEntry = {&*i, field}; fields.push_back(fieldEntry);
+				ApplyMarkup(label, i->label());
 
-			if (i->placeholder().length()) field->SetHint(i->placeholder());
+				// Initial field value may come from persistent data store.
+				wxString initialFieldValue = i->value();
+				if (i->persist()) // TODO potential encoding problems here??
+				{
+					if (persist.data.contains(i->name))
+						initialFieldValue = persist.data.value(i->name, std::string(initialFieldValue));
+				}
 
-			if (!sizerField)
-			{
-				// Start a new flex grid for this run of one-liner fields
-				sizerField = new wxFlexGridSizer(2);
-				sizerField->AddGrowableCol(1, 1);
-				sizerTop->Add(sizerField, 0, wxEXPAND | wxALL, 0);
+				wxTextCtrl *field = new wxTextCtrl(this, -1, initialFieldValue,
+					wxDefaultPosition, wxDefaultSize, 0, wxDefaultValidator, i->name);
+					
+				Field fieldEntry = {index, field}; fields.push_back(fieldEntry);
+
+				if (i->placeholder().length()) field->SetHint(i->placeholder());
+
+				if (!sizerField)
+				{
+					// Start a new flex grid for this run of one-liner fields
+					sizerField = new wxFlexGridSizer(2);
+					sizerField->AddGrowableCol(1, 1);
+					sizerTop->Add(sizerField, 0, wxEXPAND | wxALL, 0);
+				}
+
+				sizerField->Add(label, 0, wxALL | wxALIGN_CENTER_VERTICAL, MARGIN);
+				sizerField->Add(field, 0, wxEXPAND | wxALL, MARGIN);
+				
+				if (!firstField) firstField = field;
 			}
+			break;
 
-			sizerField->Add(label, 0, wxALL | wxALIGN_CENTER_VERTICAL, MARGIN);
-			sizerField->Add(field, 0, wxEXPAND | wxALL, MARGIN);
-			
-			if (!firstField) firstField = field;
-		}
-		break;
+		case PARAM_FIELD_MULTI:
+			{
+				if (sizerField) sizerField = NULL;
 
-	case PARAM_FIELD_MULTI:
-		{
-			if (sizerField) sizerField = NULL;
+				wxStaticText *label = new wxStaticText(this, -1, i->label());
 
-			wxStaticText *label = new wxStaticText(this, -1, i->label());
+				wxTextCtrl *field = new wxTextCtrl(this, -1, i->value(),
+					wxDefaultPosition, wxSize(400, 100), wxTE_MULTILINE, wxDefaultValidator, i->name);
+					
+				Field fieldEntry = {index, field}; fields.push_back(fieldEntry);
 
-			wxTextCtrl *field = new wxTextCtrl(this, -1, i->value(),
-				wxDefaultPosition, wxSize(400, 100), wxTE_MULTILINE, wxDefaultValidator, i->name);
+				sizerTop->Add(label, 0, wxEXPAND | wxALL, MARGIN);
+				sizerTop->Add(field, 0, wxEXPAND | wxALL, MARGIN);
 				
-			Field fieldEntry = {&*i, field}; fields.push_back(fieldEntry);
-
-			sizerTop->Add(label, 0, wxEXPAND | wxALL, MARGIN);
-			sizerTop->Add(field, 0, wxEXPAND | wxALL, MARGIN);
+				if (!firstField) firstField = field;
+			}
 			
-			if (!firstField) firstField = field;
+		default:
+			// Not fields
+			break;
 		}
-		
-	default:
-		// Not fields
-		break;
 	}
 
-	if (report.connectionWarning)
 	{
-		wxStaticText *messageText = new wxStaticText(this, -1,
+		// Hidden until a connection problem is known; it may show up later.
+		connectionWarningText = new wxStaticText(this, -1,
 			wxT("Check your internet connection."));
 
-		messageText->SetForegroundColour(*wxRED);
+		connectionWarningText->SetForegroundColour(*wxRED);
 
-		sizerTop->Add(messageText, 0, wxALIGN_RIGHT | wxLEFT | wxRIGHT, MARGIN);
+		sizerTop->Add(connectionWarningText, 0, wxALIGN_RIGHT | wxLEFT | wxRIGHT, MARGIN);
+		sizerTop->Show(connectionWarningText, report.connectionWarning);
 	}
 
 	{
@@ -467,6 +495,71 @@ Prompt::Prompt(wxWindow * parent, wxWindowID id, Report &_report)
 	if (firstField) firstField->SetFocus();
 }
 
+void Prompt::ShowReply(const Report::Reply &reply)
+{
+	const unsigned MARGIN = uiConfig.marginSm();
+
+	replyArea->Clear(true);
+
+	if (!reply.connected())
+	{
+		wxStaticText *warning = new wxStaticText(this, -1,
+			wxT("Couldn't check for solutions.  Check your internet connection."));
+
+		warning->SetForegroundColour(*wxRED);
+
+		replyArea->Add(warning, 0, wxALIGN_LEFT | wxALL, MARGIN);
+	}
+	else if (reply.valid() && (!reply.identity || persist.shouldShow(reply.identity)))
+	{
+		if (reply.title.length())
+		{
+			wxStaticText *title = new wxStaticText(this, -1, reply.title);
+			title->SetFont(wxFontInfo(12).AntiAliased());
+			replyArea->Add(title, 0, wxALIGN_LEFT | wxALL, MARGIN);
+		}
+
+		if (reply.message.length())
+		{
+			wxString message = reply.message;
+			message.Replace("\r", "");
+
+			wxStaticText *text = new wxStaticText(this, -1, message);
+			text->Wrap(400);
+			replyArea->Add(text, 0, wxALIGN_LEFT | wxALL, MARGIN);
+		}
+
+		if (reply.sentLink())
+		{
+			wxHyperlinkCtrl *anchor = new wxHyperlinkCtrl(this, -1, reply.link, reply.link);
+
+			// As in InfoDialog, following the link may end the report.
+			const Report::SERVER_COMMAND command = reply.command;
+			anchor->Bind(wxEVT_HYPERLINK, [command](wxHyperlinkEvent &event)
+			{
+				if (wxLaunchDefaultBrowser(event.GetURL()) && command == Report::SC_STOP_ON_LINK)
+					Tattle_Halt();
+			});
+
+			replyArea->Add(anchor, 0, wxALIGN_LEFT | wxALL, MARGIN);
+		}
+
+		replyArea->Add(new wxStaticLine(this), 0, wxEXPAND | wxALL, MARGIN);
+	}
+
+	Layout();
+	GetSizer()->Fit(this);
+}
+
+void Prompt::ShowConnectionWarning()
+{
+	if (!connectionWarningText || connectionWarningText->IsShown()) return;
+
+	GetSizer()->Show(connectionWarningText);
+	Layout();
+	GetSizer()->Fit(this);
+}
+
 Prompt::~Prompt()
 {
 	int i = 5;
@@ -9,6 +9,8 @@
 
 #include <cstring>
 #include <algorithm>
+#include <vector>
+#include <random>
 
 #include "tattle.h"
 
@@ -28,7 +30,6 @@ Report::Report()
 
 	config = Json::object();
 	config["service"]  = Json::object();
-	config["service"]["url"] = Json::object();
 	config["path"] = Json::object();
 	config["gui"]  = Json::object();
 	config["gui"]["prompt"] = Json::object();
@@ -44,75 +45,278 @@ Report::Report()
 
 void Report::_parse_urls() const
 {
-	if (config["service"].contains("url"))
-	{
-		auto& urls = config["service"]["url"];
-		if (urls.contains("post"))
-			url_cache.post .set(urls.value("prefix", "") + urls.value("post",  ""));
-		if (urls.contains("query"))
-			url_cache.query.set(urls.value("prefix", "") + urls.value("query", ""));
-		url_cache.parsed = true; // TODO make this a proper one-time operation.
-	}
+	auto &urls = settings().service.url;
+
+	url_cache.post = url_cache.query = url_cache.upload = ParsedURL();
+	if (urls.post.length())
+		url_cache.post  .set(urls.prefix + urls.post);
+	if (urls.query.length())
+		url_cache.query .set(urls.prefix + urls.query);
+	if (urls.upload.length())
+		url_cache.upload.set(urls.prefix + urls.upload);
+	url_cache.parsed = true;
+}
+
+void Report::_resolve_settings() const
+{
+	settings_cache.command = config::Command();
+	settings_cache.errors.clear();
+	settings_cache.warnings.clear();
+	config::Load(config, settings_cache.command, settings_cache.errors, std::string(), &settings_cache.warnings);
+	settings_cache.resolved = true;
 }
 
+// Settings are resolved on first use and again by compile(), after which the Report is read-only.
+const config::Command &Report::settings() const
+{
+	if (!settings_cache.resolved)
+		_resolve_settings();
+	return settings_cache.command;
+}
+const config::Errors &Report::configErrors() const
+{
+	if (!settings_cache.resolved)
+		_resolve_settings();
+	return settings_cache.errors;
+}
+const config::Errors &Report::configWarnings() const
+{
+	if (!settings_cache.resolved)
+		_resolve_settings();
+	return settings_cache.warnings;
+}
+
+// URLs are parsed on first use and again by compile(), after which the Report is read-only.
 const Report::ParsedURL& Report::url_post() const
 {
-	//if (!url_cache.parsed)
+	if (!url_cache.parsed)
 		_parse_urls();
 	return url_cache.post;
 }
 const Report::ParsedURL& Report::url_query() const
 {
-	//if (!url_cache.parsed)
+	if (!url_cache.parsed)
 		_parse_urls();
 	return url_cache.query;
 }
+const Report::ParsedURL& Report::url_upload() const
+{
+	if (!url_cache.parsed)
+		_parse_urls();
+	return url_cache.upload;
+}
 
+Report::Timeouts Report::timeouts(bool interactive) const
+{
+	const long long fallback = interactive ? 45 : 6;
+	auto &limits = settings().service.timeout;
+
+	Timeouts result;
+	result.connect = int(limits.connect.value_or(fallback));
+	result.send    = int(limits.send   .value_or(fallback));
+	result.reply   = int(limits.reply  .value_or(fallback));
+	result.total   = int(limits.total  .value_or(0));
+	return result;
+}
 
-Report::Content *Report::findContent(const wxString &name)
+Report::RetryPolicy Report::retry_policy() const
 {
-	for (auto &content : _contents) if (content.name == name) return &content;
-	return NULL;
+	auto &retry = settings().service.retry;
+
+	RetryPolicy result;
+	result.attempts    = unsigned(retry.attempts);
+	result.backoff     = retry.backoff;
+	result.max_backoff = retry.max_backoff;
+	return result;
 }
 
-const Report::Content *Report::findContent(const wxString &name) const
+Report::RetryPolicy Report::spool_retry_policy() const
 {
-	for (auto &content : _contents) if (content.name == name) return &content;
-	return NULL;
+	RetryPolicy result;
+	result.attempts    = unsigned(settings().spool.max_attempts);
+	result.backoff     = 60;
+	result.max_backoff = 86400;
+	return result;
 }
 
+Report::UploadPolicy Report::upload_policy() const
+{
+	auto &upload = settings().service.upload;
 
-Report::Content::Content() :
-	type(PARAM_NONE), preQuery(false)
+	UploadPolicy result;
+	result.threshold  = wxFileOffset(upload.threshold);
+	result.chunk_size = size_t(upload.chunk_size);
+	result.parallel   = unsigned(upload.parallel);
+	return result;
+}
+
+static std::mt19937 &RandomEngine()
 {
+	thread_local std::mt19937 rng{std::random_device{}()};
+	return rng;
 }
 
+// A random (version 4) UUID.
+std::string Report::makeUUID()
+{
+	std::uniform_int_distribution<int> nibble(0, 15);
+
+	std::string uuid;
+	for (unsigned i = 0; i < 32; ++i)
+	{
+		if (i == 8 || i == 12 || i == 16 || i == 20) uuid.push_back('-');
+
+		int n = nibble(RandomEngine());
+		if (i == 12) n = 4;               // version
+		if (i == 16) n = 8 | (n & 3);     // variant
+		uuid.push_back("0123456789abcdef"[n]);
+	}
+	return uuid;
+}
 
-static void DumpString(wxMemoryBuffer &dest, const char *src)
+std::string Report::makeBoundary()
 {
-	dest.AppendData((void*) src, std::strlen(src));
+	std::mt19937 &rng = RandomEngine();
+	std::uniform_int_distribution<int> digit(0, 9);
+
+	std::string boundary_id = "tattle-boundary-";
+	for (unsigned i = 0; i < 12; ++i) boundary_id.push_back(char('0' + digit(rng)));
+	return boundary_id;
 }
 
-static void DumpString(wxMemoryBuffer &dest, const std::string src)
+std::string Report::dedupe_key() const
 {
-	dest.AppendData((void*) &src[0], src.length());
+	if (!dedupe_by_contents())
+	{
+		auto id = identity();
+		return id.type + ":" + id.id;
+	}
+
+	// Checksum of names, values and captured data, in order.
+	uint32_t crc = 0;
+	auto add = [&crc](const void *data, size_t size)    {crc = Crc32(data, size, crc);};
+	auto addViews = [&add](const FileViews &views)    {for (auto &view : views) add(view.data(), view.size());};
+
+	for (auto &content : _contents)
+	{
+		std::string value = content.value();
+		add(content.name.data(), content.name.length() + 1);
+		add(value.data(), value.length() + 1);
+
+		addViews(content.fileContents);
+		if (content.dirContents) for (auto &entry : content.dirContents->entries)
+		{
+			add(entry.name.data(), entry.name.length() + 1);
+			addViews(entry.data);
+		}
+	}
+
+	return wxString::Format("#%08x", unsigned(crc)).ToStdString();
 }
 
-static void DumpString(wxMemoryBuffer &dest, const wxString &src)
+unsigned Report::suppressDuplicate(PersistentData &state, Admission *admission) const
 {
-	wxScopedCharBuffer utf8 = src.ToUTF8();
-	dest.AppendData(utf8.data(), utf8.length());
+	if (dedupe_window() <= 0) return 0;
+
+	std::string key = dedupe_key();
+	if (!state.sentRecently(key, dedupe_window())) return 0;
+
+	unsigned occurrences = admission ? admission->occurrences() : 1;
+	state.countSuppressed(key, occurrences);
+	if (admission) admission->reported(occurrences);
+	return occurrences;
+}
+
+Report::Occurrences Report::stampOccurrences(PersistentData &state, Admission *admission)
+{
+	// The key is taken before stamping, which changes a contents checksum.
+	Occurrences result;
+	if (dedupe_window() > 0)
+	{
+		result.key = dedupe_key();
+		result.suppressed = state.suppressedCount(result.key);
+	}
+
+	if (admission || result.key.length())
+	{
+		unsigned occurrences = admission ? admission->occurrences() : 1;
+		setString("occurrences", std::to_string(occurrences + result.suppressed));
+		if (admission) admission->reported(occurrences);
+	}
+	return result;
+}
+
+void Report::markDelivered(PersistentData &state, const Occurrences &occurrences,
+	const Reply &reply, bool spooled) const
+{
+	if (!occurrences.key.length()) return;
+
+	if ((reply.statusCode >= 200 && reply.statusCode < 300) || spooled)
+		state.markSent(occurrences.key, occurrences.suppressed);
+}
+
+
+size_t Report::Contents::indexOf(const std::string &name) const
+{
+	auto i = _index.find(name);
+	return (i != _index.end()) ? i->second : npos;
+}
+
+size_t Report::Contents::add(Content &&content)
+{
+	size_t index = _items.size();
+	_index.emplace(content.name, index); // Keeps the first of any duplicates
+	_items.push_back(std::move(content));
+	return index;
 }
 
-static void DumpBuffer(wxMemoryBuffer &dest, const wxMemoryBuffer &src)
+void Report::setString(const std::string &name, const std::string &value)
+{
+	// The prepared post reads the contents; it must finish before they change,
+	//   and is dropped if a part it compressed has.
+	if (_prepared)
+	{
+		_prepared->wait();
+		if (_contents.indexOf(name) < _prepared->covered()) _prepared.reset();
+	}
+
+	Content *content = findContent(name);
+	if (!content)
+	{
+		Content added;
+		added.name = name;
+		content = &_contents[_contents.add(std::move(added))];
+	}
+
+	content->type         = PARAM_STRING;
+	content->initialValue = value;
+	content->user_input.clear();
+}
+
+
+
+Report::Content::Content() :
+	type(PARAM_NONE), preQuery(false)
 {
-	dest.AppendData(src.GetData(), src.GetDataLen());
 }
 
+
 void Report::compile()
 {
-	auto process_contents = [](Contents &contents, Json& j_contents, bool preQuery)
+	_resolve_settings();
+	_parse_urls();
+
+	// Hosts may supply their own key, eg. to deduplicate reports across invocations.
+	_idempotencyKey = settings().report.idempotency_key;
+	if (!_idempotencyKey.length()) _idempotencyKey = makeUUID();
+
+	// Resolve each content's options once.  Schema violations are listed by configErrors().
+	_contents.reserve(_contents.size() + settings().report.query.size() + settings().report.contents.size());
+
+	auto process_contents = [](Contents &contents, const Json &j_contents, bool preQuery)
 	{
+		config::Errors errors;
+
 		for (auto i = j_contents.begin(); i != j_contents.end(); ++i)
 		{
 			if (!i.key().length()) continue;
@@ -123,244 +327,201 @@ void Report::compile()
 			content.preQuery = preQuery;
 			content.name = i.key();
 
-			if (i.value().is_string())
+			const Json &options = i.value();
+			if (options.is_string())
 			{
-				content.json = {{"value", i.value()}};
+				content.initialValue = options.get<std::string>();
 				content.type = PARAM_STRING;
 			}
-			else if (i.value().is_object())
+			else if (options.is_object())
 			{
-				content.json = i.value(); // Make a copy.
-
-				auto path = JsonMember(content.json, "path", "");
-				auto input = JsonMember(content.json, "input", "");
-				if (path.length())
+				if (options.contains("path"))
 				{
 					content.type = PARAM_FILE;
+					config::Load(options, content.fileConfig, errors);
+				}
+				else if (options.contains("dir"))
+				{
+					content.type = PARAM_DIR;
+					config::Load(options, content.dirConfig, errors);
 				}
-				else if (input.length())
+				else if (options.contains("input"))
 				{
-					content.type = PARAM_FIELD;
-					if (input == "multiline") content.type = PARAM_FIELD_MULTI;
+					config::Load(options, content.inputConfig, errors);
+					content.initialValue = content.inputConfig.value;
+					content.type = (content.inputConfig.input == "multiline") ? PARAM_FIELD_MULTI : PARAM_FIELD;
 				}
-				else if (content.json.contains("value"))
+				else
 				{
+					content.initialValue = JsonMember(options, "value", "");
 					content.type = PARAM_STRING;
 				}
 			}
 			else
 			{
-				// TODO: this should be an error.
 				content.type = PARAM_STRING;
 			}
-			contents.push_back(std::move(content));
+			contents.add(std::move(content));
 		}
 	};
 
 	// Pre-query data
-	if (config["report"].contains("query"))
-		process_contents(_contents, config["report"]["query"], true);
+	process_contents(_contents, settings().report.query, true);
 
 	// General data
-	if (config["report"].contains("contents"))
-		process_contents(_contents, config["report"]["contents"], false);
+	process_contents(_contents, settings().report.contents, false);
 
 
-	for (Contents::iterator i = _contents.begin(); i != _contents.end(); ++i)
+	// Read attached files, sharing the result between identical attachments.
+	struct FileJob
 	{
-		if (i->type == PARAM_FILE)
-		{
-			if (!wxFile::Access(i->path(), wxFile::read))
-			{
-				DumpString(i->fileContents, wxT("[File not found]"));
-				continue;
-			}
+		wxString    path;
+		unsigned    trunc_begin, trunc_end;
+		std::string trunc_note;
+		bool        map;
+		FileViews   contents;
+	};
+	std::vector<FileJob>                     jobs;
+	std::vector<std::pair<Content*, size_t>> assignments;
+	std::unordered_map<std::string, size_t>  jobIndex; // By path and capture options
 
-			// Open the file
-			wxFile file(i->path());
-			
-			if (!file.IsOpened())
-			{
-				DumpString(i->fileContents, wxT("[File not found]"));
-				continue;
-			}
-			
-			// Clear any pre-existing contents
-			i->fileContents.Clear();
-			
-			// Read the file into the post buffer directly
-			wxFileOffset fileLength = file.Length();
-
-			auto
-				trunc_begin = i->truncate_begin(),
-				trunc_end   = i->truncate_end();
-			auto
-				trunc_note = i->truncate_note();
-			
-			if ((trunc_begin || trunc_end) && (trunc_begin+trunc_end < fileLength))
-			{
-				// Trim the file
-				if (trunc_begin)
-				{
-					size_t consumed = file.Read(i->fileContents.GetAppendBuf(trunc_begin), trunc_begin);
-					i->fileContents.UngetAppendBuf(consumed);
-					
-					DumpString(i->fileContents, " ...\r\n\r\n");
-				}
-				if (trunc_note.length())
-				{
-					DumpString(i->fileContents, trunc_note);
-				}
-				if (trunc_end)
-				{
-					DumpString(i->fileContents, "\r\n\r\n... ");
-					file.Seek(-wxFileOffset(trunc_end), wxFromEnd);
-					size_t consumed = file.Read(i->fileContents.GetAppendBuf(trunc_end), trunc_end);
-					i->fileContents.UngetAppendBuf(consumed);
-				}
-			}
-			else
-			{
-				size_t consumed = file.Read(i->fileContents.GetAppendBuf(fileLength), fileLength);
-				i->fileContents.UngetAppendBuf(consumed);
-			}
-		}
+	for (auto &content : _contents)
+	{
+		if (content.type != PARAM_FILE) continue;
+
+		const bool map = (content.capture() == "map");
+		std::string key = content.path() + '\0' + std::to_string(content.truncate_begin()) + '\0' +
+			std::to_string(content.truncate_end()) + '\0' + content.truncate_note() + (map ? "\0m" : "\0r");
+
+		auto job = jobIndex.emplace(std::move(key), jobs.size());
+		if (job.second) jobs.push_back({wxString::FromUTF8(content.path()),
+			content.truncate_begin(), content.truncate_end(), content.truncate_note(), map, {}});
+
+		assignments.emplace_back(&content, job.first->second);
+	}
+
+	// Read files concurrently with a small pool of workers.
+	const wxFileOffset mapThreshold = map_threshold();
+
+	ParallelFor(jobs.size(), [&](size_t n)
+	{
+		auto &job = jobs[n];
+		CaptureFile(job.contents, job.path, job.trunc_begin, job.trunc_end, job.trunc_note,
+			job.map, mapThreshold);
+	});
+
+	for (auto &assignment : assignments)
+		assignment.first->fileContents = jobs[assignment.second].contents;
+
+	// Capture directories, which are walked in parallel.
+	for (auto &content : _contents)
+	{
+		if (content.type != PARAM_DIR) continue;
+
+		content.dirContents = CaptureDirectory(content.dir(),
+			content.dir_include(), content.dir_exclude(),
+			content.max_file_size(), content.max_total_size(), mapThreshold);
 	}
+
+	// Compress what we can of the post while the user fills in the prompt.
+	auto compression = post_compression();
+	_prepared.reset();
+	if (url_post().isSet() && (compression == "gzip" || compression == "deflate"))
+		_prepared = std::make_shared<PreparedPost>(*this, (compression == "gzip") ? wxZLIB_GZIP : wxZLIB_ZLIB, makeBoundary());
 }
 
+bool Report::uploadsSeparately(const Content &content) const
+{
+	const UploadPolicy policy = upload_policy();
 
+	return content.type == PARAM_FILE && policy.threshold > 0 && url_upload().isSet() &&
+		wxFileOffset(content.fileSize()) >= policy.threshold;
+}
 
-void Report::encodePost(wxMemoryBuffer &postBuffer, wxString boundary_id, bool preQuery) const
+std::string Report::postBoundary() const
 {
-	// Boundary beginning with two hyphen-minus characters
-	wxString boundary_divider       = "\r\n--" + boundary_id + "\r\n";
-	wxString boundary_divider_final = "\r\n--" + boundary_id + "--\r\n";
-	
-	for (Contents::const_iterator i = _contents.begin(); true; ++i)
+	return _prepared ? _prepared->boundary() : makeBoundary();
+}
+
+
+
+wxInputStream *Report::encodePost(const std::string &boundary_id, bool preQuery, const UploadRefs *uploads) const
+{
+	// Queries are always sent uncompressed.
+	auto compression = post_compression();
+
+	if (!preQuery && (compression == "gzip" || compression == "deflate"))
 	{
-		if (preQuery && i != _contents.end())
-		{
-			// Only send strings marked for pre-querying
-			if (!i->preQuery || i->type != PARAM_STRING) continue;
-		}
-	
-		
-	
-		// Not the last item, is it?
-		if (i == _contents.end())
-		{
-			// All items are preceded and succeeded by a boundary.
-			DumpString(postBuffer, boundary_divider_final);
-			break;
-		}
-		else
-		{
-			// All items are preceded and succeeded by a boundary.
-			DumpString(postBuffer, boundary_divider);
-		}
-	
-		// Content disposition and name
-		DumpString(postBuffer, "Content-Disposition: form-data; name=\"");
-		DumpString(postBuffer, i->name);
-		DumpString(postBuffer, "\"");
-		if (i->path().length())
+		const int zlibFlags = (compression == "gzip") ? wxZLIB_GZIP : wxZLIB_ZLIB;
+
+		if (_prepared && boundary_id == _prepared->boundary())
 		{
-			// Filename
-			DumpString(postBuffer, "; filename=\"");
-			DumpString(postBuffer, i->path());
-			DumpString(postBuffer, "\"");
+			if (wxInputStream *prepared = _prepared->open(uploads)) return prepared;
 		}
-		DumpString(postBuffer, "\r\n");
-		
-		// Additional content type info
-		if (i->path().length() && i->content_type().length())
+
+		// Without the background result, compress once now; the length comes with it.
 		{
-			DumpString(postBuffer, "Content-Type: ");
-			DumpString(postBuffer, i->content_type());
-			DumpString(postBuffer, "\r\n");
+			auto post = std::make_shared<PreparedPost>(*this, zlibFlags, boundary_id, false);
+			if (wxInputStream *compressed = post->open(uploads)) return compressed;
 		}
-		if (i->content_transfer_encoding().length())
+
+		// Compressing twice, to measure then to send, needs no temporary storage.
+		return new DeflateStream(
+			new PostStream(*this, boundary_id, preQuery, uploads),
+			new PostStream(*this, boundary_id, preQuery, uploads),
+			zlibFlags);
+	}
+
+	return new PostStream(*this, boundary_id, preQuery, uploads);
+}
+
+/*
+	Form encoding (application/x-www-form-urlencoded) of UTF-8 text:
+		alphanumerics and *-._ pass through, spaces become '+'
+		and any other byte is percent-encoded.
+*/
+static void AppendFormEncoded(std::string &out, const std::string &text)
+{
+	static const struct Table
+	{
+		bool plain[256];
+
+		Table() : plain()
 		{
-			DumpString(postBuffer, "Content-Transfer-Encoding: ");
-			DumpString(postBuffer, i->content_transfer_encoding());
-			DumpString(postBuffer, "\r\n");
+			for (int c = '0'; c <= '9'; ++c) plain[c] = true;
+			for (int c = 'A'; c <= 'Z'; ++c) plain[c] = true;
+			for (int c = 'a'; c <= 'z'; ++c) plain[c] = true;
+			plain[int('*')] = plain[int('-')] = plain[int('.')] = plain[int('_')] = true;
 		}
-		
-		// Empty line...
-		DumpString(postBuffer, "\r\n");
-		
-		// Content...
-		switch (i->type)
+	}
+		table;
+
+	static const char hex[] = "0123456789ABCDEF";
+
+	for (unsigned char c : text)
+	{
+		if (table.plain[c]) out += char(c);
+		else if (c == ' ')  out += '+';
+		else
 		{
-		case PARAM_STRING:
-		case PARAM_FIELD:
-		case PARAM_FIELD_MULTI:
-			DumpString(postBuffer, i->value());
-			break;
-		
-		case PARAM_FILE:
-			DumpBuffer(postBuffer, i->fileContents);
-			break;
-		case PARAM_NONE:
-		default:
-			DumpString(postBuffer, "Unknown Data:\r\n");
-			DumpString(postBuffer, i->value());
-			break;
+			const char escape[3] = {'%', hex[c >> 4], hex[c & 15]};
+			out.append(escape, 3);
 		}
 	}
-	
-	postBuffer.AppendByte('\0');
-	cout << "HTTP Post Buffer:" << endl << ((const char*) postBuffer.GetData()) << endl;
-}
-
-static void AppendPercentEncoded(wxString &str, char c)
-{
-	str.append('%');
-	str.append("0123456789ABCDEF"[(int(c)>>4)&15]);
-	str.append("0123456789ABCDEF"[(int(c)   )&15]);
 }
 
-wxString Report::preQueryString() const
+std::string Report::preQueryString() const
 {
-	wxString query;
+	std::string query;
 	
-	for (Contents::const_iterator i = _contents.begin(); i != _contents.end(); ++i)
+	for (auto &content : _contents)
 	{
-		if (i->preQuery)
-		{
-			query += (query.Length() ? wxT("&") : wxT("?"));
-			query += i->name;
-			query += "=";
-			
-			// Quick and dirty URL encoding
-			size_t len = std::min<size_t>(i->value().length(), 64);
-			for (size_t n = 0; n < len; ++n)
-			{
-				wxUniChar uc = i->value()[n];
-				char c;
-				if (uc.IsAscii() && uc.GetAsChar(&c))
-				{
-					if (c >= '0' && c <= '9') {query.Append(uc); continue;}
-					if (c >= 'a' && c <= 'z') {query.Append(uc); continue;}
-					if (c >= 'A' && c <= 'Z') {query.Append(uc); continue;}
-					if (c=='.'||c=='-'||c=='_'||c=='~') {query.append(uc); continue;}
-					
-					AppendPercentEncoded(query, c);
-				}
-				else
-				{
-					// Encode in UTF-8 and percent encode that
-					wxString tmp; tmp.append(uc);
-					wxScopedCharBuffer utf8 = tmp.ToUTF8();
-					
-					for (size_t m = 0; m < utf8.length(); ++m)
-					{
-						AppendPercentEncoded(query, utf8[m]);
-					}
-				}
-			}
-			
-		}
+		if (!content.preQuery || content.type != PARAM_STRING) continue;
+
+		query += (query.length() ? '&' : '?');
+		AppendFormEncoded(query, content.name);
+		query += '=';
+		AppendFormEncoded(query, content.value());
 	}
 	
 	return query;
@@ -9,25 +9,38 @@
 
 #include <iostream>
 #include <algorithm>
-#include <future>
 #include <chrono>
+#include <cmath>
+#include <ctime>
+#include <random>
 
 #include "tattle.h"
 
-#include <wx/progdlg.h>
 #include <wx/sstream.h>
 #include <wx/uri.h>
-#include <wx/frame.h>
-#include <wx/mstream.h>
+#include <wx/evtloop.h>
+#include <wx/app.h>
+#include <wx/apptrait.h>
+#include <wx/timer.h>
+#include <wx/thread.h>
+#include <wx/utils.h>
+#include <wx/datetime.h>
 
 
 using namespace tattle;
 
 
 
+/*
+	Run a request to completion, cancelling it if a phase exceeds its timeout.
+		On the main thread, a nested event loop dispatches the request's events,
+		so completion is noticed as soon as it happens.  Other threads have no
+		loop to dispatch them and poll the request's state at a short interval.
+		How the request went is noted in `connections`, if given.
+*/
 wxWebRequest::State run_request_with_timeout(
-	wxEvtHandler &handler, wxWebRequest &request, int timeout_seconds,
-	wxProgressDialog *progress)
+	wxEvtHandler &handler, wxWebRequest &request, const Report::Timeouts &timeouts,
+	ProgressSink *progress, ConnectionCache *connections)
 {
 	//request.DisablePeerVerify(); // TODO make this configurable?
 
@@ -37,65 +50,47 @@ wxWebRequest::State run_request_with_timeout(
 		return wxWebRequest::State_Failed;
 	}
 
-	std::promise<wxWebRequest::State> promise_state;
-	auto future_state = promise_state.get_future();
+	using clock = std::chrono::steady_clock;
 
-	wxWebRequest::State result = wxWebRequest::State_Idle;
+	const auto time_started = clock::now();
+	auto time_progress = time_started, time_cancelled = time_started;
 
-	// For some reason this isn't working.
-	auto eventHandler = [&](wxWebRequestEvent &event)
-	{
-		if (event.GetEventType() == wxEVT_WEBREQUEST_DATA)
-		{
-			// meh
-		}
-		else if (event.GetEventType() == wxEVT_WEBREQUEST_STATE)
-		{
-			switch (event.GetState())
-			{
-			case wxWebRequest::State_Completed:
-			case wxWebRequest::State_Failed:
-			case wxWebRequest::State_Cancelled:
-				promise_state.set_value(event.GetState());
-				break;
-			}
-		}
-	};
-
-	handler.Bind(wxEVT_WEBREQUEST_STATE, eventHandler);
-	handler.Bind(wxEVT_WEBREQUEST_DATA, eventHandler);
+	wxFileOffset bytes_sent = 0, bytes_recv = 0;
 
+	wxWebRequest::State result = wxWebRequest::State_Idle;
+	bool done = false, cancelled = false;
 
-	auto time_started = std::chrono::steady_clock::now();
-	request.Start();
+	std::unique_ptr<wxEventLoopBase> loop;
+	if (wxIsMainThread()) loop = NewEventLoop();
 
-	size_t bytes_sent = 0, bytes_to_send = 0,
-		bytes_recv = 0, bytes_to_recv = 0;
+	auto finish = [&](wxWebRequest::State state)
+	{
+		if (done) return;
+		done = true;
+		result = state;
+		if (loop && loop->IsRunning()) loop->Exit();
+	};
 
-	// Await the completion of the request...
-	for (long idle_time = 1; idle_time <= 2*timeout_seconds+1; ++idle_time)
+	auto isFinal = [](wxWebRequest::State state)
 	{
-		if (idle_time > timeout_seconds)
+		switch (state)
 		{
-			result = wxWebRequest::State_Cancelled; // in case of bad behavior
-			request.Cancel();
+		case wxWebRequest::State_Completed:
+		case wxWebRequest::State_Failed:
+		case wxWebRequest::State_Cancelled:
+		case wxWebRequest::State_Unauthorized:
+			return true;
+		default:
+			return false;
 		}
+	};
 
-		if (future_state.wait_until(time_started + std::chrono::seconds(idle_time))
-			!= std::future_status::timeout)
-			return future_state.get();
+	// Track progress, enforce timeouts and catch any missed state change.
+	auto check = [&]()
+	{
+		if (isFinal(request.GetState())) {finish(request.GetState()); return;}
 
-		// HACK: if the event handler doesn't work, this will
-		auto requestState = request.GetState();
-		switch (requestState)
-		{
-		case wxWebRequest::State_Completed: 
-		case wxWebRequest::State_Failed: 
-		case wxWebRequest::State_Cancelled:
-			result = requestState;
-			idle_time = 3*timeout_seconds; // break the outer loop
-			break;
-		}
+		const auto now = clock::now();
 
 		auto
 			send_ct = request.GetBytesSent(),
@@ -103,36 +98,177 @@ wxWebRequest::State run_request_with_timeout(
 			recv_ct = request.GetBytesReceived(),
 			recv_ex = request.GetBytesExpectedToReceive();
 
-		// Reset timeout if transaction is making progress
-		if (send_ct != bytes_sent || recv_ct != bytes_recv)
-		{
-			time_started = std::chrono::steady_clock::now();
-			idle_time = 1;
-		}
+		// Phase timeouts are measured from the last progress.
+		if (send_ct != bytes_sent || recv_ct != bytes_recv) time_progress = now;
 
-		// diagnostics / progress bar
 		bytes_sent = send_ct;
 		bytes_recv = recv_ct;
-		bytes_to_send = send_ex;
-		bytes_to_recv = recv_ex;
+
+		int limit;
+		if (!send_ct && !recv_ct)                    limit = timeouts.connect;
+		else if (send_ex > 0 && send_ct < send_ex) limit = timeouts.send;
+		else                                         limit = timeouts.reply;
+
+		if (!cancelled &&
+			((limit > 0          && now - time_progress > std::chrono::seconds(limit)) ||
+			 (timeouts.total > 0 && now - time_started  > std::chrono::seconds(timeouts.total))))
+		{
+			std::cout << "Tattle: request timed out" << std::endl;
+			cancelled = true;
+			time_cancelled = now;
+			request.Cancel();
+		}
+
+		// In case of bad behavior after cancelling
+		if (cancelled && now - time_cancelled > std::chrono::seconds(2))
+			finish(wxWebRequest::State_Cancelled);
 
 		if (progress)
 		{
 			float pct
-				= (80.f*bytes_sent)/bytes_to_send
-				+ (20.f*bytes_recv)/bytes_to_recv;
-			progress->Update(std::floor(pct));
+				= ((send_ex > 0) ? (80.f*send_ct)/send_ex : 0.f)
+				+ ((recv_ex > 0) ? (20.f*recv_ct)/recv_ex : 0.f);
+			progress->update(int(std::floor(pct)));
 		}
+	};
+
+	auto onState = [&](wxWebRequestEvent &event)
+	{
+		event.Skip();
+		if (event.GetRequest().GetId() == request.GetId() && isFinal(event.GetState()))
+			finish(event.GetState());
+	};
+
+	handler.Bind(wxEVT_WEBREQUEST_STATE, onState);
+
+	request.Start();
+
+	if (loop)
+	{
+		wxTimer timer;
+		timer.Bind(wxEVT_TIMER, [&](wxTimerEvent &) {check();});
+		timer.Start(100);
+
+		if (!done) loop->Run();
+
+		timer.Stop();
+	}
+	else while (!done)
+	{
+		wxMilliSleep(10);
+		check();
 	}
 
-	handler.Unbind(wxEVT_WEBREQUEST_STATE, eventHandler);
-	handler.Unbind(wxEVT_WEBREQUEST_DATA, eventHandler);
+	handler.Unbind(wxEVT_WEBREQUEST_STATE, onState);
+
+	NoteConnection(connections, request, result);
 
 	return result;
 }
 
 
 
+/*
+	Full jitter over an exponentially growing window; Retry-After
+		(delta-seconds or an HTTP date) sets a floor up to max_backoff.
+*/
+double Report::RetryPolicy::delay(unsigned attempt, const wxString &retryAfter) const
+{
+	thread_local std::mt19937 rng{std::random_device{}()};
+
+	double window = std::min(max_backoff, backoff * std::pow(2.0, double(attempt - 1)));
+	double delay  = std::uniform_real_distribution<double>(0.0, std::max(window, 0.0))(rng);
+
+	if (retryAfter.length())
+	{
+		double floor = -1;
+
+		unsigned long seconds;
+		wxDateTime when;
+		if (retryAfter.ToULong(&seconds))      floor = double(seconds);
+		else if (when.ParseRfc822Date(retryAfter)) floor = double(when.GetTicks() - std::time(nullptr));
+
+		if (floor > max_backoff) return -1;
+		delay = std::max(delay, floor);
+	}
+
+	return delay;
+}
+
+wxWebSession &tattle::WebSession()
+{
+	// Backends keep idle connections to each host in the session.
+	return wxWebSession::GetDefault();
+}
+
+std::unique_ptr<wxEventLoopBase> tattle::NewEventLoop()
+{
+	wxAppConsole *app    = wxAppConsole::GetInstance();
+	wxAppTraits  *traits = app ? app->GetTraits() : nullptr;
+
+	wxEventLoopBase *loop = traits ? traits->CreateEventLoop() : nullptr;
+	return std::unique_ptr<wxEventLoopBase>(loop ? loop : new wxEventLoop);
+}
+
+// A nested event loop keeps the GUI responsive; see run_request_with_timeout.
+void tattle::WaitFor(std::chrono::milliseconds delay)
+{
+	if (delay.count() <= 0) return;
+
+	if (!wxIsMainThread())
+	{
+		wxMilliSleep((unsigned long) delay.count());
+		return;
+	}
+
+	std::unique_ptr<wxEventLoopBase> loop = NewEventLoop();
+	wxTimer timer;
+	timer.Bind(wxEVT_TIMER, [&](wxTimerEvent &) {loop->Exit();});
+	timer.StartOnce(int(delay.count()));
+	loop->Run();
+}
+
+void tattle::WaitForRequest(wxEvtHandler &handler, std::chrono::milliseconds timeout)
+{
+	if (timeout.count() <= 0) return;
+
+	// Without a loop to dispatch events, callers poll the requests' state.
+	if (!wxIsMainThread())
+	{
+		wxMilliSleep((unsigned long) std::min<long long>(timeout.count(), 100));
+		return;
+	}
+
+	std::unique_ptr<wxEventLoopBase> loop = NewEventLoop();
+
+	auto onState = [&](wxWebRequestEvent &event)
+	{
+		event.Skip();
+		switch (event.GetState())
+		{
+		case wxWebRequest::State_Completed:
+		case wxWebRequest::State_Failed:
+		case wxWebRequest::State_Cancelled:
+		case wxWebRequest::State_Unauthorized:
+			if (loop->IsRunning()) loop->Exit();
+			break;
+		default:
+			break;
+		}
+	};
+
+	wxTimer timer;
+	timer.Bind(wxEVT_TIMER, [&](wxTimerEvent &) {if (loop->IsRunning()) loop->Exit();});
+
+	handler.Bind(wxEVT_WEBREQUEST_STATE, onState);
+	timer.StartOnce(int(timeout.count()));
+	loop->Run();
+	timer.Stop();
+	handler.Unbind(wxEVT_WEBREQUEST_STATE, onState);
+}
+
+
+
 bool Report::ParsedURL::set(std::string url)
 {
 	return set(wxString::FromUTF8(url.data(), url.length()));
@@ -243,7 +379,7 @@ void Report::Reply::parseRaw(const ParsedURL &url)
 
 	identity = Report::Identifier(std::string(GetTagContents(raw, wxT("tattle-id"))));
 
-	icon = uiConfig.GetIconID(iconName);
+	icon = iconName;
 	
 	if      (comm == wxT("STOP"))         command = SC_STOP;
 	else if (comm == wxT("PROMPT"))       command = SC_PROMPT;
@@ -272,6 +408,17 @@ void Report::Reply::processResponse(wxWebRequest::State requestState, wxWebRespo
 		if (!path.Length()) path = wxT("/");
 
 		raw = response.AsString();
+
+		// Lifetime of the reply, from Cache-Control.
+		wxString cacheControl = response.GetHeader("Cache-Control").Lower();
+		if (cacheControl.Find("no-store") != wxNOT_FOUND) maxAge = -1;
+		else
+		{
+			int p = cacheControl.Find("max-age=");
+			unsigned long seconds;
+			if (p != wxNOT_FOUND && cacheControl.Mid(p + 8).BeforeFirst(',').Trim().ToULong(&seconds))
+				maxAge = (long long) seconds;
+		}
 		
 		std::cout << "Tattle: query `" << (path+query) << ": success";
 		{
@@ -291,166 +438,510 @@ void Report::Reply::processResponse(wxWebRequest::State requestState, wxWebRespo
 	parseRaw(url);
 }
 
-void Report::httpAction(wxEvtHandler &handler, const ParsedURL &url, Reply &reply, wxProgressDialog *prog, bool isQuery) const
+/*
+	GET queries carry their strings in the URL.  The reply is saved under $etags
+		with its validator, keyed by a checksum of the URL, so the server may
+		answer a repeat query with 304 Not Modified and no body.
+*/
+wxString Report::requestURL(const ParsedURL &url, bool isQuery, const PersistentData *state, QueryValidator &validator) const
 {
-	if (prog)
+	wxString full_url = url.full();
+
+	validator = QueryValidator();
+	if (!isQuery || !query_get()) return full_url;
+
+	full_url += wxString::FromUTF8(preQueryString());
+
+	const wxScopedCharBuffer url_utf8 = full_url.ToUTF8();
+	validator.key = wxString::Format("%08x", unsigned(Crc32(url_utf8.data(), url_utf8.length()))).ToStdString();
+
+	if (state)
 	{
-		// Set icon and show
-		prog->SetIcon(wxArtProvider::GetIcon(uiConfig.defaultIcon()));
-		prog->Show();
-		prog->Raise();
+		const Json saved = JsonFetch(state->data, JsonPointer("/$etags") / validator.key, Json::object());
+		if (saved.contains("reply"))
+		{
+			validator.etag  = JsonMember(saved, "etag",  "");
+			validator.reply = JsonMember(saved, "reply", "");
+		}
 	}
 
-	int request_time_limit = prog ? 45 : 6;
+	return full_url;
+}
 
-	//  Note: we don't use query strings anymore due to length limits
-	//if (query.Length() && query[0] != wxT('?')) query = wxT("?")+query;
+void Report::prepareRequest(wxWebRequest &webRequest, bool isQuery, const QueryValidator &validator, const UploadRefs *uploads) const
+{
+	if (isQuery && query_get())
+	{
+		webRequest.SetMethod("GET");
+		if (validator.etag.length()) webRequest.SetHeader("If-None-Match", wxString::FromUTF8(validator.etag));
+		return;
+	}
 
-	wxString full_url = url.full();
+	webRequest.SetMethod("POST");
 
-	wxWebRequest webRequest = wxWebSession::GetDefault().CreateRequest(&handler, full_url);
+	std::string boundary_id = postBoundary();
 
-	webRequest.SetMethod("POST");
+	// The body is produced as the request reads it.
+	wxInputStream *postStream = encodePost(boundary_id, isQuery, uploads);
+	wxFileOffset   postLength = postStream->GetLength();
+
+	auto compression = post_compression();
+	if (!isQuery && (compression == "gzip" || compression == "deflate"))
+		webRequest.SetHeader("Content-Encoding", compression);
+
+	// Lets the server discard repeated deliveries of the same report.
+	if (!isQuery && _idempotencyKey.length())
+		webRequest.SetHeader("Idempotency-Key", wxString::FromUTF8(_idempotencyKey));
+
+	webRequest.SetData(postStream,
+		wxT("multipart/form-data; boundary=\"") + wxString(boundary_id) + ("\""),
+		postLength);
+}
+
+void Report::finishReply(Reply &reply, wxWebRequest::State finalState, wxWebResponse &response, const ParsedURL &url,
+	bool isQuery, QueryValidator &validator) const
+{
+	reply = Reply();
+	reply.processResponse(finalState, response, url);
+
+	if (isQuery && query_get() && response.IsOk())
+	{
+		if (reply.statusCode == 304 && validator.etag.length())
+		{
+			std::cout << "Tattle: query not modified; using the saved reply" << std::endl;
+			reply.raw = wxString::FromUTF8(validator.reply);
+			reply.parseRaw(url);
+		}
+		else if (reply.statusCode >= 200 && reply.statusCode < 300)
+		{
+			validator.etag  = response.GetHeader("ETag").utf8_string();
+			validator.reply = reply.raw.utf8_string();
+		}
+	}
 
-	wxMemoryBuffer postBuffer;
+	if (enable_server_values() && reply.jsonValues.length()) try
 	{
-		std::string boundary_id = "tattle-boundary-";
-		for (unsigned i = 0; i < 12; ++i) boundary_id.push_back('0' + (std::rand()%10));
+		const auto contents_utf8 = reply.jsonValues.ToUTF8();
+
+		Json server_values = Json::parse(contents_utf8.data(), contents_utf8.data() + contents_utf8.length(), nullptr, true, true);
+
+		if (!server_values.is_object()) throw 0;
+
+		Json permitted_values = Json::object();
+		for (auto i = server_values.begin(); i != server_values.end(); ++i)
+		{
+			// Don't allow the server to set keys with a prefix
+			if (!i.key().length()) continue;
+			switch (i.key()[0])
+			{
+			case int('$'): case int('.'):
+				// Don't allow server to write keys starting with these characters.
+				continue;
+			}
+			permitted_values[i.key()] = std::move(i.value());
+		}
+
+		// Lifetimes in seconds for values set by this reply, as "$ttl" : {key : seconds}.
+		const Json ttl = JsonMember(server_values, "$ttl", Json::object());
+		if (permitted_values.size() && ttl.is_object())
+		{
+			Json permitted_ttl = Json::object();
+			for (auto i = ttl.begin(); i != ttl.end(); ++i)
+				if (permitted_values.contains(i.key()) && i.value().is_number()) permitted_ttl[i.key()] = i.value();
+			if (permitted_ttl.size()) permitted_values["$ttl"] = std::move(permitted_ttl);
+		}
 
-		encodePost(postBuffer, boundary_id, isQuery);
-		webRequest.SetData(new wxMemoryInputStream(postBuffer.GetData(), postBuffer.GetDataLen()),
-			wxT("multipart/form-data; boundary=\"") + wxString(boundary_id) + ("\""),
-			postBuffer.GetDataLen());
+		if (permitted_values.size())
+			reply.serverValues = std::move(permitted_values);
 	}
-	
+	catch (Json::parse_error &) {}
+	catch (int) {}
+}
+
+/*
+	Save a query's reply, with any validator, for later runs.
+		If the server could not be reached, a saved reply stands in for it.
+*/
+void Report::saveReply(PersistentData *state, Reply &reply, bool isQuery, const QueryValidator &validator) const
+{
+	if (!state || !isQuery) return;
+
+	const bool answered = (reply.statusCode >= 200 && reply.statusCode < 300) ||
+		(reply.statusCode == 304 && validator.etag.length());
 
-	do
+	if (!answered)
 	{
-		// Connect to server
-		if (prog)
+		Reply saved;
+		if (!reply.connected() && cachedReply(*state, saved))
 		{
-			prog->Update(10, "Connecting to " + url.host + "...");
-			wxYield();
+			std::cout << "Tattle: no connection; using the saved reply" << std::endl;
+			reply = std::move(saved);
 		}
+		return;
+	}
+
+	Json patch = Json::object();
+
+	// The validator, or forget one the server has dropped.
+	if (validator.key.length())
+	{
+		if (validator.etag.length())
+			patch["$etags"][validator.key] = {{"etag", validator.etag}, {"reply", validator.reply}};
+		else if (state->data.contains(JsonPointer("/$etags") / validator.key))
+			patch["$etags"][validator.key] = nullptr;
+	}
+
+	const std::string key = replyCacheKey();
+	if (reply.maxAge < 0)
+	{
+		if (state->data.contains(JsonPointer("/$replies") / key)) patch["$replies"][key] = nullptr;
+	}
+	else
+	{
+		patch["$replies"][key] = {
+			{"status",  (reply.statusCode == 304) ? 200 : reply.statusCode},
+			{"title",   reply.title  .utf8_string()},
+			{"message", reply.message.utf8_string()},
+			{"link",    reply.link   .utf8_string()},
+			{"command", int(reply.command)},
+			{"icon",    reply.icon   .utf8_string()},
+			{"id",      reply.identity.type + ":" + reply.identity.id},
+			{"time",    (long long) std::time(nullptr)},
+			{"max_age", reply.maxAge}};
+	}
+
+	if (patch.size()) state->mergePatch(patch);
+}
+
+std::string Report::replyCacheKey() const
+{
+	const std::string query = preQueryString();
+	const Identifier  id    = identity();
+
+	return id.type + ":" + id.id + wxString::Format("#%08x", unsigned(Crc32(query.data(), query.length()))).ToStdString();
+}
+
+bool Report::cachedReply(const PersistentData &state, Reply &reply, bool *fresh) const
+{
+	const Json saved = JsonFetch(state.data, JsonPointer("/$replies") / replyCacheKey(), Json());
+	if (!saved.is_object()) return false;
+
+	reply = Reply();
+	reply.cached       = true;
+	reply.requestState = wxWebRequest::State_Completed;
+	reply.statusCode   = JsonMember(saved, "status", 200);
+	reply.title        = wxString::FromUTF8(JsonMember(saved, "title",   ""));
+	reply.message      = wxString::FromUTF8(JsonMember(saved, "message", ""));
+	reply.link         = wxString::FromUTF8(JsonMember(saved, "link",    ""));
+	reply.icon         = wxString::FromUTF8(JsonMember(saved, "icon",    ""));
+	reply.identity     = Identifier(JsonMember(saved, "id", ""));
+	reply.maxAge       = JsonMember(saved, "max_age", 0LL);
+
+	switch (JsonMember(saved, "command", 0))
+	{
+	case SC_STOP:         reply.command = SC_STOP;         break;
+	case SC_PROMPT:       reply.command = SC_PROMPT;       break;
+	case SC_STOP_ON_LINK: reply.command = SC_STOP_ON_LINK; break;
+	default:              reply.command = SC_NONE;         break;
+	}
+
+	if (fresh) *fresh = (JsonMember(saved, "time", 0LL) + reply.maxAge > (long long) std::time(nullptr));
+	return true;
+}
+
+void Report::httpAction(wxEvtHandler &handler, const ParsedURL &url, Reply &reply, ProgressSink *prog, bool isQuery,
+	PersistentData *state) const
+{
+	const Timeouts request_timeouts = timeouts(prog != nullptr);
+
+	// Queries are not retried; the user is waiting on them.
+	RetryPolicy retry = retry_policy();
+	if (isQuery) retry.attempts = 1;
+
+	QueryValidator validator;
+	const wxString full_url = requestURL(url, isQuery, state, validator);
+
+	ConnectionCache *connections = state ? &state->connections : nullptr;
+
+	// Large files go ahead of the post, in resumable chunks.
+	UploadRefs uploads;
+	std::vector<std::string> uploadIds;
+
+	if (!isQuery)
+	{
+		for (auto &content : _contents)
+		{
+			if (!uploadsSeparately(content)) continue;
+
+			std::string reference;
+			if (!httpUpload(handler, content, state, prog, reference))
+			{
+				std::cout << "Tattle: failed to upload `" << content.name << "'" << std::endl;
+
+				reply = Reply();
+				reply.requestState = wxWebRequest::State_Failed;
+				if (prog) prog->update(100);
+				return;
+			}
+			uploads[content.name] = reference;
+			uploadIds.push_back(JsonMember(Json::parse(reference), "upload_id", ""));
+		}
+	}
+
+	for (unsigned attempt = 1; ; ++attempt)
+	{
+		wxWebRequest webRequest = NewRequest(connections, handler, full_url);
+
+		prepareRequest(webRequest, isQuery, validator, &uploads);
+
+		// Connect to server
+		if (prog) prog->update(10, "Connecting to " + url.host + "...");
 
 		//wxSleep(1);  For UI testing
 
 		// Post and download reply
-		if (uiConfig.showProgress())
+		if (prog)
 		{
 			if (isQuery)
-				prog->Update(30, "Talking with " + url.host + "...");
+				prog->update(30, "Talking with " + url.host + "...");
 			else
-				prog->Update(25, "Sending to " + url.host + "...\nThis may take a while.");
-			wxYield();
+				prog->update(25, "Sending to " + url.host + "...\nThis may take a while.");
 		}
 
-		auto finalState = run_request_with_timeout(handler, webRequest, request_time_limit, prog);
+		auto finalState = run_request_with_timeout(handler, webRequest, request_timeouts, prog, connections);
 
 		wxWebResponse response = webRequest.GetResponse();
 
-		reply.processResponse(finalState, response, url);
+		finishReply(reply, finalState, response, url, isQuery, validator);
 
-		if (report.enable_server_values() && reply.jsonValues.length()) try
-		{
-			const auto contents_utf8 = reply.jsonValues.ToUTF8();
+		webRequest.Cancel(); // in case it didn't go through
+
+		// Retry transient failures
+		const int status = reply.statusCode;
+		if (attempt >= retry.attempts) break;
+		if (!RetryPolicy::transient(status)) break;
+
+		double delay = retry.delay(attempt, response.IsOk() ? response.GetHeader("Retry-After") : wxString());
+		if (delay < 0) break;
+
+		std::cout << "Tattle: retrying in " << delay << " seconds (attempt " << (attempt+1) << ")" << std::endl;
+		if (prog) prog->update(10, "Retrying " + url.host + "...");
 
-			Json server_values = Json::parse(contents_utf8.data(), contents_utf8.data() + contents_utf8.length(), nullptr, true, true);
+		WaitFor(std::chrono::milliseconds(long(delay * 1000.0)));
+	}
 
-			if (!server_values.is_object()) throw 0;
+	saveReply(state, reply, isQuery, validator);
 
-			Json permitted_values = Json::object();
-			for (auto i = server_values.begin(); i != server_values.end(); ++i)
+	// Forget uploads once a report refers to them, or is refused while referring to
+	//   them: the server may have lost them, and a fresh upload next time recovers.
+	const int  status  = reply.statusCode;
+	const bool refused = (status >= 400 && status < 500 && status != 408 && status != 429);
+	if (state && uploadIds.size() && ((status >= 200 && status < 300) || refused))
+	{
+		state->update([&uploadIds](const Json &latest)
+		{
+			Json patch = Json::object();
+			const Json saved = JsonFetch(latest, "/$uploads", Json::object());
+			if (saved.is_object()) for (auto i = saved.begin(); i != saved.end(); ++i)
 			{
-				// Don't allow the server to set keys with a prefix
-				if (!i.key().length()) continue;
-				switch (i.key()[0])
-				{
-				case int('$'): case int('.'):
-					// Don't allow server to write keys starting with these characters.
-					continue;
-				}
-				permitted_values[i.key()] = std::move(i.value());
+				if (std::find(uploadIds.begin(), uploadIds.end(), JsonMember(i.value(), "id", "")) != uploadIds.end())
+					patch[i.key()] = nullptr;
 			}
+			return patch.size() ? Json({{"$uploads", patch}}) : Json();
+		});
+	}
 
-			if (permitted_values.size())
-				persist.mergePatch(permitted_values);
-		}
-		catch (Json::parse_error &) {}
-		catch (int) {}
+	//wxSleep(1);  For UI testing
 
-		webRequest.Cancel(); // in case it didn't go through
+	if (prog) prog->update(100);
+}
 
-		//wxSleep(1);  For UI testing
+Report::Reply Report::httpQuery(wxEvtHandler &parent, ProgressSink *progress, PersistentData *state) const
+{
+	Reply reply;
 
-		if (uiConfig.showProgress()) prog->Update(100);
-	}
-	while (false);
+	httpAction(parent, url_query(), reply, progress, true, state);
+	
+	return reply;
 }
 
-Report::Reply Report::httpQuery(wxEvtHandler &parent) const
-{
-	wxWindow *parentWindow = dynamic_cast<wxWindow*>(&parent), *unhideWindow = nullptr;
 
-	// Hack for ordering issue
-	if (parentWindow && uiConfig.showProgress() && uiConfig.stayOnTop())
-		{parentWindow->Hide(); unhideWindow = parentWindow; parentWindow = NULL;}
 
-	Reply reply;
+QueryTask::QueryTask(const Report &report, wxEvtHandler &handler, PersistentData *state, Callback done) :
+	_report(report), _handler(handler), _state(state), _connections(state ? &state->connections : nullptr),
+	_done(std::move(done))
+{
+	const Report::ParsedURL &url = _report.url_query();
 
-	if (uiConfig.showProgress())
+	_request = NewRequest(_connections, _handler, _report.requestURL(url, true, _state, _validator));
+	if (!_request.IsOk())
 	{
-		wxProgressDialog dialog("Looking for solutions...", "Preparing...", 100, parentWindow,
-			wxPD_APP_MODAL | wxPD_AUTO_HIDE | uiConfig.style());
-
-		httpAction(parent, url_query(), reply, &dialog, true);
+		std::cout << "Failed to set up Web Request." << std::endl;
+		return;
 	}
-	else
+
+	_report.prepareRequest(_request, true, _validator, nullptr);
+
+	// Phases are not tracked here, so the whole query gets their sum.
+	const Report::Timeouts limits = _report.timeouts(true);
+	const int seconds = limits.total ? limits.total : (limits.connect + limits.reply);
+
+	_handler.Bind(wxEVT_WEBREQUEST_STATE, &QueryTask::_onState, this);
+	_timer.Bind(wxEVT_TIMER, &QueryTask::_onTimeout, this);
+
+	_running = true;
+	_request.Start();
+	if (seconds > 0) _timer.StartOnce(seconds * 1000);
+}
+
+QueryTask::~QueryTask()
+{
+	if (!_running) return;
+
+	_running = false;
+	_timer.Stop();
+	_handler.Unbind(wxEVT_WEBREQUEST_STATE, &QueryTask::_onState, this);
+	_request.Cancel();
+	ForgetConnection(_connections, _request);
+}
+
+void QueryTask::_onState(wxWebRequestEvent &event)
+{
+	event.Skip();
+	if (!_running || event.GetRequest().GetId() != _request.GetId()) return;
+
+	switch (event.GetState())
 	{
-		httpAction(parent, url_query(), reply, NULL, true);
+	case wxWebRequest::State_Completed:
+	case wxWebRequest::State_Failed:
+	case wxWebRequest::State_Cancelled:
+	case wxWebRequest::State_Unauthorized:
+		_finish(event.GetState());
+		break;
+	default:
+		break;
 	}
+}
 
-	// Ordering issue hack
-	if (unhideWindow) unhideWindow->Show();
-	
-	return reply;
+void QueryTask::_onTimeout(wxTimerEvent &)
+{
+	if (!_running) return;
+
+	std::cout << "Tattle: request timed out" << std::endl;
+	_request.Cancel();
+	_finish(wxWebRequest::State_Cancelled);
 }
 
-Report::Reply Report::httpPost(wxEvtHandler &parent) const
+void QueryTask::_finish(wxWebRequest::State state)
 {
-	wxWindow *parentWindow = dynamic_cast<wxWindow*>(&parent), *unhideWindow = nullptr;
+	_running = false;
+	_timer.Stop();
+	_handler.Unbind(wxEVT_WEBREQUEST_STATE, &QueryTask::_onState, this);
+
+	NoteConnection(_connections, _request, state);
+
+	wxWebResponse response = _request.GetResponse();
+
+	Report::Reply reply;
+	_report.finishReply(reply, state, response, _report.url_query(), true, _validator);
+	_report.saveReply(_state, reply, true, _validator);
 
-	// Hack for ordering issue
-	if (parentWindow && uiConfig.showProgress() && uiConfig.stayOnTop())
-		{parentWindow->Hide(); unhideWindow = parentWindow; parentWindow = NULL;}
+	// The callback may destroy this task.
+	Callback done = std::move(_done);
+	if (done) done(reply);
+}
 
+Report::Reply Report::httpPost(wxEvtHandler &parent, ProgressSink *progress, PersistentData *state) const
+{
 	Reply reply;
 	//http.SetTimeout(60);
 
-	if (uiConfig.showProgress())
-	{
-		wxProgressDialog dialog("Sending...", "Preparing Report...", 100, parentWindow,
-			wxPD_APP_MODAL | wxPD_AUTO_HIDE | uiConfig.style());
+	httpAction(parent, url_post(), reply, progress, false, state);
+	
+	return reply;
+}
 
-		httpAction(parent, url_post(), reply, &dialog, false);
-	}
-	else
+Preconnect::Preconnect(wxEvtHandler &handler, const Report::ParsedURL &url, int timeoutSeconds,
+	ConnectionCache *connections, Callback done) :
+	_handler(handler), _connections(connections), _done(std::move(done))
+{
+	// Only the server matters; the URL's own path may act on any request.
+	Report::ParsedURL root = url;
+	root.path.clear();
+
+	_request = NewRequest(_connections, _handler, root.full());
+	if (!_request.IsOk()) return;
+
+	_request.SetMethod("HEAD");
+
+	_handler.Bind(wxEVT_WEBREQUEST_STATE, &Preconnect::_onState, this);
+	_timer.Bind(wxEVT_TIMER, &Preconnect::_onTimeout, this);
+
+	_running = true;
+	_request.Start();
+	if (timeoutSeconds > 0) _timer.StartOnce(timeoutSeconds * 1000);
+}
+
+Preconnect::~Preconnect()
+{
+	if (!_running) return;
+
+	_running = false;
+	_timer.Stop();
+	_handler.Unbind(wxEVT_WEBREQUEST_STATE, &Preconnect::_onState, this);
+	_request.Cancel();
+	ForgetConnection(_connections, _request);
+}
+
+void Preconnect::_onState(wxWebRequestEvent &event)
+{
+	event.Skip();
+	if (!_running || event.GetRequest().GetId() != _request.GetId()) return;
+
+	switch (event.GetState())
 	{
-		httpAction(parent, url_post(), reply, NULL, false);
+	case wxWebRequest::State_Completed:
+	case wxWebRequest::State_Failed:
+	case wxWebRequest::State_Cancelled:
+	case wxWebRequest::State_Unauthorized:
+		// Any status means the server was reached, even if it doesn't take HEAD requests.
+		_finish(_request.GetResponse().IsOk() && _request.GetResponse().GetStatus() != 0);
+		break;
+	default:
+		break;
 	}
-	
-	// Ordering issue hack
-	//  TODO this causes the prompt window to "blink in" after posting
-	if (unhideWindow) unhideWindow->Show();
-	
-	return reply;
+}
+
+void Preconnect::_onTimeout(wxTimerEvent &)
+{
+	if (!_running) return;
+
+	std::cout << "Tattle: connection to server timed out" << std::endl;
+	_request.Cancel();
+	_finish(false);
+}
+
+void Preconnect::_finish(bool connected)
+{
+	_running = false;
+	_timer.Stop();
+	_handler.Unbind(wxEVT_WEBREQUEST_STATE, &Preconnect::_onState, this);
+
+	NoteConnection(_connections, _request, _request.GetState());
+
+	// The callback may destroy this object.
+	Callback done = std::move(_done);
+	if (done) done(connected);
 }
 
 bool Report::httpTest(wxEvtHandler &parent, const ParsedURL &url) const
 {
-	wxWebRequest webRequest = wxWebSession::GetDefault().CreateRequest(&parent, url.full());
+	wxWebRequest webRequest = NewRequest(nullptr, parent, url.full());
+
+	Timeouts testTimeouts;
+	testTimeouts.connect = testTimeouts.send = testTimeouts.reply = 5;
 
-	auto finalState = run_request_with_timeout(parent, webRequest, 5, nullptr);
+	auto finalState = run_request_with_timeout(parent, webRequest, testTimeouts, nullptr, nullptr);
 
 	bool connected = (finalState == wxWebRequest::State_Completed);
 	
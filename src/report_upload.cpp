@@ -0,0 +1,369 @@
+//
+//  report_upload.cpp
+//  tattle
+//
+//  Resumable, chunked uploads of large files.  See Upload-Protocol.md.
+//
+
+#include <wx/defs.h>
+
+#include <chrono>
+#include <deque>
+#include <algorithm>
+#include <cstdio>
+
+#include "tattle.h"
+
+#include <wx/mstream.h>
+#include <wx/evtloop.h>
+#include <wx/timer.h>
+#include <wx/thread.h>
+#include <wx/utils.h>
+
+
+using namespace tattle;
+
+
+extern wxWebRequest::State run_request_with_timeout(
+	wxEvtHandler &handler, wxWebRequest &request, const Report::Timeouts &timeouts,
+	ProgressSink *progress, ConnectionCache *connections);
+
+
+namespace
+{
+	using Clock = std::chrono::steady_clock;
+
+	struct Chunk
+	{
+		size_t       index   = 0;
+		unsigned     attempt = 1;
+		std::shared_ptr<std::string> data;
+		wxWebRequest request;
+
+		wxFileOffset      bytesSent = 0;
+		Clock::time_point progressTime, cancelTime;
+		bool              cancelled = false, abandoned = false;
+	};
+
+	struct ChunkJob
+	{
+		size_t            index;
+		unsigned          attempt;
+		Clock::time_point notBefore; // Retries wait out their delay
+	};
+}
+
+static std::string HexCrc32(uint32_t crc)
+{
+	char hex[9];
+	std::snprintf(hex, sizeof(hex), "%08x", unsigned(crc));
+	return hex;
+}
+
+static bool IsFinal(wxWebRequest::State state)
+{
+	switch (state)
+	{
+	case wxWebRequest::State_Completed:
+	case wxWebRequest::State_Failed:
+	case wxWebRequest::State_Cancelled:
+	case wxWebRequest::State_Unauthorized:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Copy a range of a file content, which may span several views.
+static void CopyRange(const FileViews &views, size_t offset, size_t length, std::string &dest)
+{
+	dest.clear();
+	dest.reserve(length);
+
+	for (auto &view : views)
+	{
+		if (!length) break;
+		if (offset >= view.size()) {offset -= view.size(); continue;}
+
+		size_t count = std::min(length, view.size() - offset);
+		dest.append(view.data() + offset, count);
+		offset = 0;
+		length -= count;
+	}
+}
+
+/*
+	Wait until at least one chunk's request finishes or wakeBy passes, cancelling
+		stalled ones.  Like run_request_with_timeout, this dispatches events on the
+		main thread and polls elsewhere.
+*/
+static void WaitForAnyChunk(wxEvtHandler &handler, std::vector<Chunk> &active, int stallSeconds,
+	Clock::time_point wakeBy)
+{
+	bool done = false;
+
+	std::unique_ptr<wxEventLoopBase> loop;
+	if (wxIsMainThread()) loop = NewEventLoop();
+
+	auto stop = [&]()
+	{
+		done = true;
+		if (loop && loop->IsRunning()) loop->Exit();
+	};
+
+	auto check = [&]()
+	{
+		const auto now = Clock::now();
+		if (now >= wakeBy) stop();
+
+		for (auto &chunk : active)
+		{
+			if (IsFinal(chunk.request.GetState())) {stop(); continue;}
+
+			auto sent = chunk.request.GetBytesSent();
+			if (sent != chunk.bytesSent) {chunk.bytesSent = sent; chunk.progressTime = now;}
+
+			if (!chunk.cancelled && stallSeconds > 0 && now - chunk.progressTime > std::chrono::seconds(stallSeconds))
+			{
+				chunk.cancelled  = true;
+				chunk.cancelTime = now;
+				chunk.request.Cancel();
+			}
+
+			// In case of bad behavior after cancelling
+			if (chunk.cancelled && now - chunk.cancelTime > std::chrono::seconds(2))
+			{
+				chunk.abandoned = true;
+				stop();
+			}
+		}
+	};
+
+	auto onState = [&](wxWebRequestEvent &event)
+	{
+		event.Skip();
+		if (IsFinal(event.GetState())) stop();
+	};
+
+	handler.Bind(wxEVT_WEBREQUEST_STATE, onState);
+
+	check();
+
+	if (loop)
+	{
+		if (!done)
+		{
+			wxTimer timer;
+			timer.Bind(wxEVT_TIMER, [&](wxTimerEvent &) {check();});
+			timer.Start(100);
+			loop->Run();
+			timer.Stop();
+		}
+	}
+	else while (!done)
+	{
+		wxMilliSleep(10);
+		check();
+	}
+
+	handler.Unbind(wxEVT_WEBREQUEST_STATE, onState);
+}
+
+bool Report::httpUpload(wxEvtHandler &handler, const Content &content, PersistentData *state,
+	ProgressSink *progress, std::string &reference) const
+{
+	const ParsedURL &url = url_upload();
+	if (!url.isSet() || content.type != PARAM_FILE) return false;
+
+	const UploadPolicy policy = upload_policy();
+	const RetryPolicy  retry  = retry_policy();
+	const Timeouts     limits = timeouts(progress != nullptr);
+
+	ConnectionCache *connections = state ? &state->connections : nullptr;
+
+	const size_t size       = content.fileSize();
+	const size_t chunkSize  = policy.chunk_size;
+	const size_t chunkCount = (size + chunkSize - 1) / chunkSize;
+
+	// Checksum of the whole file, which the server verifies after assembly.
+	uint32_t crc = 0;
+	for (auto &view : content.fileContents) crc = Crc32(view.data(), view.size(), crc);
+
+	// Progress is keyed by the file's path and data, so a later run can resume it.
+	const std::string identity = content.path() + "|" + std::to_string(size) + "|" + HexCrc32(crc);
+	const std::string key      = HexCrc32(Crc32(identity.data(), identity.length()));
+
+	std::string uploadId;
+	size_t      offset = 0; // Acknowledged without gaps
+
+	if (state)
+	{
+		Json saved = JsonFetch(state->data, JsonPointer("/$uploads/" + key), Json::object());
+		if (JsonMember(saved, "chunk_size", size_t(0)) == chunkSize && JsonMember(saved, "size", size_t(0)) == size)
+		{
+			uploadId = JsonMember(saved, "id", "");
+			offset   = std::min(size, JsonMember(saved, "offset", size_t(0)));
+		}
+	}
+	// The server may have lost or outpaced what was recorded; its offset wins.
+	if (uploadId.length())
+	{
+		wxWebRequest query = NewRequest(connections, handler, url.full());
+		if (query.IsOk())
+		{
+			query.SetMethod("HEAD");
+			query.SetHeader("Upload-Id", wxString::FromUTF8(uploadId));
+		}
+
+		auto queryState = run_request_with_timeout(handler, query, limits, nullptr, connections);
+		wxWebResponse response = query.IsOk() ? query.GetResponse() : wxWebResponse();
+		int status = (queryState == wxWebRequest::State_Completed && response.IsOk()) ? response.GetStatus() : 0;
+
+		unsigned long long serverOffset = 0;
+		if (status == 404 || status == 410)
+		{
+			std::cout << "Tattle: the server no longer has the upload of `" << content.name << "'" << std::endl;
+			uploadId.clear();
+		}
+		else if (status >= 200 && status < 300 &&
+			response.GetHeader("Upload-Offset").ToULongLong(&serverOffset))
+		{
+			offset = (serverOffset >= size) ? size : size_t(serverOffset / chunkSize) * chunkSize;
+		}
+		// Otherwise the server can't say, or can't be reached; trust the record.
+	}
+
+	if (!uploadId.length()) {uploadId = makeUUID(); offset = 0;}
+	else std::cout << "Tattle: resuming upload of `" << content.name << "' at " << offset << " bytes" << std::endl;
+
+	auto record = [&](Json entry)
+	{
+		if (state) state->mergePatch({{"$uploads", {{key, std::move(entry)}}}});
+	};
+	record({{"id", uploadId}, {"size", size}, {"chunk_size", chunkSize}, {"offset", offset}});
+
+	std::vector<bool> acked(chunkCount, false);
+	for (size_t i = 0; i < chunkCount && (i+1)*chunkSize <= offset; ++i) acked[i] = true;
+	if (offset == size) std::fill(acked.begin(), acked.end(), true);
+
+	std::deque<ChunkJob> queue;
+	for (size_t i = 0; i < chunkCount; ++i) if (!acked[i]) queue.push_back({i, 1u, Clock::time_point()});
+
+	std::vector<Chunk> active;
+	size_t sent = offset;
+
+	auto start = [&](size_t index, unsigned attempt)
+	{
+		Chunk chunk;
+		chunk.index   = index;
+		chunk.attempt = attempt;
+		chunk.data    = std::make_shared<std::string>();
+
+		const size_t begin = index * chunkSize;
+		CopyRange(content.fileContents, begin, std::min(chunkSize, size - begin), *chunk.data);
+
+		chunk.request = NewRequest(connections, handler, url.full());
+		if (!chunk.request.IsOk()) return false;
+
+		chunk.request.SetMethod("PUT");
+		chunk.request.SetHeader("Upload-Id",       wxString::FromUTF8(uploadId));
+		chunk.request.SetHeader("Upload-Offset",   wxString::Format("%llu", (unsigned long long) begin));
+		chunk.request.SetHeader("Upload-Length",   wxString::Format("%llu", (unsigned long long) size));
+		chunk.request.SetHeader("Upload-Checksum", "crc32=" + HexCrc32(Crc32(chunk.data->data(), chunk.data->length())));
+		chunk.request.SetData(new wxMemoryInputStream(chunk.data->data(), chunk.data->length()),
+			"application/octet-stream", wxFileOffset(chunk.data->length()));
+
+		chunk.progressTime = Clock::now();
+		chunk.request.Start();
+		active.push_back(std::move(chunk));
+		return true;
+	};
+
+	auto abort = [&]()
+	{
+		for (auto &chunk : active) {chunk.request.Cancel(); ForgetConnection(connections, chunk.request);}
+		return false;
+	};
+
+	while (queue.size() || active.size())
+	{
+		// Start the chunks which are due; the rest wake the wait when they are.
+		const auto now = Clock::now();
+		Clock::time_point wakeBy = Clock::time_point::max();
+		for (auto job = queue.begin(); job != queue.end() && active.size() < policy.parallel; )
+		{
+			if (job->notBefore > now) {wakeBy = std::min(wakeBy, job->notBefore); ++job; continue;}
+
+			ChunkJob due = *job;
+			job = queue.erase(job);
+			if (!start(due.index, due.attempt)) return abort();
+		}
+
+		if (active.empty())
+		{
+			WaitFor(std::chrono::duration_cast<std::chrono::milliseconds>(wakeBy - now));
+			continue;
+		}
+
+		WaitForAnyChunk(handler, active, limits.send, wakeBy);
+
+		for (size_t i = 0; i < active.size(); )
+		{
+			Chunk &chunk = active[i];
+			auto chunkState = chunk.request.GetState();
+
+			if (!IsFinal(chunkState) && !chunk.abandoned) {++i; continue;}
+
+			if (IsFinal(chunkState)) NoteConnection  (connections, chunk.request, chunkState);
+			else                     ForgetConnection(connections, chunk.request);
+
+			wxWebResponse response = chunk.request.GetResponse();
+			int status = (chunkState == wxWebRequest::State_Completed && response.IsOk()) ? response.GetStatus() : 0;
+
+			if (status >= 200 && status < 300)
+			{
+				acked[chunk.index] = true;
+				sent += chunk.data->length();
+
+				// Record the acknowledged offset whenever it advances.
+				size_t before = offset;
+				while (offset < size && acked[offset / chunkSize]) offset = std::min(size, offset + chunkSize);
+				if (offset != before) record({{"offset", offset}});
+
+				if (progress) progress->update(10 + int((60.0 * sent) / std::max<size_t>(size, 1)),
+					"Uploading " + content.name + "...");
+			}
+			else
+			{
+				// Resend after failures, timeouts, checksum mismatches (422), 408, 429 and 5xx.
+				bool transient = (status == 422 || RetryPolicy::transient(status));
+				if (!transient || chunk.attempt >= retry.attempts)
+				{
+					std::cout << "Tattle: upload chunk " << chunk.index << " failed with status " << status << std::endl;
+					active.erase(active.begin() + i);
+					return abort();
+				}
+
+				double delay = retry.delay(chunk.attempt, response.IsOk() ? response.GetHeader("Retry-After") : wxString());
+				if (delay < 0)
+				{
+					active.erase(active.begin() + i);
+					return abort();
+				}
+
+				queue.push_front({chunk.index, chunk.attempt + 1,
+					Clock::now() + std::chrono::milliseconds(long(delay * 1000.0))});
+			}
+
+			active.erase(active.begin() + i);
+		}
+	}
+
+	reference = Json({
+		{"upload_id",  uploadId},
+		{"size",       size},
+		{"crc32",      HexCrc32(crc)},
+		{"chunk_size", chunkSize},
+	}).dump();
+	return true;
+}
@@ -0,0 +1,271 @@
+//
+//  spool.cpp
+//  tattle
+//
+
+#include <wx/defs.h>
+
+#include <cmath>
+#include <ctime>
+#include <chrono>
+#include <algorithm>
+
+#include "tattle.h"
+
+#include <wx/dir.h>
+#include <wx/filename.h>
+#include <wx/wfstream.h>
+#include <wx/utils.h>
+
+
+using namespace tattle;
+
+
+Spool::Spool(const wxString &dir) :
+	_dir(dir)
+{
+}
+
+wxString Spool::_path(const wxString &entry, const char *extension) const
+{
+	return _dir + "/" + entry + extension;
+}
+
+wxString Spool::store(const Report &report, const Report::ParsedURL &url) const
+{
+	if (!_dir.length()) return wxString();
+
+	if (!wxFileName::DirExists(_dir) && !wxFileName::Mkdir(_dir, wxS_DIR_DEFAULT, wxPATH_MKDIR_FULL))
+		return wxString();
+
+	auto now = std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count();
+	wxString entry = wxString::Format("report-%lld-%lu", (long long) now, (unsigned long) wxGetProcessId());
+
+	std::string boundary_id = report.postBoundary();
+
+	// Write the encoded body, then publish it by renaming.
+	wxString bodyPath = _path(entry, ".body");
+	{
+		std::unique_ptr<wxInputStream> body(report.encodePost(boundary_id, false));
+
+		wxFileOutputStream out(bodyPath + ".tmp");
+		if (!out.IsOk()) return wxString();
+
+		out.Write(*body);
+		bool ok = out.Close() && (body->GetLastError() == wxSTREAM_EOF || body->GetLastError() == wxSTREAM_NO_ERROR);
+
+		if (!ok || !ReplaceFile(bodyPath + ".tmp", bodyPath))
+		{
+			wxRemoveFile(bodyPath + ".tmp");
+			return wxString();
+		}
+	}
+
+	// The metadata is written last; entries without it are incomplete.
+	auto compression = report.post_compression();
+
+	Json meta =
+	{
+		{"url", std::string(url.full().ToUTF8())},
+		{"content-type", "multipart/form-data; boundary=\"" + boundary_id + "\""},
+		{"content-encoding", (compression == "gzip" || compression == "deflate") ? compression : ""},
+		{"idempotency-key", report.idempotency_key()},
+		{"created", std::time(nullptr)},
+		{"attempts", 0},
+		{"next_attempt", 0},
+	};
+
+	if (!WriteFileAtomic(_path(entry, ".json"), meta.dump(1, '\t')))
+	{
+		wxRemoveFile(bodyPath);
+		return wxString();
+	}
+
+	std::cout << "Tattle: saved report to spool as `" << entry << "'" << std::endl;
+	return entry;
+}
+
+void Spool::remove(const wxString &entry) const
+{
+	if (!entry.length()) return;
+
+	// Remove the metadata first so a partial removal is never retried.
+	wxRemoveFile(_path(entry, ".json"));
+	wxRemoveFile(_path(entry, ".body"));
+}
+
+std::vector<wxString> Spool::entries() const
+{
+	std::vector<wxString> list;
+
+	wxDir dir(_dir);
+	if (!dir.IsOpened()) return list;
+
+	wxString name;
+	for (bool ok = dir.GetFirst(&name, "*.json", wxDIR_FILES); ok; ok = dir.GetNext(&name))
+		list.push_back(name.substr(0, name.length() - 5));
+
+	// Oldest first
+	std::sort(list.begin(), list.end());
+	return list;
+}
+
+Spool::FlushResult Spool::flush(wxEvtHandler &handler, unsigned concurrency,
+	const Report::RetryPolicy &retry, const Report::Timeouts &timeouts, ConnectionCache *connections) const
+{
+	using Clock = std::chrono::steady_clock;
+
+	struct Pending
+	{
+		wxString          entry;
+		Json              meta;
+		wxWebRequest      request;
+		Clock::time_point started, progressTime;
+		wxFileOffset      bytesSent = 0, bytesReceived = 0;
+	};
+
+	std::vector<wxString> queue = entries();
+	std::vector<Pending>  active;
+	FlushResult result;
+	bool        offline = false;
+
+	const std::time_t now = std::time(nullptr);
+
+	// Record a failed attempt and schedule the next one, or give up.
+	auto fail = [&](Pending &item, const wxString &retryAfter)
+	{
+		unsigned attempts = JsonMember(item.meta, "attempts", 0u) + 1;
+		double   delay    = (attempts < retry.attempts) ? retry.delay(attempts, retryAfter) : -1.0;
+		if (delay < 0)
+		{
+			std::cout << "Tattle: giving up on spooled report `" << item.entry << "'" << std::endl;
+			remove(item.entry);
+			++result.dropped;
+			return;
+		}
+		item.meta["attempts"] = attempts;
+		item.meta["next_attempt"] = std::time(nullptr) + std::time_t(std::ceil(delay));
+		WriteFileAtomic(_path(item.entry, ".json"), item.meta.dump(1, '\t'));
+		++result.failed;
+	};
+
+	// Phase timeouts, as in run_request_with_timeout, measured from the last progress.
+	auto timedOut = [&](Pending &item)
+	{
+		const auto now = Clock::now();
+
+		auto sent     = item.request.GetBytesSent(),     toSend = item.request.GetBytesExpectedToSend();
+		auto received = item.request.GetBytesReceived();
+		if (sent != item.bytesSent || received != item.bytesReceived) item.progressTime = now;
+		item.bytesSent     = sent;
+		item.bytesReceived = received;
+
+		int limit;
+		if (!sent && !received)               limit = timeouts.connect;
+		else if (toSend > 0 && sent < toSend) limit = timeouts.send;
+		else                                  limit = timeouts.reply;
+
+		return (limit > 0          && now - item.progressTime > std::chrono::seconds(limit)) ||
+		       (timeouts.total > 0 && now - item.started      > std::chrono::seconds(timeouts.total));
+	};
+
+	for (size_t next = 0; next < queue.size() || active.size(); )
+	{
+		// Start requests, up to the concurrency limit.
+		while (!offline && next < queue.size() && active.size() < std::max(1u, concurrency))
+		{
+			Pending item;
+			item.entry = queue[next++];
+
+			std::string metaText;
+			if (!ReadFileBytes(_path(item.entry, ".json"), metaText)) continue;
+			try {item.meta = Json::parse(metaText);}
+			catch (Json::parse_error &) {continue;}
+
+			if (JsonMember(item.meta, "next_attempt", std::time_t(0)) > now) continue;
+
+			wxString bodyPath = _path(item.entry, ".body");
+			wxFile probe(bodyPath);
+			if (!probe.IsOpened()) {remove(item.entry); continue;}
+			wxFileOffset bodyLength = probe.Length();
+			probe.Close();
+
+			item.request = NewRequest(connections, handler,
+				wxString::FromUTF8(JsonMember(item.meta, "url", "")));
+			if (!item.request.IsOk()) {fail(item, wxString()); continue;}
+
+			item.request.SetMethod("POST");
+			auto encoding = JsonMember(item.meta, "content-encoding", "");
+			if (encoding.length()) item.request.SetHeader("Content-Encoding", encoding);
+			auto key = JsonMember(item.meta, "idempotency-key", "");
+			if (key.length()) item.request.SetHeader("Idempotency-Key", wxString::FromUTF8(key));
+			item.request.SetData(new wxFileInputStream(bodyPath),
+				wxString::FromUTF8(JsonMember(item.meta, "content-type", "")), bodyLength);
+
+			item.started = item.progressTime = Clock::now();
+			item.request.Start();
+			active.push_back(std::move(item));
+		}
+
+		if (offline && next < queue.size()) next = queue.size();
+		if (active.empty()) continue;
+
+		// Sleep until a request finishes; the timeout bounds how late a stalled one is cancelled.
+		WaitForRequest(handler, std::chrono::seconds(1));
+
+		// Collect finished requests.
+		for (size_t i = 0; i < active.size(); )
+		{
+			auto &item = active[i];
+			auto state = item.request.GetState();
+
+			if ((state == wxWebRequest::State_Active || state == wxWebRequest::State_Idle) && timedOut(item))
+			{
+				std::cout << "Tattle: request timed out" << std::endl;
+				item.request.Cancel();
+				state = wxWebRequest::State_Cancelled;
+			}
+
+			switch (state)
+			{
+			case wxWebRequest::State_Completed:
+			case wxWebRequest::State_Failed:
+			case wxWebRequest::State_Cancelled:
+			case wxWebRequest::State_Unauthorized:
+				break;
+			default:
+				++i;
+				continue;
+			}
+
+			NoteConnection(connections, item.request, state);
+
+			wxWebResponse response = item.request.GetResponse();
+			int status = response.IsOk() ? response.GetStatus() : 0;
+
+			if (state == wxWebRequest::State_Completed && status >= 200 && status < 300)
+			{
+				std::cout << "Tattle: sent spooled report `" << item.entry << "'" << std::endl;
+				remove(item.entry);
+				++result.sent;
+			}
+			else if (!Report::RetryPolicy::transient(status))
+			{
+				std::cout << "Tattle: server refused spooled report `" << item.entry << "' with status " << status << std::endl;
+				remove(item.entry);
+				++result.dropped;
+			}
+			else
+			{
+				// Stop starting new requests if we can't reach the server at all.
+				if (!status) offline = true;
+				fail(item, response.IsOk() ? response.GetHeader("Retry-After") : wxString());
+			}
+
+			active.erase(active.begin() + i);
+		}
+	}
+
+	return result;
+}
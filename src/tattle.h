@@ -4,6 +4,9 @@
 //
 //  Created by Evan Balster on 11/12/16.
 //
+//  Public interface of the tattle_core library.  Nothing declared here
+//    uses global state or wx core; the GUI lives in tattle_gui.h.
+//
 
 #ifndef tattle_h
 #define tattle_h
@@ -12,10 +15,21 @@
 
 #include <string>
 #include <iostream>
-#include <list>
+#include <memory>
+#include <vector>
+#include <functional>
+#include <map>
+#include <unordered_map>
+#include <chrono>
+#include <cstdint>
+#include <algorithm>
+#include <thread>
+#include <atomic>
 
 #include <nlohmann/json.hpp>
 
+#include "command_config.h" // Generated from schemas/command.json
+
 #if FORCE_TR1_TYPE_TRAITS
     // Hack to deal with STL weirdness on OS X
 	#include <wx/setup.h>
@@ -29,17 +43,16 @@
 
 #include <wx/string.h>
 #include <wx/file.h>
-#include <wx/dialog.h>
-#include <wx/textctrl.h>
-#include <wx/checkbox.h>
-#include <wx/msgdlg.h>
-#include <wx/artprov.h>
-#include <wx/hyperlink.h>
-#include <wx/progdlg.h>
 #include <wx/event.h>
+#include <wx/stream.h>
+#include <wx/zstream.h>
+#include <wx/zipstrm.h>
+#include <wx/datetime.h>
 
 
 #include <wx/webrequest.h>
+#include <wx/timer.h>
+#include <wx/evtloop.h>
 
 namespace tattle
 {
@@ -83,13 +96,16 @@ namespace tattle
 
 
 	/*
-		Workflow control calls
+		Receives progress of an HTTP request; implemented by the GUI's progress dialog.
 	*/
-	void Tattle_Proceed();
-	void Tattle_ShowPrompt();
-	void Tattle_InsertDialog(wxWindow *dialog);
-	void Tattle_DisposeDialog(wxWindow *dialog);
-	void Tattle_Halt();
+	class ProgressSink
+	{
+	public:
+		virtual ~ProgressSink() {}
+
+		// Percent is out of 100.  An empty message keeps the previous one.
+		virtual void update(int percent, const wxString &message = wxString()) = 0;
+	};
 	
 	// Types of report parameters.
 	enum PARAM_TYPE
@@ -97,10 +113,176 @@ namespace tattle
 		PARAM_NONE = 0,
 		PARAM_STRING, // String provided in configuration
 		PARAM_FILE,   // Text file referenced by configuration
+		PARAM_DIR,    // Directory referenced by configuration, sent as an archive
 		PARAM_FIELD,       // Text field
 		PARAM_FIELD_MULTI, // Multi-line text field.
 	};
 
+	/*
+		A read-only memory mapping of a window of a file.
+			A mapping is not a snapshot: it shows later writes to the file, and reading
+			past the end of a file which has since been truncated faults.  Snapshot()
+			copies the window to a private temporary file first and maps that, so the
+			data stays as it was captured.
+	*/
+	class MappedFile
+	{
+	public:
+		MappedFile(const wxString &path, wxFileOffset offset, size_t length);
+		~MappedFile();
+
+		MappedFile(const MappedFile&) = delete;
+		MappedFile &operator=(const MappedFile&) = delete;
+
+		// Copy a window of an open file and map the copy, or return null on failure.
+		static std::shared_ptr<const MappedFile> Snapshot(wxFile &file, wxFileOffset offset, size_t length);
+
+		bool        isOpen() const    {return _data != nullptr;}
+		const char *data()   const    {return _data;}
+		size_t      size()   const    {return _size;}
+
+	private:
+		void       *_base = nullptr;
+		size_t      _baseSize = 0;
+		const char *_data = nullptr;
+		size_t      _size = 0;
+		wxString    _temporary; // Removed once unmapped
+	};
+
+	/*
+		A read-only view of captured file data, held in memory or mapped from disk.
+	*/
+	struct FileView
+	{
+		wxMemoryBuffer                    buffer;
+		std::shared_ptr<const MappedFile> mapping;
+
+		const char *data() const    {return mapping ? mapping->data() : static_cast<const char*>(buffer.GetData());}
+		size_t      size() const    {return mapping ? mapping->size() : buffer.GetDataLen();}
+	};
+
+	using FileViews = std::vector<FileView>;
+
+	/*
+		Files captured from a directory, archived when sent.
+	*/
+	struct DirCapture
+	{
+		struct Entry
+		{
+			std::string name; // Relative path with '/' separators
+			wxDateTime  time;
+			FileViews   data;
+		};
+
+		std::vector<Entry> entries;
+		wxFileOffset       archiveSize = 0;
+	};
+
+	/*
+		Capture file contents for a report.
+			Truncated files keep only their head and tail, separated by a note.
+			Files are copied to a temporary file and mapped, rather than read into memory,
+			if `map` is set or they exceed mapThreshold; small windows, such as the head
+			and tail of a truncated file, are always read into memory.
+	*/
+	void CaptureFile(FileViews &dest,
+		const wxString &path, unsigned trunc_begin, unsigned trunc_end, const std::string &trunc_note,
+		bool map, wxFileOffset mapThreshold);
+
+	/*
+		Capture files in a directory tree whose relative paths match an include
+			pattern and no exclude pattern.  Files over maxFileSize keep only their
+			tail; files which would exceed maxTotalSize are skipped.  (0 = no limit)
+	*/
+	std::shared_ptr<const DirCapture> CaptureDirectory(const wxString &root,
+		const std::vector<std::string> &include, const std::vector<std::string> &exclude,
+		wxFileOffset maxFileSize, wxFileOffset maxTotalSize, wxFileOffset mapThreshold);
+
+	// Run task(0) ... task(count-1) on a small pool of threads.
+	void ParallelFor(size_t count, const std::function<void(size_t)> &task);
+
+	// File utilities.  Atomic writes go through a temporary file and a rename;
+	//   access gives the new file's permissions where the system has them.
+	bool ReplaceFile    (const wxString &from, const wxString &to);
+	bool WriteFileAtomic(const wxString &path, const void *data, size_t size, int access = wxS_DEFAULT);
+	bool WriteFileAtomic(const wxString &path, const std::string &contents,  int access = wxS_DEFAULT);
+	bool ReadFileBytes  (const wxString &path, std::string &contents);
+
+	/*
+		Parse JSON (with comments) directly from UTF-8 bytes, without converting to wxString.
+			On failure, `error` gives the line and column, as in "3:14: unexpected '}'".
+	*/
+	bool ParseJson   (const char *begin, const char *end, Json &json, std::string &error);
+	bool ReadJsonFile(const wxString &path, Json &json, std::string &error);
+
+	// Wait for a while without blocking the GUI, if any.
+	void WaitFor(std::chrono::milliseconds delay);
+
+	/*
+		An event loop of the application's kind.  tattle_core is built without GUI
+			support, where a plain wxEventLoop is a console loop which doesn't dispatch
+			the toolkit's events; nested loops on the main thread must come from here.
+	*/
+	std::unique_ptr<wxEventLoopBase> NewEventLoop();
+
+	// Wait until one of the handler's requests finishes or the timeout passes, dispatching events on the main thread.
+	void WaitForRequest(wxEvtHandler &handler, std::chrono::milliseconds timeout);
+
+	// The session shared by all requests, which keeps their connections open for reuse.
+	wxWebSession &WebSession();
+
+	struct PersistentData;
+	class  Admission;
+
+	/*
+		Resolved addresses and TLS sessions for the servers, carried from one run to the
+			next, so a run soon after another skips the DNS lookup and resumes the TLS
+			handshake.  Addresses go in the state file under $hosts; sessions, which
+			hold secrets, go in sessionPath, readable only by the user.  Entries last
+			ttlSeconds (0 disables this).  Requests made with NewRequest() use and
+			update the given cache; NoteConnection() records how each one went once it
+			has finished, and ForgetConnection() drops one abandoned before then.
+			A null cache makes plain requests.  Each PersistentData owns a cache;
+			only libcurl's session store is shared by the process.
+			Needs wxWebRequest's libcurl backend; elsewhere these calls do nothing.
+	*/
+	class ConnectionCache
+	{
+	public:
+		ConnectionCache();
+		~ConnectionCache();
+
+		ConnectionCache(const ConnectionCache&) = delete;
+		ConnectionCache &operator=(const ConnectionCache&) = delete;
+
+		struct Hosts; // Defined in connection_cache.cpp
+
+	private:
+		std::unique_ptr<Hosts> _hosts;
+
+		friend void         LoadConnectionCache(PersistentData &state, const wxString &sessionPath, long long ttlSeconds);
+		friend void         SaveConnectionCache(PersistentData &state);
+		friend wxWebRequest NewRequest         (ConnectionCache *cache, wxEvtHandler &handler, const wxString &url);
+		friend void         NoteConnection     (ConnectionCache *cache, const wxWebRequest &request, wxWebRequest::State finalState);
+		friend void         ForgetConnection   (ConnectionCache *cache, const wxWebRequest &request);
+	};
+
+	void         LoadConnectionCache(PersistentData &state, const wxString &sessionPath, long long ttlSeconds);
+	void         SaveConnectionCache(PersistentData &state);
+	wxWebRequest NewRequest         (ConnectionCache *cache, wxEvtHandler &handler, const wxString &url);
+	void         NoteConnection     (ConnectionCache *cache, const wxWebRequest &request, wxWebRequest::State finalState);
+	void         ForgetConnection   (ConnectionCache *cache, const wxWebRequest &request);
+
+	// CRC-32 (as in zlib and PNG) and Adler-32 (as in zlib), continuing from a previous result.
+	//   The Combine functions give the checksum of two pieces of data from theirs.
+	uint32_t Crc32         (const void *data, size_t size, uint32_t crc = 0);
+	uint32_t Crc32Combine  (uint32_t crc1, uint32_t crc2, uint64_t len2);
+	uint32_t Adler32       (const void *data, size_t size, uint32_t adler = 1);
+	uint32_t Adler32Combine(uint32_t adler1, uint32_t adler2, uint64_t len2);
+
+	class  PreparedPost;
+
 	enum DETAIL_TYPE
 	{
 		DETAIL_NONE = 0,
@@ -145,39 +327,99 @@ namespace tattle
             PARAM_TYPE  type;
             std::string name;
 			bool        preQuery;  // Include in pre-query ?
-			Json        json;      // Original JSON from configuration
+
+			// Options from configuration, resolved by compile() according to the type.
+			std::string         initialValue; // Of a string or input
+			config::ReportFile  fileConfig;
+			config::ReportDir   dirConfig;
+			config::ReportInput inputConfig;
 
 
 			mutable std::string user_input;
 
-			std::string value() const
-			{
-				if (user_input.length()) return user_input;
-				if (json.is_string()) return json;
-				return JsonMember(json, "value", "");
-			}
+			const std::string &value() const    {return user_input.length() ? user_input : initialValue;}
+
+			const std::string &path()  const    {return fileConfig.path;}
+			const std::string &dir ()  const    {return dirConfig.dir;}
+
+			// Path of the attached file or directory, and the filename it is sent with.
+			const std::string &location() const    {return (type == PARAM_DIR) ? dir() : path();}
+			std::string        filename() const    {return (type == PARAM_DIR) ? dir() + ".zip" : path();}
 
-			std::string path()  const    {return JsonMember(json, "path", "");}
+			bool               persist    () const    {return inputConfig.persist;}
 
-			bool        persist    () const    {return JsonMember(json, "persist", false);}
+			const std::string &label      () const    {return inputConfig.label;}
+			const std::string &placeholder() const    {return inputConfig.placeholder;}
 
-			std::string label      () const    {return JsonMember(json, "label", "");}
-			std::string placeholder() const    {return JsonMember(json, "placeholder", "");}
+			const std::string &content_type             () const    {return (type == PARAM_DIR) ? dirConfig.content_type : fileConfig.content_type;}
+			const std::string &content_transfer_encoding() const    {return fileConfig.content_transfer_encoding;}
 
-			std::string content_type             () const    {return JsonMember(json, "content-type", "application/octet-stream");}
-			std::string content_transfer_encoding() const    {return JsonMember(json, "content-transfer-encoding", "");}
+			unsigned           truncate_begin() const    {return unsigned(fileConfig.truncate.begin);}
+			unsigned           truncate_end  () const    {return unsigned(fileConfig.truncate.end);}
+			const std::string &truncate_note () const    {return fileConfig.truncate.note;}
 
-			unsigned    truncate_begin() const    {return JsonFetch(json, "/truncate/0", 0u);}
-			unsigned    truncate_end  () const    {return JsonFetch(json, "/truncate/1", 0u);}
-			std::string truncate_note () const    {return JsonFetch(json, "/truncate/2", "(trimmed)");}
+			// "read" copies files into memory; "map" maps them read-only.
+			const std::string &capture       () const    {return fileConfig.capture;}
 
-			std::string input_warning() const    {return JsonMember(json, "input_warning", "");}
+			const std::string &input_warning() const    {return inputConfig.input_warning;}
 			
-			// File contents
-			wxMemoryBuffer fileContents;
+			// File contents, in order.
+			FileViews fileContents;
+
+			size_t fileSize() const
+			{
+				size_t size = 0;
+				for (auto &view : fileContents) size += view.size();
+				return size;
+			}
+
+			// Directory options and contents
+			const std::vector<std::string> &dir_include() const    {return dirConfig.include;}
+			const std::vector<std::string> &dir_exclude() const    {return dirConfig.exclude;}
+			wxFileOffset max_file_size () const    {return wxFileOffset(dirConfig.max_file_size);}
+			wxFileOffset max_total_size() const    {return wxFileOffset(dirConfig.max_total_size);}
+
+			std::shared_ptr<const DirCapture> dirContents;
         };
         
-        using Contents = std::list<Content>;
+        /*
+			Report contents in order, stored contiguously and indexed by name.
+				Adding a content may move the others, so hold on to indices rather
+				than pointers or iterators.  Names need not be unique; find() and
+				indexOf() give the first content with a name.
+		*/
+		class Contents
+		{
+		public:
+			using iterator       = std::vector<Content>::iterator;
+			using const_iterator = std::vector<Content>::const_iterator;
+
+			static const size_t npos = size_t(-1);
+
+			iterator       begin()       noexcept    {return _items.begin();}
+			iterator       end  ()       noexcept    {return _items.end();}
+			const_iterator begin() const noexcept    {return _items.begin();}
+			const_iterator end  () const noexcept    {return _items.end();}
+
+			size_t size () const noexcept    {return _items.size();}
+			bool   empty() const noexcept    {return _items.empty();}
+
+			Content       &operator[](size_t index)          {return _items[index];}
+			const Content &operator[](size_t index) const    {return _items[index];}
+
+			size_t         indexOf(const std::string &name) const;
+			Content       *find   (const std::string &name)          {size_t i = indexOf(name); return (i == npos) ? nullptr : &_items[i];}
+			const Content *find   (const std::string &name) const    {size_t i = indexOf(name); return (i == npos) ? nullptr : &_items[i];}
+
+			// Append a content, returning its index.
+			size_t add(Content &&content);
+
+			void reserve(size_t count)    {_items.reserve(count); _index.reserve(count);}
+
+		private:
+			std::vector<Content>                    _items;
+			std::unordered_map<std::string, size_t> _index;
+		};
 		
 		/*
 			Represents a parsed HTTP URL.
@@ -233,8 +475,12 @@ namespace tattle
 			wxString       title, message, link;
 			Identifier     identity;
 			wxString       jsonValues;
+			Json           serverValues; // Permitted values from jsonValues, if enable_server_values().
 			SERVER_COMMAND command;
-			wxArtID        icon;
+			wxString       icon; // Tattle icon name, eg. "information" or "error".
+
+			long long      maxAge = 0;     // Seconds from Cache-Control: max-age, or -1 for no-store.
+			bool           cached = false; // Restored from the state file rather than received.
 			
 			bool ok()       const;
 			bool valid()    const;
@@ -256,18 +502,32 @@ namespace tattle
 
 		/*
 			Once the report is fully configured, call this function.
-				- Generates parameters from JSON
+				- Resolves settings and generates parameters from JSON
 				- Reads files into memory, trimmed
 		*/
 		void compile();
+
+		/*
+			Settings from `config`, checked against schemas/command.json.
+				Like the URLs, they are resolved on first use and again by compile().
+				configErrors() lists violations as "<JSON pointer>: <problem>";
+				settings which violate the schema keep their defaults.
+				Properties the schema doesn't know are ignored and listed by configWarnings().
+		*/
+		const config::Command &settings()       const;
+		const config::Errors  &configErrors()   const;
+		const config::Errors  &configWarnings() const;
 	
 		/*
 			Access report parameters.
 		*/
 		const Contents &contents()              const noexcept    {return _contents;}
 		//Contents       &contents()                    noexcept    {return _contents;}
-		Content        *findContent(const wxString &name);
-		const Content  *findContent(const wxString &name) const;
+		Content        *findContent(const std::string &name)          {return _contents.find(name);}
+		const Content  *findContent(const std::string &name) const    {return _contents.find(name);}
+
+		// Add or replace a string parameter after compile(), eg. a count known only when sending.
+		void setString(const std::string &name, const std::string &value);
 		
 		
 		// Query the server using the query address.
@@ -275,261 +535,667 @@ namespace tattle
 		/*
 			Perform an HTTP query or HTTP post, or test the HTTP connection...
 				Supply a parent window if possible, or some other event handler otherwise.
+				Progress is reported to `progress` if it is not null.
+		*/
+		Reply httpQuery(wxEvtHandler &parent, ProgressSink *progress = nullptr, PersistentData *state = nullptr) const;
+		Reply httpPost (wxEvtHandler &parent, ProgressSink *progress = nullptr, PersistentData *state = nullptr) const;
+
+		/*
+			Replies to queries are kept in the state file under $replies, keyed by
+				replyCacheKey(): the report's identity and a checksum of its pre-query strings.
+				A reply stays fresh for the max-age the server gives it, and a stale one
+				stands in for the server when it cannot be reached.
+		*/
+		std::string replyCacheKey() const;
+		bool        cachedReply(const PersistentData &state, Reply &reply, bool *fresh = nullptr) const;
+
+		/*
+			Upload a file content in chunks to url_upload(), resuming earlier progress.
+				Progress is recorded under $uploads in `state`, if given.
+				On success, `reference` is the JSON sent in place of the file's data.
 		*/
-		Reply httpQuery(wxEvtHandler &parent) const;
-		Reply httpPost (wxEvtHandler &parent) const;
+		bool  httpUpload(wxEvtHandler &handler, const Content &content, PersistentData *state,
+			ProgressSink *progress, std::string &reference) const;
 		
 		// Test connectivity by making a test connection (but no actual HTTP query)
 		bool  httpTest(wxEvtHandler &parent, const ParsedURL &url) const;
 		
         
-        // Encode HTTP query and post request
-		wxString preQueryString() const;
-        void     encodePost(wxMemoryBuffer &postData, wxString boundary_id, bool preQuery) const;
+        // Contents uploaded by httpUpload, by name, with the reference to send instead.
+		using UploadRefs = std::unordered_map<std::string, std::string>;
+
+		// Encode HTTP query and post request.
+		//   preQueryString returns "?name=value&..." (application/x-www-form-urlencoded) for GET queries.
+		//   encodePost returns a new stream suitable for wxWebRequest::SetData,
+		//   compressed according to post_compression() unless this is a pre-query.
+		std::string    preQueryString() const;
+		wxInputStream *encodePost(const std::string &boundary_id, bool preQuery, const UploadRefs *uploads = nullptr) const;
+
+		// A random multipart boundary, and a random UUID.
+		static std::string makeBoundary();
+		static std::string makeUUID();
+
+		// The multipart boundary for posts: the prepared body's, if compile() started one.
+		std::string postBoundary() const;
+
+		// Whether httpAction sends a content to url_upload() ahead of the post.
+		bool uploadsSeparately(const Content &content) const;
         
     public: // members
-		void httpAction(wxEvtHandler &handler, const ParsedURL &url, Reply &reply, wxProgressDialog *dlg, bool isQuery) const;
+		void httpAction(wxEvtHandler &handler, const ParsedURL &url, Reply &reply, ProgressSink *progress, bool isQuery,
+			PersistentData *state = nullptr) const;
+
+		/*
+			Steps of an HTTP request shared by httpAction and QueryTask.
+				A GET query's URL includes its strings; `validator` holds the ETag and
+				reply saved for that URL.  finishReply parses the response, substituting
+				the saved reply for a 304, and saveReply records the outcome in `state`.
+		*/
+		struct QueryValidator
+		{
+			std::string key, etag, reply;
+		};
+		wxString requestURL  (const ParsedURL &url, bool isQuery, const PersistentData *state, QueryValidator &validator) const;
+		void     prepareRequest(wxWebRequest &request, bool isQuery, const QueryValidator &validator, const UploadRefs *uploads) const;
+		void     finishReply (Reply &reply, wxWebRequest::State state, wxWebResponse &response, const ParsedURL &url,
+			bool isQuery, QueryValidator &validator) const;
+		void     saveReply   (PersistentData *state, Reply &reply, bool isQuery, const QueryValidator &validator) const;
 
 		Json config;
 
-		Identifier identity() const
+		Identifier identity() const    {return Identifier(settings().report.type, settings().report.id);}
+
+		const ParsedURL& url_post()   const;
+		const ParsedURL& url_query()  const;
+		const ParsedURL& url_upload() const;
+
+		bool enable_server_values() const    {return settings().service.cookies;}
+
+		/*
+			Seconds allowed for each phase of a request (0 = no limit).
+				connect, send and reply are measured since the last progress;
+				interactive requests, which show progress, default to longer limits.
+		*/
+		struct Timeouts
 		{
-			return Identifier(
-				JsonFetch(config, "/report/type", ""),
-				JsonFetch(config, "/report/id",   ""));
-		}
+			int connect = 0; // Until the first byte is sent
+			int send    = 0; // While uploading the body
+			int reply   = 0; // While awaiting and downloading the response
+			int total   = 0; // The whole request
+		};
+		Timeouts timeouts(bool interactive) const;
+
+		/*
+			Retries of failed posts: connection failures, timeouts, 429 and 5xx responses.
+				Delays grow exponentially from `backoff` seconds up to `max_backoff`,
+				with full jitter.  A longer Retry-After from the server ends retrying.
+		*/
+		struct RetryPolicy
+		{
+			unsigned attempts    = 3;
+			double   backoff     = 1.0;
+			double   max_backoff = 30.0;
+
+			// Seconds to wait before the given retry (1 = first), or -1 to stop retrying.
+			double delay(unsigned attempt, const wxString &retryAfter = wxString()) const;
+
+			// Whether a reply with this status (0 = none) is worth retrying.
+			static bool transient(int status)    {return status == 0 || status == 408 || status == 429 || status >= 500;}
+		};
+		RetryPolicy retry_policy() const;
+
+		// Sent as Idempotency-Key with every delivery of this report; set by compile().
+		const std::string &idempotency_key() const    {return _idempotencyKey;}
+
+		/*
+			Resumable uploads: files of at least `threshold` bytes (0 disables)
+				are sent to url_upload() in chunks, `parallel` at a time.
+		*/
+		struct UploadPolicy
+		{
+			wxFileOffset threshold  = 0;
+			size_t       chunk_size = 4 << 20;
+			unsigned     parallel   = 1;
+		};
+		UploadPolicy upload_policy() const;
 
-		const ParsedURL& url_post()  const;
-		const ParsedURL& url_query() const;
+		// Content-Encoding for posts: "gzip", "deflate" or "none".
+		const std::string &post_compression() const    {return settings().service.compression;}
 
-		bool enable_server_values() const    {return JsonFetch(config, "/service/cookies", true);}
+		// Queries are sent as a multipart POST, or with query_get() as a GET revalidated by ETag.
+		bool query_get() const    {return settings().service.query_method == "get";}
 
-		std::string path_reviewData() const    {return JsonFetch(config, "/path/review", "");}
-		std::string path_tattleData() const    {return JsonFetch(config, "/path/state", "");}
-		std::string path_tattleLog()  const    {return JsonFetch(config, "/path/log", "");}
+		const std::string &path_reviewData() const    {return settings().path.review;}
+		const std::string &path_tattleData() const    {return settings().path.state;}
+		const std::string &path_tattleLog()  const    {return settings().path.log;}
+		const std::string &path_spool()      const    {return settings().path.spool;}
+		const std::string &path_locks()      const    {return settings().path.locks;}
+		const std::string &path_configDump() const    {return settings().path.config_dump;}
+
+		// Admission control (if path.locks is set): instances admitted at once per report identity,
+		//   and seconds a standby instance waits for the leader.
+		unsigned admission_max_instances() const    {return unsigned(settings().admission.max_instances);}
+		int      admission_wait()          const    {return int(settings().admission.wait);}
+
+		// Offline spool: flush mode, parallel requests, and retries between flushes
+		//   (max_attempts, backing off from a minute up to a day).
+		bool        spool_flush()        const    {return settings().spool.flush;}
+		unsigned    spool_concurrency()  const    {return unsigned(settings().spool.concurrency);}
+		RetryPolicy spool_retry_policy() const;
+
+		/*
+			Reports sent within dedupe_window() seconds of one with the same key are
+				counted rather than sent (0 disables).  The key is the report's identity,
+				or with dedupe_by_contents(), a checksum of its compiled contents.
+		*/
+		int         dedupe_window()      const    {return int(settings().report.dedupe.window);}
+		bool        dedupe_by_contents() const    {return settings().report.dedupe.key == "contents";}
+		std::string dedupe_key()         const;
+
+		/*
+			Dedupe and occurrence counting, shared by the frontends.
+				suppressDuplicate() counts this occurrence (and those waiting on `admission`)
+				against a matching report sent recently, returning how many were counted,
+				or 0 if the report should be sent.  Before posting, stampOccurrences() sets
+				the "occurrences" string and hands the count to `admission`; afterwards,
+				markDelivered() records the report as sent if it was delivered or spooled.
+		*/
+		struct Occurrences
+		{
+			std::string key;
+			unsigned    suppressed = 0;
+		};
+		unsigned    suppressDuplicate(PersistentData &state, Admission *admission) const;
+		Occurrences stampOccurrences (PersistentData &state, Admission *admission);
+		void        markDelivered    (PersistentData &state, const Occurrences &occurrences,
+			const Reply &reply, bool spooled) const;
+
+		// Limits on the state file, applied by PersistentData::maintain().
+		size_t    state_max_entries() const    {return size_t(settings().state.max_entries);}
+		long long state_ttl()         const    {return settings().state.ttl;}
+		bool      state_binary()      const    {return settings().state.format == "cbor";}
+
+		// Seconds that server addresses and TLS sessions are reused by later runs (0 = not saved).
+		long long state_connection_ttl() const    {return settings().state.connection_ttl;}
+
+		// Untruncated files larger than this are mapped rather than copied (0 disables).
+		wxFileOffset map_threshold() const    {return wxFileOffset(settings().report.map_threshold);}
+
+		// Compressed post data beyond this many bytes per piece is kept in a temporary file (0 disables).
+		wxFileOffset spill_threshold() const    {return wxFileOffset(settings().report.spill_threshold);}
 		
 		bool connectionWarning = false;
 
 	private:
-		Contents _contents;
+		Contents    _contents;
+		std::string _idempotencyKey;
+
+		std::shared_ptr<PreparedPost> _prepared; // Compressed post body, started by compile()
 
 		mutable struct
 		{
 			bool parsed = false;
-			ParsedURL post, query;
+			ParsedURL post, query, upload;
 		}
 			url_cache;
 
+		mutable struct
+		{
+			bool            resolved = false;
+			config::Command command;
+			config::Errors  errors, warnings;
+		}
+			settings_cache;
+
 		void _parse_urls() const;
+		void _resolve_settings() const;
     };
 
 	/*
-	*	An interface to GUI configuration values.
+		An input stream producing a report's multipart/form-data body on demand.
+			Each part's header is generated when the stream reaches it, and
+			file contents are read straight out of the report without copying.
+			The exact length is computed up front.
+			Files listed in `uploads` are sent as a reference to the upload.
 	*/
-	struct UIConfig
+	class PostStream : public wxInputStream
 	{
-		UIConfig(Json &config);
+	public:
+		PostStream(const Report &report, const std::string &boundary_id, bool preQuery,
+			const Report::UploadRefs *uploads = nullptr);
+
+		// Only the parts for contents [first, last), ending with the final boundary if `closing`.
+		PostStream(const Report &report, const std::string &boundary_id, size_t first, size_t last, bool closing,
+			const Report::UploadRefs *uploads = nullptr);
+
+		wxFileOffset GetLength() const wxOVERRIDE    {return wxFileOffset(_length);}
+
+	protected:
+		size_t       OnSysRead(void *buffer, size_t size) wxOVERRIDE;
+		wxFileOffset OnSysTell() const wxOVERRIDE    {return wxFileOffset(_position);}
+
+	private:
+		using Part = Report::Contents::const_iterator;
+
+		void _start(Part first, const Report::UploadRefs *uploads);
+
+		bool _includes(const Report::Content &content) const;
+		Part _nextPart(Part part) const;
+
+		const std::string *_uploadRef(const Report::Content &content) const;
 
-		Json& config;
+		std::string _partHeader(const Report::Content &content) const;
+		std::string _partValue (const Report::Content &content) const;
+		std::string _finalDivider() const;
 
-		std::string promptTitle     () const    {return JsonFetch(config, "/text/prompt/title", "Report");}
-		std::string promptMessage   () const    {return JsonFetch(config, "/text/prompt/message", "Use this form to send us a report.");}
-		std::string promptTechnical () const    {return JsonFetch(config, "/report/summary", "");}
-		std::string labelPrompt     () const    {return JsonFetch(config, "/text/prompt/hint", "");}
-		std::string labelSend       () const    {return JsonFetch(config, "/text/prompt/btn_send", "");}
-		std::string labelCancel     () const    {return JsonFetch(config, "/text/prompt/btn_cancel", "");}
-		std::string labelReview     () const    {return JsonFetch(config, "/text/prompt/btn_review", "");}
-		std::string labelHaltReports() const    {return JsonFetch(config, "/text/halt_reports", "Don't show again");}
+		// Select the current segment of output.
+		enum STAGE {STAGE_HEADER, STAGE_BODY, STAGE_FINAL, STAGE_DONE};
+		void _setText(STAGE stage, std::string text);
+		void _enterPart(Part part);
+		void _enterView(size_t view);
+		void _advance();
 
-		bool stayOnTop   () const    {return JsonFetch(config, "/gui/stay_on_top", false);}
-		bool enableReview() const    {return JsonFetch(config, "/gui/prompt/review", false);}
-		bool showProgress() const    {return JsonFetch(config, "/gui/progress_bar", false);}
-		bool silentQuery () const    {return JsonFetch(config, "/gui/query", "default") == "silent";}
-		bool silentPost  () const    {return JsonFetch(config, "/gui/post",  "default") == "silent";}
+		const Report::Contents &_contents;
+		const std::string       _boundary;
+		const bool              _preQuery;
+		const Part              _end;
+		const bool              _closing;
+		Report::UploadRefs      _uploads;
 
-		// Margin sizes.
-		unsigned marginSm() const;
-		unsigned marginMd() const;
-		unsigned marginLg() const;
+		size_t _length = 0, _position = 0;
 
-		wxArtID defaultIcon() const    {return GetIconID(JsonFetch(config, "/gui/icon", ""));}
+		// Current part and stage within it.
+		Part   _part;
+		STAGE  _stage;
+		size_t _view = 0;
 
-		wxArtID GetIconID(wxString tattleName) const;
+		// Generated body of the current part, if any.
+		std::unique_ptr<wxInputStream> _body;
 
+		// Current segment: either _text or a view into a content's data.
+		std::string  _text;
+		const char  *_data = nullptr;
+		size_t       _size = 0, _offset = 0;
+	};
+
+	/*
+		Base for input streams which generate their output a small piece at a time.
+	*/
+	class GeneratedStream : public wxInputStream
+	{
+	public:
+		wxFileOffset GetLength() const wxOVERRIDE    {return _length;}
+
+	protected:
+		size_t       OnSysRead(void *buffer, size_t size) wxOVERRIDE;
+		wxFileOffset OnSysTell() const wxOVERRIDE    {return wxFileOffset(_position);}
 
-		int style() const
+		// Write the next piece of output to _window.  Returns false when finished.
+		virtual bool _generate() = 0;
+
+		// Collects generated output until it is read.
+		class Window : public wxOutputStream
 		{
-			return (stayOnTop() ? wxSTAY_ON_TOP : 0);
-		}
+		public:
+			std::string data;
+			size_t      offset = 0;
+
+		protected:
+			size_t OnSysWrite(const void *buffer, size_t size) wxOVERRIDE;
+		};
+
+		Window       _window;
+		wxFileOffset _length = wxInvalidOffset;
+
+	private:
+		size_t _position = 0;
+		bool   _finished = false;
 	};
 
 	/*
-	*	Storage file for user input, user consent and server cookies.
+		An input stream which compresses another stream as it is read.
+			The compressed length is measured up front by compressing an identical
+			source stream, so the result can still be sent with a Content-Length.
 	*/
-	struct PersistentData
+	class DeflateStream : public GeneratedStream
 	{
 	public:
-		const Json &data;
+		// Takes ownership of both streams, which must produce identical data.
+		//   zlibFlags is wxZLIB_GZIP or wxZLIB_ZLIB.
+		DeflateStream(wxInputStream *source, wxInputStream *measure, int zlibFlags);
 
-		PersistentData();
+	protected:
+		bool _generate() wxOVERRIDE;
 
+	private:
+		// Compress one chunk of the source; returns false at the end.
+		static bool _pump(wxInputStream &source, wxZlibOutputStream &zlib);
 
-		bool shouldShow(const Report::Identifier &id) const    {return JsonFetch(data, JsonPointer("/$show/"+id.type+"/"+id.id), 1) != 0;}
+		std::unique_ptr<wxInputStream> _source;
+		wxZlibOutputStream             _zlib;
+	};
+
+	/*
+		A compressed post body, prepared while the user fills in the prompt.
+			A background thread compresses each run of parts which can't change:
+			all but fields and files uploaded ahead of the post.  open() compresses
+			the rest and joins the pieces into one gzip or zlib stream.
+			Compressed pieces past a few megabytes are kept in temporary files.
+			Preparing only reads the report; nothing is sent until open() is used.
+	*/
+	class PreparedPost : public std::enable_shared_from_this<PreparedPost>
+	{
+	public:
+		// Start preparing, in the background if asked; zlibFlags is wxZLIB_GZIP or wxZLIB_ZLIB.
+		PreparedPost(const Report &report, int zlibFlags, std::string boundary, bool background = true);
+		~PreparedPost();
 
+		PreparedPost(const PreparedPost&) = delete;
+		PreparedPost &operator=(const PreparedPost&) = delete;
 
-		bool load      (wxString path);
-		bool mergePatch(const Json &patch);
+		const std::string &boundary() const    {return _boundary;}
+
+		// Contents [0, covered()) were planned for; open() encodes any added since.
+		size_t covered() const    {return _covered;}
+
+		// Wait for the background thread.  The report's contents must not change before this.
+		void wait();
+
+		// A new stream of the whole body, for wxWebRequest::SetData.  It keeps this object alive.
+		wxInputStream *open(const Report::UploadRefs *uploads);
+
+		// Compressed data, in memory or in a temporary file which is removed with its last reference.
+		struct Deflated
+		{
+			std::string                     memory;
+			std::shared_ptr<const wxString> file;
+			uint64_t                        length = 0;
+		};
+
+	private:
+		struct Segment
+		{
+			size_t      first = 0, last = 0; // Range of contents
+			bool        fixed    = false;    // No fields or uploads; compressed in the background
+			bool        prepared = false;    // Compressed
+			Deflated    deflated;            // Raw deflate data, ending on a byte boundary
+			uint32_t    crc = 0, adler = 1;  // Of the uncompressed data
+			uint64_t    size = 0;
+			uint64_t    spillLimit = 0;      // Compressed bytes kept in memory (0 = all)
+		};
+
+		// The spill limit for contents [first, last).  Directory archives are never staged on disk.
+		uint64_t _spillLimit(size_t first, size_t last) const;
+
+		// Compress a segment from `source`; the last one ends the deflate stream.
+		static bool _compress(Segment &segment, wxInputStream &source, bool last, const std::atomic<bool> *cancel);
+
+		const Report         &_report;
+		const int             _zlibFlags;
+		const std::string     _boundary;
+		size_t                _covered = 0;
+		std::vector<Segment>  _segments;
+
+		std::thread       _worker;
+		std::atomic<bool> _cancel{false};
+	};
+
+	/*
+		An input stream producing a ZIP archive of a captured directory.
+	*/
+	class ArchiveStream : public GeneratedStream
+	{
+	public:
+		ArchiveStream(const DirCapture &capture);
+
+		// Measure the archive for a capture by generating it.
+		static wxFileOffset Measure(const DirCapture &capture);
+
+	protected:
+		bool _generate() wxOVERRIDE;
 
 	private:
-		wxString _path;
-		Json     _data;
+		const DirCapture  &_capture;
+		wxZipOutputStream  _zip;
+
+		size_t _entry = 0, _view = 0, _offset = 0;
+		bool   _entryOpen = false;
 	};
 
 	/*
-		Globally shared report state and UI configuration.
-			Only one report is made per invocation of Tattle.
+		A directory of encoded posts which could not be delivered.
+			Each entry is a request body plus a JSON metadata file, both written atomically.
 	*/
-	extern       PersistentData &persist;
-	extern const Report         &report;
-	extern const UIConfig       &uiConfig;
-    
-    /*
-		A prompt window which allows the user to enter data and submit the report.
-    */
-    class Prompt : public wxDialog
-    {
-    public:
-        enum EventTypes
-        {
-            Ev_Exit    = wxID_EXIT,
-            Ev_Cancel  = wxID_CANCEL,
-            Ev_Submit  = wxID_FORWARD,
-            Ev_Details = wxID_INFO,
-        };
-        
-        Prompt(wxWindow * parent, wxWindowID id, Report &report);
-		~Prompt() wxOVERRIDE;
-		
+	class Spool
+	{
+	public:
+		Spool(const wxString &dir);
+
+		// Encode and save a report for later delivery.  Returns the entry name, or empty on failure.
+		wxString store(const Report &report, const Report::ParsedURL &url) const;
+
+		// Delete an entry, eg. after it was delivered by other means.
+		void remove(const wxString &entry) const;
+
+		// List complete entries, oldest first.
+		std::vector<wxString> entries() const;
+
+		struct FlushResult
+		{
+			size_t sent = 0, failed = 0, dropped = 0;
+		};
+
 		/*
-			Create a dialog box describing a server's reply.
-				Returns true if the user followed a link.
+			Send due entries with up to `concurrency` requests in flight, each limited by `timeouts`.
+				Transient failures are rescheduled by `retry`, honoring Retry-After, and dropped
+				once its attempts run out; entries the server refuses otherwise are dropped.
+				Requests use and update `connections`, if given.
 		*/
-		static wxWindow *DisplayReply(const Report::Reply &reply, wxWindow *parent = NULL);
-        
-    private:
-        struct Field
-        {
-            const Report::Content *content;
-            wxTextCtrl            *control;
-        };
-        typedef std::vector<Field> Fields;
-        
-        void UpdateReportFromFields();
-        
-        void OnSubmit (wxCommandEvent & event);
-        void OnCancel (wxCommandEvent & event);
-        void OnDetails(wxCommandEvent & event);
-        void OnClose  (wxCloseEvent   & event);
+		FlushResult flush(wxEvtHandler &handler, unsigned concurrency,
+			const Report::RetryPolicy &retry, const Report::Timeouts &timeouts,
+			ConnectionCache *connections = nullptr) const;
 
-		void OnShow   (wxShowEvent & event);
-        
-        Report &report;
-        Fields  fields;
-		
-		wxFont fontTechnical;
+	private:
+		wxString _path(const wxString &entry, const char *extension) const;
+
+		wxString _dir;
+	};
 
-		wxCheckBox *dontShowAgainBox = nullptr;
-        
-        wxDECLARE_EVENT_TABLE();
-    };
-	
 	/*
-		This dialog allows a user to view a report's contents
+		An exclusive advisory lock on a file, which is created if needed.
+			The lock is released when this object is destroyed or the process exits.
 	*/
-	class ViewReport : public wxDialog
-    {
-    public:
-        enum EventTypes
-        {
-            Ev_Exit     = wxID_EXIT,
-            Ev_Done     = wxID_OK,
-			Ev_OpenFile = wxID_FILE,
-			Ev_OpenDir  = wxID_OPEN,
-        };
-        
-        ViewReport(wxWindow * parent, wxWindowID id);
-		virtual ~ViewReport();
-		
-		static bool Exists();
-        
-    private:
-        void OnDone    (wxCommandEvent & event);
-		void OnOpenFile(wxCommandEvent & event);
-		void OnOpenDir (wxCommandEvent & event);
-        void OnClose   (wxCloseEvent   & event);
-		
-		wxFont fontTechnical;
-        
-        wxDECLARE_EVENT_TABLE();
-    };
+	class FileLock
+	{
+	public:
+		FileLock() {}
+		~FileLock()    {unlock();}
+
+		FileLock(const FileLock&) = delete;
+		FileLock &operator=(const FileLock&) = delete;
+
+		// Take the lock, waiting for other holders unless `wait` is false.
+		bool lock(const wxString &path, bool wait = true);
+		void unlock();
+
+		bool locked() const    {return _handle != -1;}
+
+	private:
+		intptr_t _handle = -1; // File descriptor or HANDLE
+	};
 
 	/*
-		Non-modal Dialogs integrated with Tattle's workflow.
-			May be "OK" or "Open Link / Cancel" dialogs.
+		Coordinates instances of tattle sending the same kind of report, eg. in a crash storm.
+			One instance leads and sends the report, along with a count of occurrences.
+			Other instances add to the count; up to maxInstances-1 of them stand by
+			to take over if the leader dies, and the rest exit straight away.
+			Lock files live in the directory given by path.locks.
 	*/
-	class InfoDialog : public wxDialog
+	class Admission
 	{
 	public:
-		/*
-			Create a Tattle dialog.
-				- Specified title and message, with "OK" button
-				- Optionally specify a link
-				- Uses styling from uiConfig
-				- Calls Tattle_Proceed / Tattle_Halt when done, depending on server command:
-					- NONE:         proceed as usual
-					- PROMPT:       return to prompt if applicable, else proceed
-					- STOP:         always halt
-					- STOP_ON_LINK: halt when following link, else proceed
-		*/
-		InfoDialog(wxWindow *parent,
-			wxString title,
-			wxString message,
-			wxString link = wxString(),
-			Report::SERVER_COMMAND command = Report::SC_NONE,
-			wxArtID iconArtID = "",
-			Report::Identifier dontShowAgainID = {});
+		Admission(const wxString &dir, const Report::Identifier &id);
 
-	protected:
-		void Done();
+		// If leading, resolves the occurrences counted so far; see reported().
+		~Admission();
 
-		void OpenLink();
+		// Returns true if this instance should send the report, or false to exit.
+		bool enter(unsigned maxInstances, int waitSeconds);
 
-		void OnOk(wxCommandEvent &evt);
-		void OnLink(wxHyperlinkEvent &evt);
-		void OnOpen(wxCommandEvent &evt);
-		void OnCancel(wxCommandEvent &evt);
+		// Occurrences to report, including this one.
+		unsigned occurrences() const;
 
-		void OnClose(wxCloseEvent &evt);
+		// The report was sent with `count` occurrences; later ones are kept for the next report.
+		//   If the leader exits without calling this, all counted occurrences are dropped.
+		void reported(unsigned count)    {_reported = count; _hasReported = true;}
 
-		wxDECLARE_EVENT_TABLE();
+	private:
+		struct Tally {unsigned pending = 0, generation = 0;};
+		Tally _read() const;
+		void  _write(const Tally &tally) const;
 
-	protected:
-		Report::SERVER_COMMAND command;
+		wxString _path(const wxString &suffix) const;
 
-		wxString link;
-		int      styleBase;
+		wxString _dir, _key;
+		FileLock _leader, _slot;
+		bool     _counted = false, _hasReported = false;
+		unsigned _reported = 0;
+	};
 
-		Report::Identifier dontShowAgainID;
-		wxCheckBox *dontShowAgainBox = nullptr;
+	/*
+		A query which runs while the event loop carries on, eg. with the prompt open.
+			Its events are dispatched by the running loop, and `done` is called once,
+			on the main thread, with the reply.  The query is cancelled if it outlasts
+			its connect and reply timeouts together (or timeout.total), or if the
+			task is destroyed first.
+	*/
+	class QueryTask
+	{
+	public:
+		using Callback = std::function<void(Report::Reply &reply)>;
+
+		QueryTask(const Report &report, wxEvtHandler &handler, PersistentData *state, Callback done);
+		~QueryTask();
+
+		QueryTask(const QueryTask&) = delete;
+		QueryTask &operator=(const QueryTask&) = delete;
 
-		bool     didAction;
-		bool     overrideCommand;
+		bool running() const    {return _running;}
+
+	private:
+		void _onState  (wxWebRequestEvent &event);
+		void _onTimeout(wxTimerEvent &event);
+		void _finish   (wxWebRequest::State state);
+
+		const Report    &_report;
+		wxEvtHandler    &_handler;
+		PersistentData  *_state;
+		ConnectionCache *_connections;
+		Callback         _done;
+
+		Report::QueryValidator _validator;
+		wxWebRequest           _request;
+		wxTimer                _timer;
+		bool                   _running = false;
 	};
-	
+
+	/*
+		Opens a connection to a server ahead of a request, eg. while the prompt is shown.
+			A HEAD request is made to the root of the URL's server and its response
+			discarded; the shared WebSession() keeps the connection, so a request to
+			the same host soon after skips the DNS lookup and the TCP and TLS
+			handshakes.  No report data is sent, and the URL's own path is not requested.
+			The address found is noted in `connections`, if given.
+			`done` is called on the main thread with whether the server answered.
+	*/
+	class Preconnect
+	{
+	public:
+		using Callback = std::function<void(bool connected)>;
+
+		Preconnect(wxEvtHandler &handler, const Report::ParsedURL &url, int timeoutSeconds,
+			ConnectionCache *connections, Callback done = Callback());
+		~Preconnect();
+
+		Preconnect(const Preconnect&) = delete;
+		Preconnect &operator=(const Preconnect&) = delete;
+
+		bool running() const    {return _running;}
+
+	private:
+		void _onState  (wxWebRequestEvent &event);
+		void _onTimeout(wxTimerEvent &event);
+		void _finish   (bool connected);
+
+		wxEvtHandler    &_handler;
+		ConnectionCache *_connections;
+		Callback         _done;
+		wxWebRequest     _request;
+		wxTimer          _timer;
+		bool             _running = false;
+	};
+
+	/*
+	*	Storage file for user input, user consent and server cookies.
+	*/
+	struct PersistentData
+	{
+	public:
+		const Json &data;
+
+		// Addresses and sessions for requests made on behalf of this state; see LoadConnectionCache().
+		ConnectionCache connections;
+
+		PersistentData();
+
+
+		bool shouldShow(const Report::Identifier &id) const    {return JsonFetch(data, JsonPointer("/$show/"+id.type+"/"+id.id), 1) != 0;}
+
+		/*
+			Dedupe of repeated reports, recorded under $sent by Report::dedupe_key().
+				Reports suppressed within the window are counted, and the count is
+				sent with the next report which goes out.
+		*/
+		bool     sentRecently   (const std::string &key, int windowSeconds) const;
+		unsigned suppressedCount(const std::string &key) const;
+		bool     countSuppressed(const std::string &key, unsigned occurrences = 1);
+		bool     markSent       (const std::string &key, unsigned flushedCount);
+
+
+		/*
+			Updates are appended to a journal and applied under a file lock,
+				so concurrent instances do not lose each other's changes.
+				update() computes its patch from the latest data, eg. to increment a count.
+		*/
+		bool load      (wxString path, bool binary = false); // Written as CBOR if binary, else JSON
+		bool mergePatch(const Json &patch);
+		bool update    (const std::function<Json(const Json &data)> &makePatch);
+
+		// Fold the journal into the state file.  This also happens as the journal grows.
+		bool compact();
+
+		/*
+			Drop expired entries, then the least recently updated beyond maxEntries (0 = no limit),
+				and compact if anything changed or the journal is large.  Entries without a
+				TTL of their own use defaultTTL seconds (0 = never expire).
+				This bounds the cost of load(); call it when nothing is waiting on Tattle.
+		*/
+		bool maintain(size_t maxEntries, long long defaultTTL);
+
+	private:
+		bool _sync(bool baseFresh); // Apply changes journaled since the last sync
+		bool _append(const Json &patch);
+		bool _compact();
+
+		wxString    _path;
+		Json        _data;
+		std::string _journalId;
+		size_t      _journalOffset = 0;
+		bool        _binary = false;
+	};
+
 	// Utility functions
 	wxString GetTagContents(const wxString &reply, const wxString &tagName);
-	
-	class TattleApp;
 }
 
 #endif /* tattle_h */
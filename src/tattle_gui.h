@@ -0,0 +1,253 @@
+//
+//  tattle_gui.h
+//  tattle
+//
+
+#ifndef tattle_gui_h
+#define tattle_gui_h
+
+#include "tattle.h"
+
+#include <wx/dialog.h>
+#include <wx/textctrl.h>
+#include <wx/checkbox.h>
+#include <wx/sizer.h>
+#include <wx/stattext.h>
+#include <wx/msgdlg.h>
+#include <wx/artprov.h>
+#include <wx/hyperlink.h>
+#include <wx/progdlg.h>
+
+
+namespace tattle
+{
+	/*
+	*	An interface to GUI configuration values.
+	*/
+	struct UIConfig
+	{
+		UIConfig(const Report &report);
+
+		const Report &report;
+
+		const config::CommandText &text() const    {return report.settings().text;}
+		const config::CommandGui  &gui () const    {return report.settings().gui;}
+
+		const std::string &promptTitle     () const    {return text().prompt.title;}
+		const std::string &promptMessage   () const    {return text().prompt.message;}
+		const std::string &promptTechnical () const    {return report.settings().report.summary;}
+		const std::string &labelPrompt     () const    {return text().prompt.hint;}
+		const std::string &labelSend       () const    {return text().prompt.btn_send;}
+		const std::string &labelCancel     () const    {return text().prompt.btn_cancel;}
+		const std::string &labelReview     () const    {return text().prompt.btn_review;}
+		const std::string &labelHaltReports() const    {return text().halt_reports;}
+
+		bool stayOnTop   () const    {return gui().stay_on_top;}
+		bool enableReview() const    {return gui().prompt.review;}
+		bool showProgress() const    {return gui().progress_bar;}
+		bool silentQuery () const    {return gui().query == "silent";}
+		bool silentPost  () const    {return gui().post  == "silent";}
+
+		bool concurrentQuery() const    {return gui().concurrent_query;}
+
+		const std::vector<std::string> &inputOrder() const    {return gui().prompt.input_order;}
+
+		// Margin sizes.
+		unsigned marginSm() const;
+		unsigned marginMd() const;
+		unsigned marginLg() const;
+
+		// Tattle icon name; see GetIconArtID.
+		const std::string &defaultIcon() const    {return gui().icon;}
+
+
+		int style() const
+		{
+			return (stayOnTop() ? wxSTAY_ON_TOP : 0);
+		}
+	};
+
+	/*
+		Globally shared report state and UI configuration.
+			Only one report is made per invocation of Tattle.
+	*/
+	extern       PersistentData &persist;
+	extern const Report         &report;
+	extern const UIConfig       &uiConfig;
+
+	class TattleApp;
+
+	/*
+		Workflow control calls
+	*/
+	void Tattle_Proceed();
+	void Tattle_ShowPrompt();
+	void Tattle_InsertDialog(wxWindow *dialog);
+	void Tattle_DisposeDialog(wxWindow *dialog);
+	void Tattle_Halt();
+
+	// Map a Tattle icon name ("information", "warning", "error"...) to a wxArtID.
+	wxArtID GetIconArtID(const wxString &tattleName);
+
+	/*
+		A progress dialog for HTTP requests, styled according to uiConfig.
+			A stay-on-top parent window is hidden while the dialog exists.
+	*/
+	class ProgressDialog : public ProgressSink
+	{
+	public:
+		ProgressDialog(const wxString &title, const wxString &message, wxEvtHandler &parent);
+		~ProgressDialog() wxOVERRIDE;
+
+		void update(int percent, const wxString &message = wxString()) wxOVERRIDE;
+
+	private:
+		static wxWindow *HideParent(wxEvtHandler &parent);
+
+		wxWindow        *_hiddenParent;
+		wxProgressDialog _dialog;
+	};
+
+    /*
+		A prompt window which allows the user to enter data and submit the report.
+    */
+    class Prompt : public wxDialog
+    {
+    public:
+        enum EventTypes
+        {
+            Ev_Exit    = wxID_EXIT,
+            Ev_Cancel  = wxID_CANCEL,
+            Ev_Submit  = wxID_FORWARD,
+            Ev_Details = wxID_INFO,
+        };
+        
+        Prompt(wxWindow * parent, wxWindowID id, Report &report);
+		~Prompt() wxOVERRIDE;
+		
+		/*
+			Create a dialog box describing a server's reply.
+				Returns true if the user followed a link.
+		*/
+		static wxWindow *DisplayReply(const Report::Reply &reply, wxWindow *parent = NULL);
+
+		// Show a query's reply above the fields, replacing any shown before.
+		void ShowReply(const Report::Reply &reply);
+
+		// Show the connection warning, eg. when the server can't be reached.
+		void ShowConnectionWarning();
+        
+    private:
+        struct Field
+        {
+            size_t      content; // Index in report.contents()
+            wxTextCtrl *control;
+        };
+        typedef std::vector<Field> Fields;
+        
+        void UpdateReportFromFields();
+        
+        void OnSubmit (wxCommandEvent & event);
+        void OnCancel (wxCommandEvent & event);
+        void OnDetails(wxCommandEvent & event);
+        void OnClose  (wxCloseEvent   & event);
+
+		void OnShow   (wxShowEvent & event);
+        
+        Report &report;
+        Fields  fields;
+		
+		wxFont fontTechnical;
+
+		wxCheckBox *dontShowAgainBox = nullptr;
+		wxBoxSizer *replyArea        = nullptr;
+		wxStaticText *connectionWarningText = nullptr;
+        
+        wxDECLARE_EVENT_TABLE();
+    };
+	
+	/*
+		This dialog allows a user to view a report's contents
+	*/
+	class ViewReport : public wxDialog
+    {
+    public:
+        enum EventTypes
+        {
+            Ev_Exit     = wxID_EXIT,
+            Ev_Done     = wxID_OK,
+			Ev_OpenFile = wxID_FILE,
+			Ev_OpenDir  = wxID_OPEN,
+        };
+        
+        ViewReport(wxWindow * parent, wxWindowID id);
+		virtual ~ViewReport();
+		
+		static bool Exists();
+        
+    private:
+        void OnDone    (wxCommandEvent & event);
+		void OnOpenFile(wxCommandEvent & event);
+		void OnOpenDir (wxCommandEvent & event);
+        void OnClose   (wxCloseEvent   & event);
+		
+		wxFont fontTechnical;
+        
+        wxDECLARE_EVENT_TABLE();
+    };
+
+	/*
+		Non-modal Dialogs integrated with Tattle's workflow.
+			May be "OK" or "Open Link / Cancel" dialogs.
+	*/
+	class InfoDialog : public wxDialog
+	{
+	public:
+		/*
+			Create a Tattle dialog.
+				- Specified title and message, with "OK" button
+				- Optionally specify a link
+				- Uses styling from uiConfig
+				- Calls Tattle_Proceed / Tattle_Halt when done, depending on server command:
+					- NONE:         proceed as usual
+					- PROMPT:       return to prompt if applicable, else proceed
+					- STOP:         always halt
+					- STOP_ON_LINK: halt when following link, else proceed
+		*/
+		InfoDialog(wxWindow *parent,
+			wxString title,
+			wxString message,
+			wxString link = wxString(),
+			Report::SERVER_COMMAND command = Report::SC_NONE,
+			wxArtID iconArtID = "",
+			Report::Identifier dontShowAgainID = {});
+
+	protected:
+		void Done();
+
+		void OpenLink();
+
+		void OnOk(wxCommandEvent &evt);
+		void OnLink(wxHyperlinkEvent &evt);
+		void OnOpen(wxCommandEvent &evt);
+		void OnCancel(wxCommandEvent &evt);
+
+		void OnClose(wxCloseEvent &evt);
+
+		wxDECLARE_EVENT_TABLE();
+
+	protected:
+		Report::SERVER_COMMAND command;
+
+		wxString link;
+		int      styleBase;
+
+		Report::Identifier dontShowAgainID;
+		wxCheckBox *dontShowAgainBox = nullptr;
+
+		bool     didAction;
+		bool     overrideCommand;
+	};
+}
+
+#endif /* tattle_gui_h */
@@ -0,0 +1,19 @@
+//
+//  ui_config.cpp
+//  tattle
+//
+
+#include "tattle_gui.h"
+
+
+using namespace tattle;
+
+
+UIConfig::UIConfig(const Report &_report) :
+	report(_report)
+{
+}
+
+unsigned UIConfig::marginSm() const    {return unsigned(gui().margin_small);}
+unsigned UIConfig::marginMd() const    {return unsigned(gui().margin_medium);}
+unsigned UIConfig::marginLg() const    {return unsigned(gui().margin_large);}
@@ -5,7 +5,7 @@
 //  Created by Evan Balster on 11/25/16.
 //
 
-#include "tattle.h"
+#include "tattle_gui.h"
 
 //Dialog stuff
 #include <wx/button.h>
@@ -40,20 +40,31 @@ ViewReport::~ViewReport()
 	--ViewReportCount;
 }
 
-static void ContentDump(wxString &dump, const Report::Content *content)
+// Dumps are built as UTF-8 and converted once, as reports may hold thousands of strings.
+static void ContentDump(std::string &dump, const Report::Content &content)
 {
+	const std::string &value = content.value();
+
+	if (dump.length()) dump += '\n';
+
 	// Special handling for fields with newlines
-	if (content->value().length() > 35 || content->value().find_first_of("\r\n") != wxString::npos)
+	if (value.length() > 35 || value.find_first_of("\r\n") != std::string::npos)
 	{
-		wxString valueIndent = content->value();
-		valueIndent.Replace(wxString("\n"), wxString("\n| "));
-		dump += content->name + wxT(":\n| ") + valueIndent;
+		dump += content.name;
+		dump += ":\n| ";
+		for (char c : value)
+		{
+			dump += c;
+			if (c == '\n') dump += "| ";
+		}
 	}
 	else
 	{
-		wxString label = content->name+wxT(": ");
-		if (label.length() < 20) label.Append(' ', size_t(20-label.length()));
-		dump += label + content->value();
+		size_t start = dump.length();
+		dump += content.name;
+		dump += ": ";
+		if (dump.length() - start < 20) dump.append(20 - (dump.length() - start), ' ');
+		dump += value;
 	}
 }
 
@@ -76,41 +87,28 @@ ViewReport::ViewReport(wxWindow * parent, wxWindowID id)
 	
 	// List string arguments
 	{
-		wxString argDump;
-		
-		bool preQueryNote = report.url_query().isSet();
+		std::string queryDump, argDump;
 		
-		bool first = true;
+		const bool preQueryNote = report.url_query().isSet();
 		
-		if (preQueryNote)
-			for (auto i = report.contents().begin(); i != report.contents().end(); ++i)
+		for (auto &content : report.contents())
 		{
-			if (i->type != PARAM_STRING) continue;
-			
-			if (!i->preQuery) continue;
+			if (content.type != PARAM_STRING) continue;
 			
-			if (first)
-			{
-				wxString queryLabel = (report.connectionWarning ?
-					wxT("We tried to use this info to check for solutions:") :
-					wxT("We already used this info to check for solutions:"));
-					
-				sizerTop->Add(
-					new wxStaticText(this, -1, queryLabel),
-					0, wxALL | wxALIGN_LEFT, MARGIN);
-				
-				first = false;
-			}
-			else argDump += wxT("\n");
-			
-			// Dump normal arguments
-			ContentDump(argDump, &*i);
+			ContentDump((preQueryNote && content.preQuery) ? queryDump : argDump, content);
 		}
 		
-		if (first) preQueryNote = false;
-		else
+		if (queryDump.length())
 		{
-			wxTextCtrl *queryDisplay = new wxTextCtrl(this, -1, argDump,
+			wxString queryLabel = (report.connectionWarning ?
+				wxT("We tried to use this info to check for solutions:") :
+				wxT("We already used this info to check for solutions:"));
+				
+			sizerTop->Add(
+				new wxStaticText(this, -1, queryLabel),
+				0, wxALL | wxALIGN_LEFT, MARGIN);
+			
+			wxTextCtrl *queryDisplay = new wxTextCtrl(this, -1, wxString::FromUTF8(queryDump),
 				wxDefaultPosition, wxSize(450, 125),
 				wxTE_MULTILINE|wxTE_READONLY|wxHSCROLL, wxDefaultValidator);
 			
@@ -123,44 +121,24 @@ ViewReport::ViewReport(wxWindow * parent, wxWindowID id)
 			
 			// Horizontal rule
 			sizerTop->Add(new wxStaticLine(this), 0, wxEXPAND | wxALL, MARGIN);
-			
-			argDump.Clear();
 		}
 		
-		first = true;
-		
-		for (auto i = report.contents().begin(); i != report.contents().end(); ++i)
+		if (argDump.length())
 		{
-			if (i->type != PARAM_STRING) continue;
-			
-			if (preQueryNote && i->preQuery) continue;
-			
-			if (first)
+			wxString queryLabel = wxT("The full report below is only sent if you choose");
+			if (uiConfig.labelSend().length())
 			{
-				wxString queryLabel = wxT("The full report below is only sent if you choose");
-				if (uiConfig.labelSend().length())
-				{
-					queryLabel.append(wxT(" `"));
-					queryLabel.append(uiConfig.labelSend());
-					queryLabel.append(wxT("'"));
-				}
-				queryLabel.append(wxT(":"));
-					
-				sizerTop->Add(
-					new wxStaticText(this, -1, queryLabel),
-					0, wxALL | wxALIGN_LEFT , MARGIN);
-				
-				first = false;
+				queryLabel.append(wxT(" `"));
+				queryLabel.append(uiConfig.labelSend());
+				queryLabel.append(wxT("'"));
 			}
-			else argDump += wxT("\n");
+			queryLabel.append(wxT(":"));
+				
+			sizerTop->Add(
+				new wxStaticText(this, -1, queryLabel),
+				0, wxALL | wxALIGN_LEFT , MARGIN);
 			
-			// Dump normal arguments
-			ContentDump(argDump, &*i);
-		}
-		
-		if (!first)
-		{
-			wxTextCtrl *argDisplay = new wxTextCtrl(this, -1, argDump,
+			wxTextCtrl *argDisplay = new wxTextCtrl(this, -1, wxString::FromUTF8(argDump),
 				wxDefaultPosition, wxSize(450, 150),
 				wxTE_MULTILINE|wxTE_READONLY|wxHSCROLL, wxDefaultValidator);
 			
@@ -183,9 +161,9 @@ ViewReport::ViewReport(wxWindow * parent, wxWindowID id)
 		
 		for (auto i = report.contents().begin(); i != report.contents().end(); ++i)
 		{
-			if (i->type != PARAM_FILE) continue;
+			if (i->type != PARAM_FILE && i->type != PARAM_DIR) continue;
 			
-			wxString shortName = i->path();
+			wxString shortName = i->location();
 			{
 				size_t p = shortName.find_last_of("\\/");
 				if (p != wxString::npos) shortName = shortName.substr(p+1);
@@ -210,7 +188,9 @@ ViewReport::ViewReport(wxWindow * parent, wxWindowID id)
 			wxButton *button = new wxButton(this, wxID_FILE, shortName,
 				wxDefaultPosition, wxDefaultSize, 0, wxDefaultValidator, i->name);
 
-			if (i->content_type() == "application/octet-stream")
+			if (i->type == PARAM_DIR)
+				button->SetBitmap(wxArtProvider::GetBitmap(wxART_FOLDER, wxART_BUTTON));
+			else if (i->content_type() == "application/octet-stream")
 				button->SetBitmap(wxArtProvider::GetBitmap(wxART_NORMAL_FILE, wxART_BUTTON));
 			else
 				button->SetBitmap(wxArtProvider::GetBitmap(wxART_HELP_PAGE, wxART_BUTTON));
@@ -271,8 +251,8 @@ void ViewReport::OnOpenFile(wxCommandEvent & event)
 	
 	if (window)
 	{
-		if (auto *content = report.findContent(window->GetName()))
-			wxLaunchDefaultApplication(OpenablePath(content->path()));
+		if (auto *content = report.findContent(std::string(window->GetName().ToUTF8())))
+			wxLaunchDefaultApplication(OpenablePath(content->location()));
 	}
 }
 
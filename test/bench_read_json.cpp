@@ -0,0 +1,96 @@
+//
+//  bench_read_json.cpp
+//  tattle
+//
+//  Times reading a JSON file with ReadJsonFile against the ways it was read
+//    before: through a wxString, and from a std::ifstream.
+//
+//  bench_read_json [file.json [iterations]]
+//    Without a file, a state file of 20000 entries is generated and used.
+//
+
+#include "tattle.h"
+
+#include <cstdlib>
+#include <fstream>
+
+#include <wx/init.h>
+#include <wx/file.h>
+#include <wx/filename.h>
+
+
+using namespace tattle;
+
+
+using BenchClock = std::chrono::steady_clock;
+
+// Average milliseconds per call of read, which returns whether it succeeded.
+static double Time(unsigned iterations, const std::function<bool()> &read)
+{
+	auto start = BenchClock::now();
+	for (unsigned i = 0; i < iterations; ++i)
+		if (!read()) return -1.0;
+	return std::chrono::duration<double, std::milli>(BenchClock::now() - start).count() / iterations;
+}
+
+static void Print(const char *name, double milliseconds)
+{
+	if (milliseconds < 0) std::cout << name << ": failed" << std::endl;
+	else                  std::cout << name << ": " << milliseconds << " ms" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+	wxInitializer initializer(argc, argv);
+	if (!initializer.IsOk()) return 1;
+
+	wxString path;
+	unsigned iterations = 20;
+	bool     generated = false;
+
+	if (argc > 1) path = wxString::FromUTF8(argv[1]);
+	if (argc > 2) iterations = std::max(1, std::atoi(argv[2]));
+
+	if (!path.length())
+	{
+		Json state = Json::object();
+		for (unsigned i = 0; i < 20000; ++i)
+			state["$sent"]["report-" + std::to_string(i)] = {{"time", 1700000000 + i}, {"note", "caf\xC3\xA9 \xE2\x9C\x93"}};
+
+		path = wxFileName::CreateTempFileName("tattle");
+		if (!path.length() || !WriteFileAtomic(path, state.dump(1, '\t'))) return 1;
+		generated = true;
+	}
+
+	std::cout << "Reading " << path << " " << iterations << " times" << std::endl;
+
+	Print("wxString", Time(iterations, [&]()
+	{
+		wxFile file(path);
+		wxString contents;
+		if (!file.IsOpened() || !file.ReadAll(&contents)) return false;
+
+		const auto text = contents.ToUTF8();
+		try         {Json::parse(text.data(), text.data() + text.length(), nullptr, true, true);}
+		catch (...) {return false;}
+		return true;
+	}));
+
+	Print("ifstream", Time(iterations, [&]()
+	{
+		std::ifstream stream(path.fn_str(), std::ios::binary);
+		try         {Json::parse(stream, nullptr, true, true);}
+		catch (...) {return false;}
+		return true;
+	}));
+
+	Print("ReadJsonFile", Time(iterations, [&]()
+	{
+		Json json;
+		std::string error;
+		return ReadJsonFile(path, json, error);
+	}));
+
+	if (generated) wxRemoveFile(path);
+	return 0;
+}
@@ -0,0 +1,66 @@
+//
+//  capture_truncation.cpp
+//  tattle
+//
+//  Captures a file by mapping it, truncates the file and reads the capture
+//    back as the encoders do.  The capture is a snapshot: it must still hold
+//    the file as it was, rather than faulting or following the truncation.
+//
+
+#include "tattle.h"
+
+#include <wx/init.h>
+#include <wx/file.h>
+#include <wx/filename.h>
+
+
+using namespace tattle;
+
+
+static int Fail(const char *what)
+{
+	std::cerr << "capture_truncation: " << what << std::endl;
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	wxInitializer initializer(argc, argv);
+	if (!initializer.IsOk()) return Fail("could not initialize wxWidgets");
+
+	const size_t length = 1 << 20, kept = 4000;
+
+	std::string contents(length, '\0');
+	for (size_t i = 0; i < length; ++i) contents[i] = char('a' + i % 26);
+
+	wxString path = wxFileName::CreateTempFileName("tattle");
+	if (!path.length() || !WriteFileAtomic(path, contents)) return Fail("could not write the file");
+
+	FileViews views;
+	CaptureFile(views, path, 0, 0, std::string(), true, 0);
+
+	int result = 0;
+	if (views.size() != 1 || !views[0].mapping) result = Fail("the file was not mapped");
+
+	// Truncate the file, then keep only its first bytes.
+	if (!result)
+	{
+		wxFile file(path, wxFile::write);
+		if (!file.IsOpened() || file.Write(contents.data(), kept) != kept) result = Fail("could not truncate the file");
+	}
+
+	if (!result)
+	{
+		const char *data = views[0].data();
+		const size_t size = views[0].size();
+
+		if (size != length)
+			result = Fail("the capture changed length");
+		else if (std::string(data, size) != contents)
+			result = Fail("the captured data changed");
+	}
+
+	views.clear();
+	wxRemoveFile(path);
+	return result;
+}
@@ -0,0 +1,192 @@
+#!/usr/bin/env python3
+"""
+Reference server for Tattle's chunked upload protocol (see Upload-Protocol.md).
+
+	python3 test/upload_server.py [--port 8080] [--dir uploads] [--fail 0.1]
+
+Point a command file at it with:
+
+	"service" : {
+		"url"    : {"prefix" : "http://localhost:8080/", "post" : "post", "upload" : "upload"},
+		"upload" : {"threshold" : 1048576, "chunk_size" : 262144, "parallel" : 4}
+	}
+
+Chunks are written to <dir>/<upload id>.part, and the byte ranges received for each
+upload are tracked in memory.  Posts are printed, with each upload reference checked
+against the assembled file once its chunks cover the whole of it.  A HEAD with an
+Upload-Id answers with the upload's Upload-Offset, or 404 if it is unknown.  --fail
+drops a share of chunk requests with a 503 (or corrupts them, answering 422) to
+exercise retries.
+"""
+
+import argparse
+import email.parser
+import email.policy
+import json
+import os
+import random
+import re
+import sys
+import threading
+import zlib
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+
+UPLOAD_TYPE = "application/x-tattle-upload+json"
+ID_PATTERN  = re.compile(r"^[0-9A-Za-z-]{1,64}$")
+
+
+def add_range(ranges, begin, end):
+	"""Add [begin, end) to a sorted list of disjoint ranges, merging any it meets."""
+	merged = []
+	for first, last in ranges:
+		if last < begin or first > end: merged.append((first, last))
+		else: begin, end = min(begin, first), max(end, last)
+	merged.append((begin, end))
+	merged.sort()
+	return merged
+
+
+def covers(ranges, total):
+	return total == 0 or ranges == [(0, total)]
+
+
+class Handler(BaseHTTPRequestHandler):
+	protocol_version = "HTTP/1.1"
+
+	def _reply(self, status, text=""):
+		body = text.encode("utf-8")
+		self.send_response(status)
+		self.send_header("Content-Type", "text/plain; charset=utf-8")
+		self.send_header("Content-Length", str(len(body)))
+		self.end_headers()
+		self.wfile.write(body)
+
+	def _body(self):
+		length = int(self.headers.get("Content-Length", "0"))
+		data = self.rfile.read(length)
+		encoding = self.headers.get("Content-Encoding", "")
+		if encoding == "gzip":    data = zlib.decompress(data, 16 + zlib.MAX_WBITS)
+		if encoding == "deflate": data = zlib.decompress(data)
+		return data
+
+	def do_HEAD(self):
+		upload_id = self.headers.get("Upload-Id", "")
+		with self.server.lock:
+			received = self.server.received.get(upload_id)
+		if received is None:
+			return self._reply(404)
+
+		# The offset is the end of the bytes received with no gaps before it.
+		length, ranges = received
+		offset = ranges[0][1] if ranges and ranges[0][0] == 0 else 0
+
+		self.send_response(200)
+		self.send_header("Upload-Offset", str(offset))
+		self.send_header("Upload-Length", str(length))
+		self.send_header("Content-Length", "0")
+		self.end_headers()
+
+	def do_PUT(self):
+		data = self._body()
+
+		upload_id = self.headers.get("Upload-Id", "")
+		try:
+			offset = int(self.headers.get("Upload-Offset", ""))
+			total  = int(self.headers.get("Upload-Length", ""))
+		except ValueError:
+			return self._reply(400, "bad offset or length\n")
+		if not ID_PATTERN.match(upload_id) or offset < 0 or offset + len(data) > total:
+			return self._reply(400, "bad upload id or range\n")
+
+		if random.random() < self.server.fail_rate:
+			if random.random() < 0.5: return self._reply(503, "simulated failure\n")
+			data = bytes([data[0] ^ 0xFF]) + data[1:] if data else data
+
+		checksum = self.headers.get("Upload-Checksum", "")
+		if checksum != "crc32=%08x" % zlib.crc32(data):
+			return self._reply(422, "checksum mismatch\n")
+
+		path = os.path.join(self.server.directory, upload_id + ".part")
+		with self.server.lock:
+			length, ranges = self.server.received.get(upload_id, (total, []))
+			if length != total:
+				return self._reply(400, "upload length changed\n")
+
+			mode = "r+b" if os.path.exists(path) and ranges else "w+b"
+			with open(path, mode) as f:
+				f.seek(offset)
+				f.write(data)
+
+			if data: ranges = add_range(ranges, offset, offset + len(data))
+			self.server.received[upload_id] = (total, ranges)
+
+		self._reply(204)
+
+	def do_POST(self):
+		data = self._body()
+
+		header = "Content-Type: %s\r\n\r\n" % self.headers.get("Content-Type", "")
+		message = email.parser.BytesParser(policy=email.policy.HTTP).parsebytes(header.encode("utf-8") + data)
+		if not message.is_multipart():
+			return self._reply(400, "expected multipart/form-data\n")
+
+		print("POST %s (Idempotency-Key %s)" % (self.path, self.headers.get("Idempotency-Key", "-")))
+
+		for part in message.iter_parts():
+			name = part.get_param("name", header="content-disposition")
+			body = part.get_payload(decode=True) or b""
+
+			if part.get_content_type() != UPLOAD_TYPE:
+				print("  %s: %d bytes" % (name, len(body)))
+				continue
+
+			ref = json.loads(body)
+			upload_id = ref.get("upload_id", "")
+			path = os.path.join(self.server.directory, upload_id + ".part")
+			with self.server.lock:
+				received = self.server.received.get(upload_id)
+			if not ID_PATTERN.match(upload_id) or received is None or not os.path.exists(path):
+				return self._reply(400, "unknown upload for %s\n" % name)
+
+			# Chunks may arrive in any order; every byte must have been received.
+			length, ranges = received
+			if length != ref.get("size") or not covers(ranges, length):
+				return self._reply(400, "incomplete upload for %s\n" % name)
+
+			with open(path, "rb") as f: assembled = f.read()
+			if len(assembled) != ref.get("size") or "%08x" % zlib.crc32(assembled) != ref.get("crc32"):
+				return self._reply(400, "corrupt upload for %s\n" % name)
+
+			print("  %s: %d bytes uploaded as %s" % (name, len(assembled), ref["upload_id"]))
+
+		self._reply(200, "Report received.\n")
+
+	def log_message(self, format, *args):
+		sys.stderr.write((format % args) + "\n")
+
+
+def main():
+	parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+	parser.add_argument("--port", type=int, default=8080)
+	parser.add_argument("--dir", default="uploads")
+	parser.add_argument("--fail", type=float, default=0.0, help="share of chunks to reject")
+	args = parser.parse_args()
+
+	os.makedirs(args.dir, exist_ok=True)
+
+	server = ThreadingHTTPServer(("localhost", args.port), Handler)
+	server.directory = args.dir
+	server.fail_rate = args.fail
+	server.lock      = threading.Lock()
+	server.received  = {} # (length, received ranges) by upload id
+
+	print("Listening on http://localhost:%d/ (uploads in %s)" % (args.port, args.dir))
+	try:
+		server.serve_forever()
+	except KeyboardInterrupt:
+		pass
+
+
+if __name__ == "__main__":
+	main()